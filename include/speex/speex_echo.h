@@ -59,6 +59,43 @@ extern "C" {
 /** Get impulse response (int32[]) */
 #define SPEEX_ECHO_GET_IMPULSE_RESPONSE 29
 
+/** Set the number of worker threads that share the work of each frame with
+    the caller (int, default 0). The output is the same for any number of
+    threads; this only helps with several microphones or speakers. If the
+    threads can't all be started, speex_echo_ctl() returns -1 and the
+    previous ones are kept. */
+#define SPEEX_ECHO_SET_THREADS 30
+/** Get the number of worker threads (int) */
+#define SPEEX_ECHO_GET_THREADS 31
+
+/** Set sparse mode (int, default 0). Only once the filter has adapted to
+    an echo, the partitions at both ends that hold almost none of its energy
+    get zero weights and are left out of the filtering and the adaptation,
+    except on one frame out of 8 where the whole filter adapts, so that a
+    change of the echo path is still followed. This saves CPU on long filters
+    whose echo path is much shorter. No effect with
+    speex_echo_state_init_partitioned(). */
+#define SPEEX_ECHO_SET_SPARSE 32
+/** Get sparse mode (int) */
+#define SPEEX_ECHO_GET_SPARSE 33
+
+/** Set the longest bulk delay between the far end and its echo to look for,
+    in samples (int, default 0 for none). The far end is then delayed by the
+    delay found before it reaches the filter, so filter_length only has to
+    cover the echo tail. Best set before the first frame; setting it starts
+    the search over. speex_echo_ctl() returns -1 for more than 1048576. */
+#define SPEEX_ECHO_SET_DELAY_SEARCH 34
+/** Get the longest bulk delay looked for, in samples (int) */
+#define SPEEX_ECHO_GET_DELAY_SEARCH 35
+/** Get the bulk delay the far end is currently delayed by, in samples (int) */
+#define SPEEX_ECHO_GET_DELAY 36
+
+/** Get the number of frames the filter did not adapt on because the far end
+    had been silent for longer than the filter (int32). The output of these
+    frames is still computed with the filter as it is. Only
+    speex_echo_state_reset() sets it back to 0. */
+#define SPEEX_ECHO_GET_SKIPPED_FRAMES 37
+
 /** Internal echo canceller state. Should never be accessed directly. */
 struct SpeexEchoState_;
 
@@ -85,6 +122,29 @@ SpeexEchoState *speex_echo_state_init(int frame_size, int filter_length);
  */
 SpeexEchoState *speex_echo_state_init_mc(int frame_size, int filter_length, int nb_mic, int nb_speakers);
 
+/** Creates a new multi-channel echo canceller state whose filter is split
+ * into partitions of frame_size for its first max_block samples, and into
+ * partitions of max_block for the rest. The delay stays that of frame_size.
+ * The rest of the filter costs about as much as with frames of max_block,
+ * but the first max_block samples cost about as much again, as every frame
+ * still needs its own FFTs: the whole filter costs about twice as much as
+ * with frames of max_block, and only less than with frames of frame_size
+ * when frame_size is much shorter. For a 6400-sample filter at 16 kHz,
+ * frame_size 80 with max_block 640 costs 0.9 times as much as frames of 80
+ * (0.65 in fixed-point), and 1.8 times (2.1) as much as frames of 640, while
+ * frame_size 160 with max_block 640 costs 1.3 times (1.0) as much as frames
+ * of 160.
+ * @param frame_size Number of samples to process at one time (can be as short as 2-5 ms)
+ * @param filter_length Number of samples of echo to cancel (should generally correspond to 100-500 ms)
+ * @param nb_mic Number of microphone channels
+ * @param nb_speakers Number of speaker channels
+ * @param max_block Size of the longest partitions, rounded down to frame_size
+ * times a power of two (e.g. 4*frame_size). frame_size gives the same filter as
+ * speex_echo_state_init_mc().
+ * @return Newly-created echo canceller state
+ */
+SpeexEchoState *speex_echo_state_init_partitioned(int frame_size, int filter_length, int nb_mic, int nb_speakers, int max_block);
+
 /** Destroys an echo canceller state
  * @param st Echo canceller state
 */
@@ -132,6 +192,52 @@ void speex_echo_state_reset(SpeexEchoState *st);
 int speex_echo_ctl(SpeexEchoState *st, int request, void *ptr);
 
 
+struct SpeexEchoBatch_;
+
+/** Context for running many independent echo cancellers together */
+typedef struct SpeexEchoBatch_ SpeexEchoBatch;
+
+/** One frame of one echo canceller, for speex_echo_batch_process(). The
+ * fields are the arguments of speex_echo_cancellation(). */
+typedef struct SpeexEchoJob {
+   SpeexEchoState *st;
+   const spx_int16_t *rec;
+   const spx_int16_t *play;
+   spx_int16_t *out;
+} SpeexEchoJob;
+
+/** What speex_echo_batch_process() reports about a call */
+typedef struct SpeexEchoBatchStats {
+   spx_uint32_t wall_time; /**< Time spent in the call, in microseconds (0 if no clock is available) */
+   spx_uint32_t stolen;    /**< Jobs run by another thread than the one they were queued on */
+} SpeexEchoBatchStats;
+
+/** Create a context for running many independent echo cancellers in one call
+ * @param nb_threads Number of worker threads to start, in addition to the
+ * thread calling speex_echo_batch_process(). 0 processes everything on the
+ * calling thread. Ignored when built without thread support.
+ * @return Newly created batch context, or NULL on error
+ */
+SpeexEchoBatch *speex_echo_batch_init(int nb_threads);
+
+/** Destroy a batch context and stop its worker threads
+ * @param batch Batch context
+ */
+void speex_echo_batch_destroy(SpeexEchoBatch *batch);
+
+/** Run one frame of each job, spread over the threads of the batch. A state
+ * goes back to the thread that ran it the previous time unless that thread
+ * has more than its share of the jobs, and threads that run out of jobs take
+ * some from the others. A state may appear in at most one job of a call.
+ * @param batch Batch context
+ * @param jobs Array of jobs
+ * @param nb_jobs Number of jobs
+ * @param stats Returns the wall time of the call and how many jobs moved
+ * between threads, may be NULL
+ */
+void speex_echo_batch_process(SpeexEchoBatch *batch, SpeexEchoJob *jobs, int nb_jobs, SpeexEchoBatchStats *stats);
+
+
 
 struct SpeexDecorrState_;
 
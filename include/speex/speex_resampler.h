@@ -61,10 +61,28 @@
 #define speex_resampler_process_int CAT_PREFIX(RANDOM_PREFIX,_resampler_process_int)
 #define speex_resampler_process_interleaved_float CAT_PREFIX(RANDOM_PREFIX,_resampler_process_interleaved_float)
 #define speex_resampler_process_interleaved_int CAT_PREFIX(RANDOM_PREFIX,_resampler_process_interleaved_int)
+#define speex_resampler_process_format CAT_PREFIX(RANDOM_PREFIX,_resampler_process_format)
+#define speex_resampler_process_interleaved_format CAT_PREFIX(RANDOM_PREFIX,_resampler_process_interleaved_format)
+#define speex_resampler_process_interleaved_parallel CAT_PREFIX(RANDOM_PREFIX,_resampler_process_interleaved_parallel)
+#define speex_resampler_set_input_func CAT_PREFIX(RANDOM_PREFIX,_resampler_set_input_func)
+#define speex_resampler_pull_format CAT_PREFIX(RANDOM_PREFIX,_resampler_pull_format)
+#define speex_resampler_pull_float CAT_PREFIX(RANDOM_PREFIX,_resampler_pull_float)
+#define speex_resampler_pull_int CAT_PREFIX(RANDOM_PREFIX,_resampler_pull_int)
+#define speex_resampler_batch_init CAT_PREFIX(RANDOM_PREFIX,_resampler_batch_init)
+#define speex_resampler_batch_destroy CAT_PREFIX(RANDOM_PREFIX,_resampler_batch_destroy)
+#define speex_resampler_batch_process_int CAT_PREFIX(RANDOM_PREFIX,_resampler_batch_process_int)
+#define speex_resampler_batch_process_float CAT_PREFIX(RANDOM_PREFIX,_resampler_batch_process_float)
+#define speex_resampler_process_offline CAT_PREFIX(RANDOM_PREFIX,_resampler_process_offline)
 #define speex_resampler_set_rate CAT_PREFIX(RANDOM_PREFIX,_resampler_set_rate)
 #define speex_resampler_get_rate CAT_PREFIX(RANDOM_PREFIX,_resampler_get_rate)
 #define speex_resampler_set_rate_frac CAT_PREFIX(RANDOM_PREFIX,_resampler_set_rate_frac)
 #define speex_resampler_get_ratio CAT_PREFIX(RANDOM_PREFIX,_resampler_get_ratio)
+#define speex_resampler_set_asrc CAT_PREFIX(RANDOM_PREFIX,_resampler_set_asrc)
+#define speex_resampler_get_asrc CAT_PREFIX(RANDOM_PREFIX,_resampler_get_asrc)
+#define speex_resampler_set_interleaved CAT_PREFIX(RANDOM_PREFIX,_resampler_set_interleaved)
+#define speex_resampler_get_interleaved CAT_PREFIX(RANDOM_PREFIX,_resampler_get_interleaved)
+#define speex_resampler_set_phase CAT_PREFIX(RANDOM_PREFIX,_resampler_set_phase)
+#define speex_resampler_get_phase CAT_PREFIX(RANDOM_PREFIX,_resampler_get_phase)
 #define speex_resampler_set_quality CAT_PREFIX(RANDOM_PREFIX,_resampler_set_quality)
 #define speex_resampler_get_quality CAT_PREFIX(RANDOM_PREFIX,_resampler_get_quality)
 #define speex_resampler_set_input_stride CAT_PREFIX(RANDOM_PREFIX,_resampler_set_input_stride)
@@ -111,9 +129,83 @@ enum {
    RESAMPLER_ERR_MAX_ERROR
 };
 
+/** Sample formats of speex_resampler_process_format(). All of them have the
+ * same full scale as the int API, so a float or double sample of 32768
+ * corresponds to 1<<15 in S16, 1<<23 in S24 and 1<<31 in S32. */
+enum {
+   SPEEX_RESAMPLER_FORMAT_S16   = 0, /**< 16-bit integers (spx_int16_t) */
+   SPEEX_RESAMPLER_FORMAT_S24   = 1, /**< 24-bit integers packed in 3 bytes, little-endian */
+   SPEEX_RESAMPLER_FORMAT_S32   = 2, /**< 32-bit integers (spx_int32_t) */
+   SPEEX_RESAMPLER_FORMAT_FLOAT = 3, /**< float */
+   SPEEX_RESAMPLER_FORMAT_F64   = 4  /**< double */
+};
+
+/** Phase responses of the filter, see speex_resampler_set_phase() */
+enum {
+   SPEEX_RESAMPLER_PHASE_LINEAR  = 0, /**< Symmetric filter (default) */
+   SPEEX_RESAMPLER_PHASE_MINIMUM = 1  /**< Minimum-phase filter, same magnitude response */
+};
+
 struct SpeexResamplerState_;
 typedef struct SpeexResamplerState_ SpeexResamplerState;
 
+struct SpeexResamplerBatch_;
+typedef struct SpeexResamplerBatch_ SpeexResamplerBatch;
+
+/** One stream of a batch passed to speex_resampler_batch_process_int(). The
+ * fields are the arguments of speex_resampler_process_interleaved_int(), and
+ * in_len and out_len are updated the same way. */
+typedef struct SpeexResamplerJob {
+   SpeexResamplerState *st;
+   const spx_int16_t *in;
+   spx_uint32_t in_len;
+   spx_int16_t *out;
+   spx_uint32_t out_len;
+} SpeexResamplerJob;
+
+/** Float version of SpeexResamplerJob, for
+ * speex_resampler_batch_process_float() */
+typedef struct SpeexResamplerJobFloat {
+   SpeexResamplerState *st;
+   const float *in;
+   spx_uint32_t in_len;
+   float *out;
+   spx_uint32_t out_len;
+} SpeexResamplerJobFloat;
+
+/** Function supplying the input of the pull functions, see
+ * speex_resampler_set_input_func().
+ * @param user Pointer given to speex_resampler_set_input_func()
+ * @param data Where to write the samples, interleaved when there are several
+ * channels
+ * @param len Number of samples wanted (per channel)
+ * @return Number of samples written (per channel). Anything less than len
+ * ends the pull call once the output that this input allows is computed.
+ */
+typedef spx_uint32_t (*speex_resampler_input_func)(void *user,
+                                                   void *data,
+                                                   spx_uint32_t len);
+
+/** One task of speex_resampler_process_interleaved_parallel().
+ * @param arg Argument given to the speex_resampler_parallel_func
+ * @param index Index of the task, from 0 to count-1
+ */
+typedef void (*speex_resampler_task_func)(void *arg, spx_uint32_t index);
+
+/** Interface to the caller's thread pool for
+ * speex_resampler_process_interleaved_parallel(). It must call
+ * task(arg, index) once for each index from 0 to count-1, in any order and
+ * from any threads, and only return once all of them are done.
+ * @param pool Pointer given to speex_resampler_process_interleaved_parallel()
+ * @param task Task to run
+ * @param arg Argument of the task
+ * @param count Number of tasks
+ */
+typedef void (*speex_resampler_parallel_func)(void *pool,
+                                              speex_resampler_task_func task,
+                                              void *arg,
+                                              spx_uint32_t count);
+
 /** Create a new resampler with integer input and output rates.
  * @param nb_channels Number of channels to be processed
  * @param in_rate Input sampling rate (integer number of Hz).
@@ -219,6 +311,222 @@ int speex_resampler_process_interleaved_int(SpeexResamplerState *st,
                                              spx_int16_t *out,
                                              spx_uint32_t *out_len);
 
+/** Resample an array of any sample format into an array of any format. The
+ * conversions are done as the samples are copied into and out of the filter,
+ * without an intermediate buffer. The input and output buffers must *not*
+ * overlap.
+ *
+ * Different channels of a state can be processed from different threads at
+ * the same time with this function (or process_float() and process_int()).
+ * This requires a previous call on the state with the same output format,
+ * after which nothing shared by the channels is written any more. No other
+ * function may be called on the state while this happens.
+ * @param st Resampler state
+ * @param channel_index Index of the channel to process for the multi-channel
+ * base (0 otherwise)
+ * @param in_format Format of the input (SPEEX_RESAMPLER_FORMAT_*)
+ * @param in Input buffer
+ * @param in_len Number of input samples in the input buffer. Returns the number
+ * of samples processed
+ * @param out_format Format of the output (SPEEX_RESAMPLER_FORMAT_*)
+ * @param out Output buffer
+ * @param out_len Size of the output buffer. Returns the number of samples written
+ */
+int speex_resampler_process_format(SpeexResamplerState *st,
+                                   spx_uint32_t channel_index,
+                                   int in_format,
+                                   const void *in,
+                                   spx_uint32_t *in_len,
+                                   int out_format,
+                                   void *out,
+                                   spx_uint32_t *out_len);
+
+/** Resample an interleaved array of any sample format into an interleaved
+ * array of any format. The input and output buffers must *not* overlap.
+ * @param st Resampler state
+ * @param in_format Format of the input (SPEEX_RESAMPLER_FORMAT_*)
+ * @param in Input buffer
+ * @param in_len Number of input samples in the input buffer. Returns the number
+ * of samples processed. This is all per-channel.
+ * @param out_format Format of the output (SPEEX_RESAMPLER_FORMAT_*)
+ * @param out Output buffer
+ * @param out_len Size of the output buffer. Returns the number of samples written.
+ * This is all per-channel.
+ */
+int speex_resampler_process_interleaved_format(SpeexResamplerState *st,
+                                               int in_format,
+                                               const void *in,
+                                               spx_uint32_t *in_len,
+                                               int out_format,
+                                               void *out,
+                                               spx_uint32_t *out_len);
+
+/** Resample an interleaved array like
+ * speex_resampler_process_interleaved_format(), processing each channel as a
+ * separate task on the caller's thread pool. This is meant for offline
+ * conversion of many channels. It doesn't use the kernels that process all
+ * the channels together, so it is slower on a single thread.
+ * @param st Resampler state
+ * @param in_format Format of the input (SPEEX_RESAMPLER_FORMAT_*)
+ * @param in Input buffer
+ * @param in_len Number of input samples in the input buffer. Returns the number
+ * of samples processed. This is all per-channel.
+ * @param out_format Format of the output (SPEEX_RESAMPLER_FORMAT_*)
+ * @param out Output buffer
+ * @param out_len Size of the output buffer. Returns the number of samples written.
+ * This is all per-channel.
+ * @param run Function running the tasks (one per channel), or NULL to run
+ * them one after the other on the calling thread
+ * @param pool Pointer passed to run
+ */
+int speex_resampler_process_interleaved_parallel(SpeexResamplerState *st,
+                                                 int in_format,
+                                                 const void *in,
+                                                 spx_uint32_t *in_len,
+                                                 int out_format,
+                                                 void *out,
+                                                 spx_uint32_t *out_len,
+                                                 speex_resampler_parallel_func run,
+                                                 void *pool);
+
+/** Set the function the pull functions get their input from. It is only
+ * ever asked for the samples that the requested output depends on, so the
+ * caller doesn't have to keep any input aside between calls.
+ * @param st Resampler state
+ * @param format Format of the input (SPEEX_RESAMPLER_FORMAT_*)
+ * @param func Input function, or NULL to remove it
+ * @param user Pointer passed to func
+ */
+int speex_resampler_set_input_func(SpeexResamplerState *st,
+                                   int format,
+                                   speex_resampler_input_func func,
+                                   void *user);
+
+#ifndef OUTSIDE_SPEEX
+struct SpeexBuffer_;
+
+/** Make the pull functions read their input from a SpeexBuffer holding
+ * interleaved samples. Only whole frames (one sample for each channel) are
+ * read, and a buffer that runs short ends the pull call as with an input
+ * function.
+ * @param st Resampler state
+ * @param format Format of the samples in the buffer (SPEEX_RESAMPLER_FORMAT_*)
+ * @param buffer Buffer to read from, or NULL to remove it
+ */
+int speex_resampler_set_input_buffer(SpeexResamplerState *st,
+                                     int format,
+                                     struct SpeexBuffer_ *buffer);
+#endif
+
+/** Compute a given number of output samples, reading exactly the input they
+ * need from the input function (or buffer). This is meant for callers that
+ * have to produce a fixed amount of output, such as a playback period. The
+ * output is interleaved when there are several channels, and all of them
+ * must have been processed in step so far (as is the case when only the
+ * interleaved or pull functions are used).
+ * @param st Resampler state
+ * @param out_format Format of the output (SPEEX_RESAMPLER_FORMAT_*)
+ * @param out Output buffer
+ * @param out_len Number of samples wanted (per channel). Returns the number of
+ * samples written, which is less only if the input ran short.
+ * @retval RESAMPLER_ERR_BAD_STATE No input set, or channels not in step
+ */
+int speex_resampler_pull_format(SpeexResamplerState *st,
+                                int out_format,
+                                void *out,
+                                spx_uint32_t *out_len);
+
+/** Float version of speex_resampler_pull_format().
+ * @param st Resampler state
+ * @param out Output buffer
+ * @param out_len Number of samples wanted (per channel). Returns the number of
+ * samples written.
+ */
+int speex_resampler_pull_float(SpeexResamplerState *st,
+                               float *out,
+                               spx_uint32_t *out_len);
+
+/** Int version of speex_resampler_pull_format().
+ * @param st Resampler state
+ * @param out Output buffer
+ * @param out_len Number of samples wanted (per channel). Returns the number of
+ * samples written.
+ */
+int speex_resampler_pull_int(SpeexResamplerState *st,
+                             spx_int16_t *out,
+                             spx_uint32_t *out_len);
+
+/** Create a context for resampling many independent streams in one call.
+ * @param nb_threads Number of worker threads to start, in addition to the
+ * thread calling speex_resampler_batch_process_int(). 0 processes everything
+ * on the calling thread. Ignored when built without thread support.
+ * @param err Error code, may be NULL
+ * @return Newly created batch context
+ * @retval NULL Error: not enough memory or invalid argument
+ */
+SpeexResamplerBatch *speex_resampler_batch_init(int nb_threads, int *err);
+
+/** Destroy a batch context and stop its worker threads.
+ * @param batch Batch context
+ */
+void speex_resampler_batch_destroy(SpeexResamplerBatch *batch);
+
+/** Resample a set of independent interleaved int streams. Jobs whose
+ * resamplers share a filter are processed together so that its coefficients
+ * stay in cache, and the work is spread over the worker threads of the
+ * batch. A resampler state may appear in at most one job of a call.
+ * @param batch Batch context
+ * @param jobs Array of jobs. in_len and out_len are updated as with
+ * speex_resampler_process_interleaved_int().
+ * @param nb_jobs Number of jobs
+ * @return The error returned by the failed job with the lowest index, or
+ * RESAMPLER_ERR_SUCCESS
+ */
+int speex_resampler_batch_process_int(SpeexResamplerBatch *batch,
+                                      SpeexResamplerJob *jobs,
+                                      spx_uint32_t nb_jobs);
+
+/** Resample a set of independent interleaved float streams. See
+ * speex_resampler_batch_process_int().
+ * @param batch Batch context
+ * @param jobs Array of jobs
+ * @param nb_jobs Number of jobs
+ * @return The error returned by the failed job with the lowest index, or
+ * RESAMPLER_ERR_SUCCESS
+ */
+int speex_resampler_batch_process_float(SpeexResamplerBatch *batch,
+                                        SpeexResamplerJobFloat *jobs,
+                                        spx_uint32_t nb_jobs);
+
+/** Resample a whole interleaved recording at once, spread over the worker
+ * threads of a batch. The input is split into segments that start at the
+ * same filter phase, each of which is resampled by its own state after a
+ * lead-in taken from the input before it. The output is sample-identical to
+ * a single speex_resampler_process_interleaved_format() call on st with
+ * the whole input, but st itself isn't changed. st must not have processed
+ * anything since it was initialised or reset, except for
+ * speex_resampler_skip_zeros(). The asynchronous mode isn't supported.
+ * @param st Resampler state giving the rates, quality and phase
+ * @param batch Batch context providing the threads, or NULL to resample on
+ * the calling thread
+ * @param in_format Format of the input (SPEEX_RESAMPLER_FORMAT_*)
+ * @param in Input buffer
+ * @param in_len Number of input samples (per channel)
+ * @param out_format Format of the output (SPEEX_RESAMPLER_FORMAT_*)
+ * @param out Output buffer
+ * @param out_len Size of the output buffer (per channel). Returns the number
+ * of samples written.
+ * @return RESAMPLER_ERR_SUCCESS, or an error code
+ */
+int speex_resampler_process_offline(SpeexResamplerState *st,
+                                    SpeexResamplerBatch *batch,
+                                    int in_format,
+                                    const void *in,
+                                    spx_uint32_t in_len,
+                                    int out_format,
+                                    void *out,
+                                    spx_uint32_t *out_len);
+
 /** Set (change) the input/output sampling rates (integer value).
  * @param st Resampler state
  * @param in_rate Input sampling rate (integer number of Hz).
@@ -261,6 +569,70 @@ void speex_resampler_get_ratio(SpeexResamplerState *st,
                                spx_uint32_t *ratio_num,
                                spx_uint32_t *ratio_den);
 
+/** Enable or disable the asynchronous sample rate converter (asrc) mode,
+ * meant for tracking a slowly varying ratio such as the drift between two
+ * clocks. In this mode, the filter only depends on the nominal input and
+ * output rates, and speex_resampler_set_rate_frac() calls that only change
+ * the ratio just update the step between output samples, which is cheap
+ * enough to do on every frame. The filter always interpolates an oversampled
+ * table, so it costs a bit more than the normal mode for simple ratios.
+ * @param st Resampler state
+ * @param enable 1 to enable the asrc mode, 0 to disable it
+ */
+int speex_resampler_set_asrc(SpeexResamplerState *st,
+                             int enable);
+
+/** Get whether the asrc mode is enabled.
+ * @param st Resampler state
+ * @param enable 1 if the asrc mode is enabled, 0 otherwise
+ */
+void speex_resampler_get_asrc(SpeexResamplerState *st,
+                              int *enable);
+
+/** Enable or disable the kernels that resample all the channels of an
+ * interleaved stream together, in speex_resampler_process_interleaved_*().
+ * They load the filter taps once per output frame instead of once per
+ * channel, which is several times faster with 8 channels or more (fewer
+ * channels always use the per-channel path). The output is not bit-exact
+ * with the per-channel path: the taps of the interpolated mode are
+ * interpolated and rounded once per frame, and the sums are not done in the
+ * same order. They are disabled by default.
+ * @param st Resampler state
+ * @param enable 1 to enable the interleaved kernels, 0 to disable them
+ */
+int speex_resampler_set_interleaved(SpeexResamplerState *st,
+                                    int enable);
+
+/** Get whether the interleaved kernels are enabled.
+ * @param st Resampler state
+ * @param enable 1 if they are enabled, 0 otherwise
+ */
+void speex_resampler_get_interleaved(SpeexResamplerState *st,
+                                     int *enable);
+
+/** Select the phase response of the filter. The default linear-phase filter
+ * delays all frequencies by half its length, which is several milliseconds
+ * at the higher qualities. The minimum-phase filter has the same magnitude
+ * response (and stop-band attenuation) for each quality, but most of its
+ * delay is gone: speex_resampler_get_input_latency() then reports its group
+ * delay at DC. The pass-band is no longer delayed uniformly, which can
+ * matter for music but not for voice. Large down-sampling ratios are done
+ * in a single filter instead of a half-band cascade, so they cost more.
+ * This should be called right after the init function, as changing the
+ * phase also clears the filter memory (see speex_resampler_reset_mem()).
+ * @param st Resampler state
+ * @param phase SPEEX_RESAMPLER_PHASE_LINEAR or SPEEX_RESAMPLER_PHASE_MINIMUM
+ */
+int speex_resampler_set_phase(SpeexResamplerState *st,
+                              int phase);
+
+/** Get the phase response of the filter.
+ * @param st Resampler state
+ * @param phase SPEEX_RESAMPLER_PHASE_LINEAR or SPEEX_RESAMPLER_PHASE_MINIMUM
+ */
+void speex_resampler_get_phase(SpeexResamplerState *st,
+                               int *phase);
+
 /** Set (change) the conversion quality.
  * @param st Resampler state
  * @param quality Resampling quality between 0 and 10, where 0 has poor
@@ -75,6 +75,26 @@
 #include "pseudofloat.h"
 #include "math_approx.h"
 #include "os_support.h"
+#include "threadpool.h"
+
+#include <limits.h>
+#include <time.h>
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#if defined(USE_SSE) && !defined(FIXED_POINT)
+#include "mdf_sse.h"
+#endif
+
+#if defined(USE_AVX2) && !defined(FIXED_POINT)
+#include "x86cpu.h"
+#include "mdf_avx2.h"
+/* Calls the AVX2 version of a spectral function if the CPU supports it */
+#define MDF_KERNEL_(st, func) ((st)->use_avx2 ? func##_avx2 : func)
+#else
+#define MDF_KERNEL_(st, func) func
+#endif
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -92,6 +112,23 @@
    and difficult signals in general. The cost is an extra FFT and a matrix-vector multiply */
 #define TWO_PATH
 
+/* In floating point, the spectra in X, W, foreground, E and Y are split: the real parts of
+   all the bins, padded to a multiple of 8, followed by the imaginary parts. The spectral
+   loops then need no special case for DC and Nyquist and map directly onto SIMD registers.
+   The FFT still works on the packed layout, which mdf_fft() and mdf_ifft() convert. */
+#ifndef FIXED_POINT
+#define SPLIT_SPECTRUM
+#endif
+
+#ifdef SPLIT_SPECTRUM
+#define SPECTRUM_SIZE(frame_size) (2*(((frame_size)+8)&~7))
+/* Calls the version of a spectral function for the split layout */
+#define MDF_KERNEL(st, func) MDF_KERNEL_(st, func##_split)
+#else
+#define SPECTRUM_SIZE(frame_size) (2*(frame_size))
+#define MDF_KERNEL(st, func) MDF_KERNEL_(st, func)
+#endif
+
 #ifdef FIXED_POINT
 static const spx_float_t MIN_LEAK = {20972, -22};
 
@@ -119,13 +156,102 @@ static const spx_float_t VAR_BACKTRACK = 4.f;
 
 #define PLAYBACK_DELAY 2
 
+/* Energy of a partition, relative to the strongest one, below which it can
+   be skipped in sparse mode, and how often the whole filter is still used */
+#define SPARSE_FLOOR QCONST16(.0003f,15)
+#define SPARSE_PROBE 8
+
+/* Bands of the binary spectra of the delay search, frames the best delay has
+   to stay the best before the far end is moved to it, frames of the echo
+   path left in the filter ahead of it, and longest delay that can be searched
+   for, in samples (about 20 s at 48 kHz) */
+#define DELAY_BANDS 32
+#define DELAY_STABLE 50
+#define DELAY_MARGIN 1
+#define DELAY_MAX (1<<20)
+
 void speex_echo_get_residual(SpeexEchoState *st, spx_word32_t *Yout, int len);
 
+/** What a thread needs to work on one channel. The FFT tables have their
+    own work buffers, so each thread gets its own; the caller's comes first. */
+typedef struct {
+   SpeexEchoState *st;
+   void *fft_table;
+   void **tier_fft;      /* FFT table of each tier */
+   spx_word16_t *wtmp;   /* scratch */
+#ifdef FIXED_POINT
+   spx_word16_t *wtmp2;  /* scratch */
+#endif
+#ifdef SPLIT_SPECTRUM
+   spx_word16_t *fft_buf;/* scratch for the packed spectrum of the FFT */
+#endif
+} EchoWorker;
+
+typedef void (*echo_task_func)(SpeexEchoState *st, int index, EchoWorker *w);
+
+/** Partitions of the filter tail that share a block size longer than the
+    frame. The tier filters the far end delayed by at least one block, so
+    its output for a whole block can be computed when the block starts, and
+    it adapts once the error of the block is known. */
+typedef struct {
+   int block;            /* Partition size, a multiple of frame_size */
+   int frames;           /* Frames per block */
+   int M;                /* Number of partitions */
+   int delay;            /* Delay of the first partition, at least block */
+   int spec_size;        /* Size of a spectrum in X, W, foreground, E and Y */
+   int phase;            /* Frame within the current block */
+   int count;            /* Blocks so far, for the alternating constraint */
+   int shift;            /* log2 of frames */
+   spx_word16_t *X;      /* Far-end blocks (M+1) in frequency domain, circular */
+   int X_pos;            /* Slot of the newest block in X */
+   spx_word32_t *W;      /* (Background) filter weights */
+#ifdef TWO_PATH
+   spx_word16_t *foreground; /* Foreground filter weights */
+   spx_word16_t *yf;     /* Foreground output for the block (second half) */
+#endif
+   spx_word16_t *y;      /* Background output for the block (second half) */
+   spx_word16_t *Y;      /* scratch */
+   spx_word16_t *e;      /* Error of the block (second half) */
+   spx_word16_t *E;
+   spx_word32_t *power;  /* Power of the far-end signal */
+   spx_float_t  *power_1;/* Inverse power of far-end */
+   spx_word32_t *Xf;     /* scratch */
+   spx_word16_t *prop;
+   spx_word16_t *amp;    /* Weight amplitude of each partition, per frame */
+} EchoTier;
+
+/** Search of the bulk delay between the far end and the near end. The far
+    end goes through a delay line before the filter, so that the filter only
+    has to cover the echo tail. Each frame of the far and near end is reduced
+    to a binary spectrum (the bands above their average), and the delay is
+    the one at which they disagree on the fewest bands. */
+typedef struct {
+   int max;              /* Longest delay searched, in frames */
+   int delay;            /* Current delay of the far end, in frames */
+   int pos;              /* Slot of the newest frame in buf, bits and on */
+   int bands;            /* Bands of the binary spectra, at most 32 */
+   int best;             /* Delay that matched best on the last frames */
+   int count;            /* Frames in a row it has been the best */
+   int frames;           /* Frames with an active far end so far */
+   spx_word16_t *buf;    /* Far end (max+2 frames per loudspeaker), circular */
+   spx_uint32_t *bits;   /* Binary spectra of the far-end frames */
+   int *on;              /* Whether each far-end frame was active */
+   int *cost;            /* Average bands of disagreement at each delay (Q8) */
+   spx_word16_t *far;    /* Last two far-end frames, mixed down */
+   spx_word16_t *near;   /* Last two near-end frames, mixed down */
+   spx_word16_t *spec;   /* scratch */
+   spx_word32_t *ps;     /* scratch */
+   spx_word32_t far_avg[DELAY_BANDS]; /* Average energy of the bands */
+   spx_word32_t near_avg[DELAY_BANDS];
+   spx_word32_t far_level; /* Average energy of the far end */
+} EchoDelay;
+
 
 /** Speex echo cancellation state. */
 struct SpeexEchoState_ {
    int frame_size;           /**< Number of samples processed each time */
    int window_size;
+   int spec_size;            /**< Size of a spectrum in X, W, foreground, E and Y */
    int M;
    int cancel_count;
    int adapted;
@@ -142,13 +268,13 @@ struct SpeexEchoState_ {
 
    spx_word16_t *e;      /* scratch */
    spx_word16_t *x;      /* Far-end input buffer (2N) */
-   spx_word16_t *X;      /* Far-end buffer (M+1 frames) in frequency domain */
+   spx_word16_t *X;      /* Far-end buffer (M+1 frames) in frequency domain, circular */
+   int X_pos;            /* Slot of the newest frame in X */
    spx_word16_t *input;  /* scratch */
    spx_word16_t *y;      /* scratch */
    spx_word16_t *last_y;
    spx_word16_t *Y;      /* scratch */
    spx_word16_t *E;
-   spx_word32_t *PHI;    /* scratch */
    spx_word32_t *W;      /* (Background) filter weights */
 #ifdef TWO_PATH
    spx_word16_t *foreground; /* Foreground filter weights */
@@ -159,10 +285,6 @@ struct SpeexEchoState_ {
 #endif
    spx_word32_t *power;  /* Power of the far-end signal */
    spx_float_t  *power_1;/* Inverse power of far-end */
-   spx_word16_t *wtmp;   /* scratch */
-#ifdef FIXED_POINT
-   spx_word16_t *wtmp2;  /* scratch */
-#endif
    spx_word32_t *Rf;     /* scratch */
    spx_word32_t *Yf;     /* scratch */
    spx_word32_t *Xf;     /* scratch */
@@ -172,7 +294,7 @@ struct SpeexEchoState_ {
    spx_float_t   Pyy;
    spx_word16_t *window;
    spx_word16_t *prop;
-   void *fft_table;
+   EchoWorker *workers;  /* One per thread, the caller's first */
    spx_word16_t *memX, *memD, *memE;
    spx_word16_t preemph;
    spx_word16_t notch_radius;
@@ -182,6 +304,46 @@ struct SpeexEchoState_ {
    spx_int16_t *play_buf;
    int play_buf_pos;
    int play_buf_started;
+
+   /* Non-uniform partitions: the M partitions of frame_size are followed
+      by the tiers, as laid out by mdf_tier_layout() */
+   int nb_tiers;
+   EchoTier *tiers;
+   int cur_tier;         /* Tier of the tasks being run */
+   spx_word16_t *hist;   /* Far-end history the tiers take their blocks from */
+   int hist_size;        /* Per loudspeaker */
+   int max_window;       /* Largest FFT size */
+   int adapt_M;          /* Filter length in frames */
+   spx_word16_t *amp;    /* Weight amplitude of each of the M partitions */
+
+   /* Sparse mode: between probes, only partitions first to last-1 adapt */
+   int sparse;
+   int first;
+   int last;
+   int probe;            /* The whole filter adapts on this frame */
+   int used_first;       /* The weights outside partitions used_first to */
+   int used_last;        /* used_last-1 are zero, and aren't filtered with */
+
+   EchoDelay *delay;     /* Bulk delay search, NULL when it is off */
+
+   int silent;           /* Frames in a row with a silent far end */
+   spx_int32_t skipped;  /* Frames that were not adapted because of it */
+
+   int use_avx2;
+   int batch_owner;  /* 1 + queue of the batch thread that last ran the state, 0 if none */
+
+   /* Shared with the per-channel tasks of the frame being processed */
+   spx_int16_t *frame_out;
+   int frame_adapt;
+   int frame_skip;       /* Nothing to learn from this frame */
+   spx_word32_t *chan_sums; /* Per-channel energies, added up in channel order */
+
+#ifdef USE_PTHREADS
+   int nb_threads;
+   SpxThreadPool *pool;
+   echo_task_func task;
+   int nb_tasks;
+#endif
 };
 
 static inline void filter_dc_notch16(const spx_int16_t *in, spx_word16_t radius, spx_word16_t *out, int len, spx_mem_t *mem, int stride)
@@ -224,6 +386,7 @@ static inline spx_word32_t mdf_inner_prod(const spx_word16_t *x, const spx_word1
    return sum;
 }
 
+#ifndef OVERRIDE_POWER_SPECTRUM
 /** Compute power spectrum of a half-complex (packed) vector */
 static inline void power_spectrum(const spx_word16_t *X, spx_word32_t *ps, int N)
 {
@@ -235,7 +398,9 @@ static inline void power_spectrum(const spx_word16_t *X, spx_word32_t *ps, int N
    }
    ps[j]=MULT16_16(X[i],X[i]);
 }
+#endif
 
+#ifndef OVERRIDE_POWER_SPECTRUM_ACCUM
 /** Compute power spectrum of a half-complex (packed) vector and accumulate */
 static inline void power_spectrum_accum(const spx_word16_t *X, spx_word32_t *ps, int N)
 {
@@ -247,119 +412,360 @@ static inline void power_spectrum_accum(const spx_word16_t *X, spx_word32_t *ps,
    }
    ps[j]+=MULT16_16(X[i],X[i]);
 }
+#endif
 
-/** Compute cross-power spectrum of a half-complex (packed) vectors and add to acc */
+/** Compute cross-power spectrum of a half-complex (packed) vectors and add to acc.
+    X is a ring of R blocks of N, of which the M starting at block start are
+    used, wrapping around to the first one. */
 #ifdef FIXED_POINT
-static inline void spectral_mul_accum(const spx_word16_t *X, const spx_word32_t *Y, spx_word16_t *acc, int N, int M)
+static inline void spectral_mul_accum(const spx_word16_t *X, int start, int R, const spx_word32_t *Y, spx_word16_t *acc, int N, int M)
 {
-   int i,j;
+   int i,j,b;
    spx_word32_t tmp1=0,tmp2=0;
-   for (j=0;j<M;j++)
+   for (j=0,b=start;j<M;j++,b=b+1<R?b+1:0)
    {
-      tmp1 = MAC16_16(tmp1, X[j*N],TOP16(Y[j*N]));
+      tmp1 = MAC16_16(tmp1, X[b*N],TOP16(Y[j*N]));
    }
    acc[0] = PSHR32(tmp1,WEIGHT_SHIFT);
    for (i=1;i<N-1;i+=2)
    {
       tmp1 = tmp2 = 0;
-      for (j=0;j<M;j++)
+      for (j=0,b=start;j<M;j++,b=b+1<R?b+1:0)
       {
-         tmp1 = SUB32(MAC16_16(tmp1, X[j*N+i],TOP16(Y[j*N+i])), MULT16_16(X[j*N+i+1],TOP16(Y[j*N+i+1])));
-         tmp2 = MAC16_16(MAC16_16(tmp2, X[j*N+i+1],TOP16(Y[j*N+i])), X[j*N+i], TOP16(Y[j*N+i+1]));
+         tmp1 = SUB32(MAC16_16(tmp1, X[b*N+i],TOP16(Y[j*N+i])), MULT16_16(X[b*N+i+1],TOP16(Y[j*N+i+1])));
+         tmp2 = MAC16_16(MAC16_16(tmp2, X[b*N+i+1],TOP16(Y[j*N+i])), X[b*N+i], TOP16(Y[j*N+i+1]));
       }
       acc[i] = PSHR32(tmp1,WEIGHT_SHIFT);
       acc[i+1] = PSHR32(tmp2,WEIGHT_SHIFT);
    }
    tmp1 = tmp2 = 0;
-   for (j=0;j<M;j++)
+   for (j=0,b=start;j<M;j++,b=b+1<R?b+1:0)
    {
-      tmp1 = MAC16_16(tmp1, X[(j+1)*N-1],TOP16(Y[(j+1)*N-1]));
+      tmp1 = MAC16_16(tmp1, X[(b+1)*N-1],TOP16(Y[(j+1)*N-1]));
    }
    acc[N-1] = PSHR32(tmp1,WEIGHT_SHIFT);
 }
-static inline void spectral_mul_accum16(const spx_word16_t *X, const spx_word16_t *Y, spx_word16_t *acc, int N, int M)
+static inline void spectral_mul_accum16(const spx_word16_t *X, int start, int R, const spx_word16_t *Y, spx_word16_t *acc, int N, int M)
 {
-   int i,j;
+   int i,j,b;
    spx_word32_t tmp1=0,tmp2=0;
-   for (j=0;j<M;j++)
+   for (j=0,b=start;j<M;j++,b=b+1<R?b+1:0)
    {
-      tmp1 = MAC16_16(tmp1, X[j*N],Y[j*N]);
+      tmp1 = MAC16_16(tmp1, X[b*N],Y[j*N]);
    }
    acc[0] = PSHR32(tmp1,WEIGHT_SHIFT);
    for (i=1;i<N-1;i+=2)
    {
       tmp1 = tmp2 = 0;
-      for (j=0;j<M;j++)
+      for (j=0,b=start;j<M;j++,b=b+1<R?b+1:0)
       {
-         tmp1 = SUB32(MAC16_16(tmp1, X[j*N+i],Y[j*N+i]), MULT16_16(X[j*N+i+1],Y[j*N+i+1]));
-         tmp2 = MAC16_16(MAC16_16(tmp2, X[j*N+i+1],Y[j*N+i]), X[j*N+i], Y[j*N+i+1]);
+         tmp1 = SUB32(MAC16_16(tmp1, X[b*N+i],Y[j*N+i]), MULT16_16(X[b*N+i+1],Y[j*N+i+1]));
+         tmp2 = MAC16_16(MAC16_16(tmp2, X[b*N+i+1],Y[j*N+i]), X[b*N+i], Y[j*N+i+1]);
       }
       acc[i] = PSHR32(tmp1,WEIGHT_SHIFT);
       acc[i+1] = PSHR32(tmp2,WEIGHT_SHIFT);
    }
    tmp1 = tmp2 = 0;
-   for (j=0;j<M;j++)
+   for (j=0,b=start;j<M;j++,b=b+1<R?b+1:0)
    {
-      tmp1 = MAC16_16(tmp1, X[(j+1)*N-1],Y[(j+1)*N-1]);
+      tmp1 = MAC16_16(tmp1, X[(b+1)*N-1],Y[(j+1)*N-1]);
    }
    acc[N-1] = PSHR32(tmp1,WEIGHT_SHIFT);
 }
 
 #else
-static inline void spectral_mul_accum(const spx_word16_t *X, const spx_word32_t *Y, spx_word16_t *acc, int N, int M)
+#ifndef OVERRIDE_SPECTRAL_MUL_ACCUM
+static inline void spectral_mul_accum(const spx_word16_t *X, int start, int R, const spx_word32_t *Y, spx_word16_t *acc, int N, int M)
 {
    int i,j;
+   const spx_word16_t *Xb = X + start*N;
    for (i=0;i<N;i++)
       acc[i] = 0;
    for (j=0;j<M;j++)
    {
-      acc[0] += X[0]*Y[0];
+      acc[0] += Xb[0]*Y[0];
       for (i=1;i<N-1;i+=2)
       {
-         acc[i] += (X[i]*Y[i] - X[i+1]*Y[i+1]);
-         acc[i+1] += (X[i+1]*Y[i] + X[i]*Y[i+1]);
+         acc[i] += (Xb[i]*Y[i] - Xb[i+1]*Y[i+1]);
+         acc[i+1] += (Xb[i+1]*Y[i] + Xb[i]*Y[i+1]);
       }
-      acc[i] += X[i]*Y[i];
-      X += N;
+      acc[i] += Xb[i]*Y[i];
+      Xb += N;
+      if (Xb == X + R*N)
+         Xb = X;
       Y += N;
    }
 }
+#endif
 #define spectral_mul_accum16 spectral_mul_accum
 #endif
 
-/** Compute weighted cross-power spectrum of a half-complex (packed) vector with conjugate */
+#ifndef OVERRIDE_WEIGHTED_SPECTRAL_MUL_CONJ
+/** Compute weighted cross-power spectrum of a half-complex (packed) vector with conjugate and add to prod */
 static inline void weighted_spectral_mul_conj(const spx_float_t *w, const spx_float_t p, const spx_word16_t *X, const spx_word16_t *Y, spx_word32_t *prod, int N)
 {
    int i, j;
    spx_float_t W;
    W = FLOAT_AMULT(p, w[0]);
-   prod[0] = FLOAT_MUL32(W,MULT16_16(X[0],Y[0]));
+   prod[0] += FLOAT_MUL32(W,MULT16_16(X[0],Y[0]));
    for (i=1,j=1;i<N-1;i+=2,j++)
    {
       W = FLOAT_AMULT(p, w[j]);
-      prod[i] = FLOAT_MUL32(W,MAC16_16(MULT16_16(X[i],Y[i]), X[i+1],Y[i+1]));
-      prod[i+1] = FLOAT_MUL32(W,MAC16_16(MULT16_16(-X[i+1],Y[i]), X[i],Y[i+1]));
+      prod[i] += FLOAT_MUL32(W,MAC16_16(MULT16_16(X[i],Y[i]), X[i+1],Y[i+1]));
+      prod[i+1] += FLOAT_MUL32(W,MAC16_16(MULT16_16(-X[i+1],Y[i]), X[i],Y[i+1]));
    }
    W = FLOAT_AMULT(p, w[j]);
-   prod[i] = FLOAT_MUL32(W,MULT16_16(X[i],Y[i]));
+   prod[i] += FLOAT_MUL32(W,MULT16_16(X[i],Y[i]));
+}
+#endif
+
+#ifdef SPLIT_SPECTRUM
+/* The same functions on split spectra of N values: the real parts of N/2
+   bins, then their imaginary parts */
+#ifndef OVERRIDE_POWER_SPECTRUM_SPLIT
+static inline void power_spectrum_split(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i++)
+      ps[i] = X[i]*X[i] + X[B+i]*X[B+i];
+}
+#endif
+
+#ifndef OVERRIDE_POWER_SPECTRUM_ACCUM_SPLIT
+static inline void power_spectrum_accum_split(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i++)
+      ps[i] += X[i]*X[i] + X[B+i]*X[B+i];
+}
+#endif
+
+#ifndef OVERRIDE_SPECTRAL_MUL_ACCUM_SPLIT
+static inline void spectral_mul_accum_split(const spx_word16_t *X, int start, int R, const spx_word32_t *Y, spx_word16_t *acc, int N, int M)
+{
+   int i,j;
+   const int B = N/2;
+   const spx_word16_t *Xb = X + start*N;
+   for (i=0;i<N;i++)
+      acc[i] = 0;
+   for (j=0;j<M;j++)
+   {
+      for (i=0;i<B;i++)
+      {
+         acc[i] += (Xb[i]*Y[i] - Xb[B+i]*Y[B+i]);
+         acc[B+i] += (Xb[B+i]*Y[i] + Xb[i]*Y[B+i]);
+      }
+      Xb += N;
+      if (Xb == X + R*N)
+         Xb = X;
+      Y += N;
+   }
+}
+#endif
+#define spectral_mul_accum16_split spectral_mul_accum_split
+
+#ifndef OVERRIDE_WEIGHTED_SPECTRAL_MUL_CONJ_SPLIT
+static inline void weighted_spectral_mul_conj_split(const spx_float_t *w, const spx_float_t p, const spx_word16_t *X, const spx_word16_t *Y, spx_word32_t *prod, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i++)
+   {
+      spx_float_t W = p*w[i];
+      prod[i] += W*(X[i]*Y[i] + X[B+i]*Y[B+i]);
+      prod[B+i] += W*(X[i]*Y[B+i] - X[B+i]*Y[i]);
+   }
+}
+#endif
+
+/* Forward FFT of size N from the time domain to a split spectrum of size S */
+static void mdf_fft_size(EchoWorker *w, void *table, int N, int S, spx_word16_t *in, spx_word16_t *out)
+{
+   int i;
+   const int B = S/2;
+   const spx_word16_t *buf = w->fft_buf;
+   spx_fft(table, in, w->fft_buf);
+   out[0] = buf[0];
+   out[B] = 0;
+   for (i=1;i<N/2;i++)
+   {
+      out[i] = buf[2*i-1];
+      out[B+i] = buf[2*i];
+   }
+   out[N/2] = buf[N-1];
+   out[B+N/2] = 0;
+}
+
+/* Inverse FFT of a split spectrum */
+static void mdf_ifft_size(EchoWorker *w, void *table, int N, int S, const spx_word16_t *in, spx_word16_t *out)
+{
+   int i;
+   const int B = S/2;
+   spx_word16_t *buf = w->fft_buf;
+   buf[0] = in[0];
+   for (i=1;i<N/2;i++)
+   {
+      buf[2*i-1] = in[i];
+      buf[2*i] = in[B+i];
+   }
+   buf[N-1] = in[N/2];
+   spx_ifft(table, buf, out);
+}
+#else
+#define mdf_fft_size(w, table, N, S, in, out) spx_fft(table, in, out)
+#define mdf_ifft_size(w, table, N, S, in, out) spx_ifft(table, in, out)
+#endif
+#define mdf_fft(w, in, out) mdf_fft_size(w, (w)->fft_table, (w)->st->window_size, (w)->st->spec_size, in, out)
+#define mdf_ifft(w, in, out) mdf_ifft_size(w, (w)->fft_table, (w)->st->window_size, (w)->st->spec_size, in, out)
+/* FFTs of the block size of tier t */
+#define tier_fft(w, t, in, out) mdf_fft_size(w, (w)->tier_fft[t], 2*(w)->st->tiers[t].block, (w)->st->tiers[t].spec_size, in, out)
+#define tier_ifft(w, t, in, out) mdf_ifft_size(w, (w)->tier_fft[t], 2*(w)->st->tiers[t].block, (w)->st->tiers[t].spec_size, in, out)
+
+static void echo_worker_init(SpeexEchoState *st, EchoWorker *w)
+{
+   int t;
+   const int N = st->max_window;
+   w->st = st;
+   w->fft_table = spx_fft_init(st->window_size);
+   w->tier_fft = (void**)speex_alloc((st->nb_tiers+1)*sizeof(void*));
+   for (t=0;t<st->nb_tiers;t++)
+      w->tier_fft[t] = spx_fft_init(2*st->tiers[t].block);
+   w->wtmp = (spx_word16_t*)speex_alloc(N*sizeof(spx_word16_t));
+#ifdef FIXED_POINT
+   w->wtmp2 = (spx_word16_t*)speex_alloc(N*sizeof(spx_word16_t));
+#endif
+#ifdef SPLIT_SPECTRUM
+   w->fft_buf = (spx_word16_t*)speex_alloc(N*sizeof(spx_word16_t));
+#endif
+}
+
+static void echo_worker_destroy(EchoWorker *w)
+{
+   int t;
+   spx_fft_destroy(w->fft_table);
+   for (t=0;t<w->st->nb_tiers;t++)
+      spx_fft_destroy(w->tier_fft[t]);
+   speex_free(w->tier_fft);
+   speex_free(w->wtmp);
+#ifdef FIXED_POINT
+   speex_free(w->wtmp2);
+#endif
+#ifdef SPLIT_SPECTRUM
+   speex_free(w->fft_buf);
+#endif
+}
+
+#ifdef USE_PTHREADS
+/* Takes tasks of the current batch one by one until there are none left */
+static void echo_work(void *arg, int id)
+{
+   SpeexEchoState *st = (SpeexEchoState *)arg;
+   int i;
+   while ((i = spx_pool_next(st->pool)) < st->nb_tasks)
+      st->task(st, i, &st->workers[id]);
+}
+#endif
+
+/* Calls task(st, i, w) for i from 0 to nb_tasks-1, spread over the calling
+   thread and the worker threads, and returns once all are done */
+static void echo_run_tasks(SpeexEchoState *st, echo_task_func task, int nb_tasks)
+{
+   int i;
+#ifdef USE_PTHREADS
+   if (st->pool && nb_tasks > 1)
+   {
+      st->task = task;
+      st->nb_tasks = nb_tasks;
+      spx_pool_run(st->pool);
+      return;
+   }
+#endif
+   for (i=0;i<nb_tasks;i++)
+      task(st, i, &st->workers[0]);
+}
+
+/* Replaces the worker threads with nb_threads new ones. Returns -1, with
+   the threads left as they were, if they can't all be started. */
+static int echo_set_threads(SpeexEchoState *st, int nb_threads)
+{
+#ifdef USE_PTHREADS
+   int i;
+   EchoWorker *workers = NULL;
+   SpxThreadPool *pool = NULL;
+   if (nb_threads < 0)
+      return -1;
+   if (nb_threads > 0)
+   {
+      workers = (EchoWorker *)speex_alloc((nb_threads+1)*sizeof(EchoWorker));
+      if (!workers)
+         return -1;
+      for (i=0;i<nb_threads;i++)
+         echo_worker_init(st, &workers[i+1]);
+      /* The new workers only look at st->workers once they are given tasks,
+         which is after the swap below */
+      pool = spx_pool_create(nb_threads, echo_work, st);
+      if (!pool)
+      {
+         for (i=0;i<nb_threads;i++)
+            echo_worker_destroy(&workers[i+1]);
+         speex_free(workers);
+         return -1;
+      }
+   }
+
+   if (st->pool)
+      spx_pool_destroy(st->pool);
+   for (i=0;i<st->nb_threads;i++)
+      echo_worker_destroy(&st->workers[i+1]);
+   if (workers)
+   {
+      workers[0] = st->workers[0];
+      speex_free(st->workers);
+      st->workers = workers;
+   }
+   st->pool = pool;
+   st->nb_threads = nb_threads;
+   return 0;
+#else
+   /* Without thread support, no worker can be started */
+   (void)st;
+   return nb_threads == 0 ? 0 : -1;
+#endif
 }
 
-static inline void mdf_adjust_prop(const spx_word32_t *W, int N, int M, int P, spx_word16_t *prop)
+/* Weight amplitude of partitions start to end-1 of M partitions of N values,
+   for partitions that cover 2^shift frames. The amplitude is scaled down to
+   one frame of filter length so that partitions of different sizes can be
+   compared. */
+static void mdf_partition_amp(const spx_word32_t *W, int N, int M, int P, int shift, int start, int end, spx_word16_t *amp)
 {
    int i, j, p;
-   spx_word16_t max_sum = 1;
-   spx_word32_t prop_sum = 1;
-   for (i=0;i<M;i++)
+   for (i=start;i<end;i++)
    {
       spx_word32_t tmp = 1;
       for (p=0;p<P;p++)
          for (j=0;j<N;j++)
-            tmp += MULT16_16(EXTRACT16(SHR32(W[p*N*M + i*N+j],18)), EXTRACT16(SHR32(W[p*N*M + i*N+j],18)));
+            tmp += MULT16_16(EXTRACT16(SHR32(W[p*N*M + i*N+j],18+shift)), EXTRACT16(SHR32(W[p*N*M + i*N+j],18+shift)));
 #ifdef FIXED_POINT
       /* Just a security in case an overflow were to occur */
       tmp = MIN32(ABS32(tmp), 536870912);
+      amp[i] = spx_sqrt(tmp);
+#else
+      amp[i] = spx_sqrt(tmp)/(1<<shift);
 #endif
-      prop[i] = spx_sqrt(tmp);
+   }
+}
+
+static inline void mdf_adjust_prop(const spx_word16_t *amp, int M, spx_word16_t *prop)
+{
+   int i;
+   spx_word16_t max_sum = 1;
+   spx_word32_t prop_sum = 1;
+   for (i=0;i<M;i++)
+   {
+      prop[i] = amp[i];
       if (prop[i] > max_sum)
          max_sum = prop[i];
    }
@@ -376,6 +782,42 @@ static inline void mdf_adjust_prop(const spx_word32_t *W, int N, int M, int P, s
    /*printf ("\n");*/
 }
 
+/* mdf_adjust_prop() over the partitions of the head and of the tiers, where
+   a tier partition gets the rate of as many frames as it covers */
+static void mdf_tiers_prop(SpeexEchoState *st)
+{
+   int i, t, s = 0;
+   spx_word16_t max_sum = 1;
+   spx_word16_t min_prop;
+   spx_word32_t prop_sum = 1;
+   for (i=0;i<st->M;i++)
+      max_sum = MAX16(max_sum, st->amp[i]);
+   for (t=0;t<st->nb_tiers;t++)
+      for (i=0;i<st->tiers[t].M;i++)
+         max_sum = MAX16(max_sum, st->tiers[t].amp[i]);
+   min_prop = MULT16_16_Q15(QCONST16(.1f,15),max_sum);
+   for (i=0;i<st->M;i++)
+      prop_sum += EXTEND32(ADD16(st->amp[i], min_prop));
+   for (t=0;t<st->nb_tiers;t++)
+      for (i=0;i<st->tiers[t].M;i++)
+         prop_sum += MULT16_16(ADD16(st->tiers[t].amp[i], min_prop), st->tiers[t].frames);
+#ifdef FIXED_POINT
+   /* Keep the numerators below in 16 bits */
+   while (SHR32(prop_sum, s) > 32767)
+      s++;
+#else
+   (void)s;
+#endif
+   for (i=0;i<st->M;i++)
+      st->prop[i] = DIV32(MULT16_16(QCONST16(.99f,15), EXTRACT16(SHR32(EXTEND32(ADD16(st->amp[i], min_prop)), s))), SHR32(prop_sum, s));
+   for (t=0;t<st->nb_tiers;t++)
+   {
+      EchoTier *tier = &st->tiers[t];
+      for (i=0;i<tier->M;i++)
+         tier->prop[i] = DIV32(MULT16_16(QCONST16(.99f,15), EXTRACT16(SHR32(MULT16_16(ADD16(tier->amp[i], min_prop), tier->frames), s))), SHR32(prop_sum, s));
+   }
+}
+
 #ifdef DUMP_ECHO_CANCEL_DATA
 #include <stdio.h>
 static FILE *rFile=NULL, *pFile=NULL, *oFile=NULL;
@@ -400,7 +842,61 @@ EXPORT SpeexEchoState *speex_echo_state_init(int frame_size, int filter_length)
 
 EXPORT SpeexEchoState *speex_echo_state_init_mc(int frame_size, int filter_length, int nb_mic, int nb_speakers)
 {
-   int i,N,M, C, K;
+   return speex_echo_state_init_partitioned(frame_size, filter_length, nb_mic, nb_speakers, frame_size);
+}
+
+/* Initial adaptation rate of M partitions, decreasing along the filter */
+static void mdf_init_prop(spx_word16_t *prop, int M)
+{
+   int i;
+   spx_word32_t sum = 0;
+   /* Ratio of ~10 between adaptation rate of first and last block */
+   spx_word16_t decay = SHR32(spx_exp(NEG16(DIV32_16(QCONST16(2.4,11),M))),1);
+   prop[0] = QCONST16(.7, 15);
+   sum = EXTEND32(prop[0]);
+   for (i=1;i<M;i++)
+   {
+      prop[i] = MULT16_16_Q15(prop[i-1], decay);
+      sum = ADD32(sum, EXTEND32(prop[i]));
+   }
+   for (i=M-1;i>=0;i--)
+   {
+      prop[i] = DIV32(MULT16_16(QCONST16(.8f,15), prop[i]),sum);
+   }
+}
+
+/* The head of the filter covers the largest power of two times frame_size
+   that fits in max_block, with partitions of frame_size, and a single tier
+   with partitions of that size covers the rest. A tier needs about as many
+   FFTs per sample as the head whatever its block size, so a chain of
+   growing blocks costs more in FFTs than it saves in products.
+   Returns the number of tiers and fills tiers when it isn't NULL. */
+static int mdf_tier_layout(int frame_size, int filter_length, int max_block, EchoTier *tiers)
+{
+   int block = frame_size;
+   int shift = 0;
+   while (2*block <= max_block)
+   {
+      block *= 2;
+      shift++;
+   }
+   if (shift == 0 || filter_length <= block)
+      return 0;
+   if (tiers)
+   {
+      tiers[0].block = block;
+      tiers[0].shift = shift;
+      tiers[0].M = (filter_length-1)/block;
+      tiers[0].delay = block;
+   }
+   return 1;
+}
+
+EXPORT SpeexEchoState *speex_echo_state_init_partitioned(int frame_size, int filter_length, int nb_mic, int nb_speakers, int max_block)
+{
+   int i,N,S,M, C, K, t;
+   int total;
+   spx_word16_t *prop = NULL;
    SpeexEchoState *st = (SpeexEchoState *)speex_alloc(sizeof(SpeexEchoState));
 
    st->K = nb_speakers;
@@ -418,7 +914,29 @@ EXPORT SpeexEchoState *speex_echo_state_init_mc(int frame_size, int filter_lengt
    st->frame_size = frame_size;
    st->window_size = 2*frame_size;
    N = st->window_size;
-   M = st->M = (filter_length+st->frame_size-1)/frame_size;
+   S = st->spec_size = SPECTRUM_SIZE(frame_size);
+   M = (filter_length+st->frame_size-1)/frame_size;
+   st->max_window = N;
+   st->nb_tiers = mdf_tier_layout(frame_size, filter_length, max_block, NULL);
+   if (st->nb_tiers)
+   {
+      st->tiers = (EchoTier*)speex_alloc(st->nb_tiers*sizeof(EchoTier));
+      mdf_tier_layout(frame_size, filter_length, max_block, st->tiers);
+      M = st->tiers[0].delay/frame_size;
+   }
+   st->M = M;
+   total = M*frame_size;
+   st->hist_size = frame_size;
+   for (t=0;t<st->nb_tiers;t++)
+   {
+      EchoTier *tier = &st->tiers[t];
+      total += tier->M*tier->block;
+      if (st->hist_size < frame_size+tier->delay+tier->block)
+         st->hist_size = frame_size+tier->delay+tier->block;
+      if (st->max_window < 2*tier->block)
+         st->max_window = 2*tier->block;
+   }
+   st->adapt_M = total/frame_size;
    st->cancel_count=0;
    st->sum_adapt = 0;
    st->saturated = 0;
@@ -435,34 +953,33 @@ EXPORT SpeexEchoState *speex_echo_state_init_mc(int frame_size, int filter_lengt
 #endif
    st->leak_estimate = 0;
 
-   st->fft_table = spx_fft_init(N);
+   st->workers = (EchoWorker*)speex_alloc(sizeof(EchoWorker));
+   echo_worker_init(st, &st->workers[0]);
 
    st->e = (spx_word16_t*)speex_alloc(C*N*sizeof(spx_word16_t));
    st->x = (spx_word16_t*)speex_alloc(K*N*sizeof(spx_word16_t));
    st->input = (spx_word16_t*)speex_alloc(C*st->frame_size*sizeof(spx_word16_t));
    st->y = (spx_word16_t*)speex_alloc(C*N*sizeof(spx_word16_t));
    st->last_y = (spx_word16_t*)speex_alloc(C*N*sizeof(spx_word16_t));
-   st->Yf = (spx_word32_t*)speex_alloc((st->frame_size+1)*sizeof(spx_word32_t));
-   st->Rf = (spx_word32_t*)speex_alloc((st->frame_size+1)*sizeof(spx_word32_t));
-   st->Xf = (spx_word32_t*)speex_alloc((st->frame_size+1)*sizeof(spx_word32_t));
+   st->Yf = (spx_word32_t*)speex_alloc((S/2+1)*sizeof(spx_word32_t));
+   st->Rf = (spx_word32_t*)speex_alloc((S/2+1)*sizeof(spx_word32_t));
+   st->Xf = (spx_word32_t*)speex_alloc((S/2+1)*sizeof(spx_word32_t));
    st->Yh = (spx_word32_t*)speex_alloc((st->frame_size+1)*sizeof(spx_word32_t));
    st->Eh = (spx_word32_t*)speex_alloc((st->frame_size+1)*sizeof(spx_word32_t));
 
-   st->X = (spx_word16_t*)speex_alloc(K*(M+1)*N*sizeof(spx_word16_t));
-   st->Y = (spx_word16_t*)speex_alloc(C*N*sizeof(spx_word16_t));
-   st->E = (spx_word16_t*)speex_alloc(C*N*sizeof(spx_word16_t));
-   st->W = (spx_word32_t*)speex_alloc(C*K*M*N*sizeof(spx_word32_t));
+   st->X = (spx_word16_t*)speex_alloc(K*(M+1)*S*sizeof(spx_word16_t));
+   st->X_pos = 0;
+   st->Y = (spx_word16_t*)speex_alloc(C*S*sizeof(spx_word16_t));
+   st->E = (spx_word16_t*)speex_alloc(C*S*sizeof(spx_word16_t));
+   st->W = (spx_word32_t*)speex_alloc(C*K*M*S*sizeof(spx_word32_t));
 #ifdef TWO_PATH
-   st->foreground = (spx_word16_t*)speex_alloc(M*N*C*K*sizeof(spx_word16_t));
+   st->foreground = (spx_word16_t*)speex_alloc(M*S*C*K*sizeof(spx_word16_t));
 #endif
-   st->PHI = (spx_word32_t*)speex_alloc(N*sizeof(spx_word32_t));
    st->power = (spx_word32_t*)speex_alloc((frame_size+1)*sizeof(spx_word32_t));
-   st->power_1 = (spx_float_t*)speex_alloc((frame_size+1)*sizeof(spx_float_t));
+   st->power_1 = (spx_float_t*)speex_alloc((S/2+1)*sizeof(spx_float_t));
    st->window = (spx_word16_t*)speex_alloc(N*sizeof(spx_word16_t));
    st->prop = (spx_word16_t*)speex_alloc(M*sizeof(spx_word16_t));
-   st->wtmp = (spx_word16_t*)speex_alloc(N*sizeof(spx_word16_t));
 #ifdef FIXED_POINT
-   st->wtmp2 = (spx_word16_t*)speex_alloc(N*sizeof(spx_word16_t));
    for (i=0;i<N>>1;i++)
    {
       st->window[i] = (16383-SHL16(spx_cos(DIV32_16(MULT16_16(25736,i<<1),N)),1));
@@ -474,24 +991,63 @@ EXPORT SpeexEchoState *speex_echo_state_init_mc(int frame_size, int filter_lengt
 #endif
    for (i=0;i<=st->frame_size;i++)
       st->power_1[i] = FLOAT_ONE;
-   for (i=0;i<N*M*K*C;i++)
+   for (i=0;i<S*M*K*C;i++)
       st->W[i] = 0;
+   st->amp = (spx_word16_t*)speex_alloc(M*sizeof(spx_word16_t));
+   st->sparse = 0;
+   st->first = 0;
+   st->last = M;
+   st->probe = 0;
+   st->used_first = 0;
+   st->used_last = M;
+   st->delay = NULL;
+   st->silent = 0;
+   st->skipped = 0;
+   if (st->nb_tiers)
    {
-      spx_word32_t sum = 0;
-      /* Ratio of ~10 between adaptation rate of first and last block */
-      spx_word16_t decay = SHR32(spx_exp(NEG16(DIV32_16(QCONST16(2.4,11),M))),1);
-      st->prop[0] = QCONST16(.7, 15);
-      sum = EXTEND32(st->prop[0]);
-      for (i=1;i<M;i++)
-      {
-         st->prop[i] = MULT16_16_Q15(st->prop[i-1], decay);
-         sum = ADD32(sum, EXTEND32(st->prop[i]));
-      }
-      for (i=M-1;i>=0;i--)
+      /* The initial rates are those of a filter of adapt_M frames, and a
+         tier partition gets those of the frames it covers */
+      st->hist = (spx_word16_t*)speex_alloc(K*st->hist_size*sizeof(spx_word16_t));
+      prop = (spx_word16_t*)speex_alloc(st->adapt_M*sizeof(spx_word16_t));
+      mdf_init_prop(prop, st->adapt_M);
+      SPEEX_COPY(st->prop, prop, M);
+   } else {
+      mdf_init_prop(st->prop, M);
+   }
+   for (t=0;t<st->nb_tiers;t++)
+   {
+      EchoTier *tier = &st->tiers[t];
+      const int B = tier->block;
+      const int TS = tier->spec_size = SPECTRUM_SIZE(B);
+      const int TM = tier->M;
+      tier->frames = B/frame_size;
+      tier->X = (spx_word16_t*)speex_alloc(K*(TM+1)*TS*sizeof(spx_word16_t));
+      tier->W = (spx_word32_t*)speex_alloc(C*K*TM*TS*sizeof(spx_word32_t));
+#ifdef TWO_PATH
+      tier->foreground = (spx_word16_t*)speex_alloc(C*K*TM*TS*sizeof(spx_word16_t));
+      tier->yf = (spx_word16_t*)speex_alloc(C*2*B*sizeof(spx_word16_t));
+#endif
+      tier->y = (spx_word16_t*)speex_alloc(C*2*B*sizeof(spx_word16_t));
+      tier->Y = (spx_word16_t*)speex_alloc(C*TS*sizeof(spx_word16_t));
+      tier->e = (spx_word16_t*)speex_alloc(C*2*B*sizeof(spx_word16_t));
+      tier->E = (spx_word16_t*)speex_alloc(C*TS*sizeof(spx_word16_t));
+      tier->power = (spx_word32_t*)speex_alloc((TS/2+1)*sizeof(spx_word32_t));
+      tier->power_1 = (spx_float_t*)speex_alloc((TS/2+1)*sizeof(spx_float_t));
+      tier->Xf = (spx_word32_t*)speex_alloc((TS/2+1)*sizeof(spx_word32_t));
+      tier->prop = (spx_word16_t*)speex_alloc(TM*sizeof(spx_word16_t));
+      tier->amp = (spx_word16_t*)speex_alloc(TM*sizeof(spx_word16_t));
+      for (i=0;i<=B;i++)
+         tier->power_1[i] = FLOAT_ONE;
+      for (i=0;i<TM;i++)
       {
-         st->prop[i] = DIV32(MULT16_16(QCONST16(.8f,15), st->prop[i]),sum);
+         int j, f = (tier->delay/frame_size) + i*tier->frames;
+         tier->prop[i] = 0;
+         for (j=0;j<tier->frames && f+j<st->adapt_M;j++)
+            tier->prop[i] = ADD16(tier->prop[i], prop[f+j]);
       }
    }
+   if (st->nb_tiers)
+      speex_free(prop);
 
    st->memX = (spx_word16_t*)speex_alloc(K*sizeof(spx_word16_t));
    st->memD = (spx_word16_t*)speex_alloc(C*sizeof(spx_word16_t));
@@ -517,27 +1073,108 @@ EXPORT SpeexEchoState *speex_echo_state_init_mc(int frame_size, int filter_lengt
    st->play_buf_pos = PLAYBACK_DELAY*st->frame_size;
    st->play_buf_started = 0;
 
+   st->chan_sums = (spx_word32_t*)speex_alloc(3*C*sizeof(spx_word32_t));
+
+#if defined(USE_AVX2) && !defined(FIXED_POINT)
+   st->use_avx2 = speex_cpu_has_avx2();
+#else
+   st->use_avx2 = 0;
+#endif
+
    return st;
 }
 
-/** Resets echo canceller state */
-EXPORT void speex_echo_state_reset(SpeexEchoState *st)
+static void mdf_delay_reset(SpeexEchoState *st)
 {
-   int i, M, N, C, K;
+   int i;
+   EchoDelay *dl = st->delay;
+   const int R = dl->max+2;
+   dl->delay = 0;
+   dl->pos = 0;
+   dl->best = 0;
+   dl->count = 0;
+   dl->frames = 0;
+   for (i=0;i<st->K*R*st->frame_size;i++)
+      dl->buf[i] = 0;
+   for (i=0;i<R;i++)
+   {
+      dl->bits[i] = 0;
+      dl->on[i] = 0;
+   }
+   /* Unrelated binary spectra disagree on half the bands */
+   for (i=0;i<=dl->max;i++)
+      dl->cost[i] = dl->bands<<7;
+   for (i=0;i<st->window_size;i++)
+      dl->far[i] = dl->near[i] = 0;
+   for (i=0;i<DELAY_BANDS;i++)
+      dl->far_avg[i] = dl->near_avg[i] = 0;
+   dl->far_level = 0;
+}
+
+static void mdf_delay_destroy(EchoDelay *dl)
+{
+   speex_free(dl->buf);
+   speex_free(dl->bits);
+   speex_free(dl->on);
+   speex_free(dl->cost);
+   speex_free(dl->far);
+   speex_free(dl->near);
+   speex_free(dl->spec);
+   speex_free(dl->ps);
+   speex_free(dl);
+}
+
+/* Starts searching delays of up to max frames, or stops if max is 0 */
+static void mdf_delay_init(SpeexEchoState *st, int max)
+{
+   EchoDelay *dl;
+   if (st->delay)
+      mdf_delay_destroy(st->delay);
+   st->delay = NULL;
+   if (max <= 0)
+      return;
+   dl = (EchoDelay*)speex_alloc(sizeof(EchoDelay));
+   dl->max = max;
+   dl->bands = st->frame_size/2 < DELAY_BANDS ? st->frame_size/2 : DELAY_BANDS;
+   dl->buf = (spx_word16_t*)speex_alloc(st->K*(max+2)*st->frame_size*sizeof(spx_word16_t));
+   dl->bits = (spx_uint32_t*)speex_alloc((max+2)*sizeof(spx_uint32_t));
+   dl->on = (int*)speex_alloc((max+2)*sizeof(int));
+   dl->cost = (int*)speex_alloc((max+1)*sizeof(int));
+   dl->far = (spx_word16_t*)speex_alloc(st->window_size*sizeof(spx_word16_t));
+   dl->near = (spx_word16_t*)speex_alloc(st->window_size*sizeof(spx_word16_t));
+   dl->spec = (spx_word16_t*)speex_alloc(st->spec_size*sizeof(spx_word16_t));
+   dl->ps = (spx_word32_t*)speex_alloc((st->spec_size/2+1)*sizeof(spx_word32_t));
+   st->delay = dl;
+   mdf_delay_reset(st);
+}
+
+/* Resets the filter and the signal history. This is also what happens when
+   the canceller resets itself, so what it has learnt about the system
+   rather than the echo path (the bulk delay) and what the application sees
+   across frames (the skipped frame count) are left alone. */
+static void echo_state_reset(SpeexEchoState *st)
+{
+   int i, t, M, N, S, C, K;
    st->cancel_count=0;
    st->screwed_up = 0;
    N = st->window_size;
+   S = st->spec_size;
    M = st->M;
    C=st->C;
    K=st->K;
-   for (i=0;i<N*M;i++)
+   for (i=0;i<S*M;i++)
       st->W[i] = 0;
 #ifdef TWO_PATH
-   for (i=0;i<N*M;i++)
+   for (i=0;i<S*M;i++)
       st->foreground[i] = 0;
 #endif
-   for (i=0;i<N*(M+1);i++)
+   for (i=0;i<S*(M+1);i++)
       st->X[i] = 0;
+   st->X_pos = 0;
+   for (i=0;i<M;i++)
+      st->amp[i] = 0;
+   st->used_first = 0;
+   st->used_last = M;
    for (i=0;i<=st->frame_size;i++)
    {
       st->power[i] = 0;
@@ -549,7 +1186,7 @@ EXPORT void speex_echo_state_reset(SpeexEchoState *st)
    {
       st->last_y[i] = 0;
    }
-   for (i=0;i<N*C;i++)
+   for (i=0;i<S*C;i++)
    {
       st->E[i] = 0;
    }
@@ -563,6 +1200,38 @@ EXPORT void speex_echo_state_reset(SpeexEchoState *st)
       st->memD[i]=st->memE[i]=0;
    for (i=0;i<K;i++)
       st->memX[i]=0;
+   for (t=0;t<st->nb_tiers;t++)
+   {
+      EchoTier *tier = &st->tiers[t];
+      const int TS = tier->spec_size, TM = tier->M;
+      for (i=0;i<C*K*TM*TS;i++)
+         tier->W[i] = 0;
+#ifdef TWO_PATH
+      for (i=0;i<C*K*TM*TS;i++)
+         tier->foreground[i] = 0;
+      for (i=0;i<C*2*tier->block;i++)
+         tier->yf[i] = 0;
+#endif
+      for (i=0;i<K*(TM+1)*TS;i++)
+         tier->X[i] = 0;
+      for (i=0;i<C*2*tier->block;i++)
+         tier->y[i] = tier->e[i] = 0;
+      for (i=0;i<=tier->block;i++)
+      {
+         tier->power[i] = 0;
+         tier->power_1[i] = FLOAT_ONE;
+      }
+      for (i=0;i<TM;i++)
+         tier->amp[i] = 0;
+      tier->X_pos = 0;
+      tier->phase = 0;
+      tier->count = 0;
+   }
+   if (st->nb_tiers)
+   {
+      for (i=0;i<K*st->hist_size;i++)
+         st->hist[i] = 0;
+   }
 
    st->saturated = 0;
    st->adapted = 0;
@@ -576,13 +1245,26 @@ EXPORT void speex_echo_state_reset(SpeexEchoState *st)
       st->play_buf[i] = 0;
    st->play_buf_pos = PLAYBACK_DELAY*st->frame_size;
    st->play_buf_started = 0;
+   st->silent = 0;
+}
 
+/** Resets echo canceller state */
+EXPORT void speex_echo_state_reset(SpeexEchoState *st)
+{
+   echo_state_reset(st);
+   st->skipped = 0;
+   if (st->delay)
+      mdf_delay_reset(st);
 }
 
 /** Destroys an echo canceller state */
 EXPORT void speex_echo_state_destroy(SpeexEchoState *st)
 {
-   spx_fft_destroy(st->fft_table);
+   int t;
+   echo_set_threads(st, 0);
+   echo_worker_destroy(&st->workers[0]);
+   speex_free(st->workers);
+   speex_free(st->chan_sums);
 
    speex_free(st->e);
    speex_free(st->x);
@@ -602,21 +1284,40 @@ EXPORT void speex_echo_state_destroy(SpeexEchoState *st)
 #ifdef TWO_PATH
    speex_free(st->foreground);
 #endif
-   speex_free(st->PHI);
    speex_free(st->power);
    speex_free(st->power_1);
    speex_free(st->window);
    speex_free(st->prop);
-   speex_free(st->wtmp);
-#ifdef FIXED_POINT
-   speex_free(st->wtmp2);
-#endif
    speex_free(st->memX);
    speex_free(st->memD);
    speex_free(st->memE);
    speex_free(st->notch_mem);
 
    speex_free(st->play_buf);
+   if (st->delay)
+      mdf_delay_destroy(st->delay);
+   for (t=0;t<st->nb_tiers;t++)
+   {
+      EchoTier *tier = &st->tiers[t];
+      speex_free(tier->X);
+      speex_free(tier->W);
+#ifdef TWO_PATH
+      speex_free(tier->foreground);
+      speex_free(tier->yf);
+#endif
+      speex_free(tier->y);
+      speex_free(tier->Y);
+      speex_free(tier->e);
+      speex_free(tier->E);
+      speex_free(tier->power);
+      speex_free(tier->power_1);
+      speex_free(tier->Xf);
+      speex_free(tier->prop);
+      speex_free(tier->amp);
+   }
+   speex_free(st->tiers);
+   speex_free(st->hist);
+   speex_free(st->amp);
    speex_free(st);
 
 #ifdef DUMP_ECHO_CANCEL_DATA
@@ -682,39 +1383,645 @@ EXPORT void speex_echo_cancel(SpeexEchoState *st, const spx_int16_t *in, const s
    speex_echo_cancellation(st, in, far_end, out);
 }
 
-/** Performs echo cancellation on a frame */
-EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, const spx_int16_t *far_end, spx_int16_t *out)
+/* Frequency-domain adaptation mask of bin i of the frame spectrum, for a
+   far-end power of power */
+static inline spx_float_t mdf_adapt_mask(SpeexEchoState *st, int i, spx_word16_t RER, spx_word32_t power)
 {
-   int i,j, chan, speak;
-   int N,M, C, K;
-   spx_word32_t Syy,See,Sxx,Sdd, Sff;
-#ifdef TWO_PATH
-   spx_word32_t Dbf;
-   int update_foreground;
+   spx_word32_t r, e;
+   r = MULT16_32_Q15(st->leak_estimate,SHL32(st->Yf[i],3));
+   e = SHL32(st->Rf[i],3)+1;
+#ifdef FIXED_POINT
+   if (r>SHR32(e,1))
+      r = SHR32(e,1);
+#else
+   if (r>.5*e)
+      r = .5*e;
 #endif
-   spx_word32_t Sey;
-   spx_word16_t ss, ss_1;
-   spx_float_t Pey = FLOAT_ONE, Pyy=FLOAT_ONE;
-   spx_float_t alpha, alpha_1;
-   spx_word16_t RER;
-   spx_word32_t tmp32;
+   r = MULT16_32_Q15(QCONST16(.7,15),r) + MULT16_32_Q15(QCONST16(.3,15),(spx_word32_t)(MULT16_32_Q15(RER,e)));
+   /*st->power_1[i] = adapt_rate*r/(e*(1+st->power[i]));*/
+   return FLOAT_SHL(FLOAT_DIV32_FLOAT(r,FLOAT_MUL32U(e,power+10)),WEIGHT_SHIFT+16);
+}
 
-   N = st->window_size;
-   M = st->M;
-   C = st->C;
-   K = st->K;
+/* Converts the far end block of one loudspeaker to the frequency domain for
+   the current tier */
+static void echo_task_tier_far_end(SpeexEchoState *st, int speak, EchoWorker *w)
+{
+   const int t = st->cur_tier;
+   EchoTier *tier = &st->tiers[t];
+   const int B = tier->block;
+   /* The block starts at the current frame, delayed by tier->delay, and is
+      preceded by the block before it */
+   spx_word16_t *x = st->hist + speak*st->hist_size + st->hist_size - st->frame_size - tier->delay - B;
+   tier_fft(w, t, x, &tier->X[tier->X_pos*tier->spec_size*st->K+speak*tier->spec_size]);
+}
 
-   st->cancel_count++;
-#ifdef FIXED_POINT
-   ss=DIV32_16(11469,M);
-   ss_1 = SUB16(32767,ss);
-#else
-   ss=.35/M;
-   ss_1 = 1-ss;
+/* Filters the far end with the current tier of one microphone, for a whole
+   block */
+static void echo_task_tier_filter(SpeexEchoState *st, int chan, EchoWorker *w)
+{
+   const int t = st->cur_tier;
+   EchoTier *tier = &st->tiers[t];
+   const int B = tier->block, S = tier->spec_size, M = tier->M, K = st->K;
+   MDF_KERNEL(st, spectral_mul_accum)(tier->X, tier->X_pos*K, (M+1)*K, tier->W+chan*S*K*M, tier->Y+chan*S, S, M*K);
+   tier_ifft(w, t, tier->Y+chan*S, tier->y+chan*2*B);
+#ifdef TWO_PATH
+   MDF_KERNEL(st, spectral_mul_accum16)(tier->X, tier->X_pos*K, (M+1)*K, tier->foreground+chan*S*K*M, tier->Y+chan*S, S, M*K);
+   tier_ifft(w, t, tier->Y+chan*S, tier->yf+chan*2*B);
 #endif
+}
 
-   for (chan = 0; chan < C; chan++)
-   {
+/* Converts the error of the block that just ended to the frequency domain */
+static void echo_task_tier_error(SpeexEchoState *st, int chan, EchoWorker *w)
+{
+   const int t = st->cur_tier;
+   EchoTier *tier = &st->tiers[t];
+   tier_fft(w, t, tier->e+chan*2*tier->block, tier->E+chan*tier->spec_size);
+}
+
+/* Gradient step and constraint on the weights of the current tier for one
+   microphone and loudspeaker pair, once a block */
+static void echo_task_tier_adapt(SpeexEchoState *st, int index, EchoWorker *w)
+{
+   int i, j;
+   const int t = st->cur_tier;
+   EchoTier *tier = &st->tiers[t];
+   const int B = tier->block, N = 2*B, S = tier->spec_size, M = tier->M, K = st->K;
+   const int chan = index/K, speak = index%K;
+   spx_word32_t *W = tier->W + chan*S*K*M + speak*S;
+
+   /* Compute weight gradient, the blocks in X being those of the error */
+   for (j=M-1;j>=0;j--)
+   {
+      const int slot = tier->X_pos+j <= M ? tier->X_pos+j : tier->X_pos+j-M-1;
+      MDF_KERNEL(st, weighted_spectral_mul_conj)(tier->power_1, FLOAT_SHL(PSEUDOFLOAT(tier->prop[j]),-15), &tier->X[slot*S*K+speak*S], tier->E+chan*S, W + j*S*K, S);
+   }
+
+   /* Update weight to prevent circular convolution (AUMDF, as above) */
+   for (j=0;j<M;j++)
+   {
+      if (j==0 || tier->count%(M-1) == j-1)
+      {
+#ifdef FIXED_POINT
+         for (i=0;i<N;i++)
+            w->wtmp2[i] = EXTRACT16(PSHR32(W[j*S*K + i],NORMALIZE_SCALEDOWN+16));
+         tier_ifft(w, t, w->wtmp2, w->wtmp);
+         for (i=0;i<B;i++)
+         {
+            w->wtmp[i]=0;
+         }
+         for (i=B;i<N;i++)
+         {
+            w->wtmp[i]=SHL16(w->wtmp[i],NORMALIZE_SCALEUP);
+         }
+         tier_fft(w, t, w->wtmp, w->wtmp2);
+         for (i=0;i<N;i++)
+            W[j*S*K + i] -= SHL32(EXTEND32(w->wtmp2[i]),16+NORMALIZE_SCALEDOWN-NORMALIZE_SCALEUP-1);
+#else
+         tier_ifft(w, t, W + j*S*K, w->wtmp);
+         for (i=B;i<N;i++)
+         {
+            w->wtmp[i]=0;
+         }
+         tier_fft(w, t, w->wtmp, W + j*S*K);
+#endif
+      }
+   }
+}
+
+/* Starts a block of each tier whose last one just ended: computes its output
+   for the whole block */
+static void echo_tiers_start(SpeexEchoState *st)
+{
+   int t, i, speak;
+   const int K = st->K;
+   if (!st->nb_tiers)
+      return;
+   /* Keep the far-end history for the blocks */
+   for (speak = 0; speak < K; speak++)
+   {
+      spx_word16_t *hist = st->hist + speak*st->hist_size;
+      SPEEX_MOVE(hist, hist+st->frame_size, st->hist_size-st->frame_size);
+      SPEEX_COPY(hist+st->hist_size-st->frame_size, st->x+speak*st->window_size+st->frame_size, st->frame_size);
+   }
+   for (t=0;t<st->nb_tiers;t++)
+   {
+      EchoTier *tier = &st->tiers[t];
+      spx_word16_t ss, ss_1;
+      if (tier->phase != 0)
+         continue;
+      st->cur_tier = t;
+      tier->X_pos = tier->X_pos ? tier->X_pos-1 : tier->M;
+      echo_run_tasks(st, echo_task_tier_far_end, K);
+      echo_run_tasks(st, echo_task_tier_filter, st->C);
+
+      /* Smooth far end energy estimate over time */
+#ifdef FIXED_POINT
+      ss=DIV32_16(MULT16_16(11469,tier->frames),st->adapt_M);
+      ss_1 = SUB16(32767,ss);
+#else
+      ss=.35*tier->frames/st->adapt_M;
+      ss_1 = 1-ss;
+#endif
+      for (i=0;i<=tier->block;i++)
+         tier->Xf[i] = 0;
+      for (speak = 0; speak < K; speak++)
+         MDF_KERNEL(st, power_spectrum_accum)(tier->X+tier->X_pos*tier->spec_size*K+speak*tier->spec_size, tier->Xf, tier->spec_size);
+      for (i=0;i<=tier->block;i++)
+         tier->power[i] = MULT16_32_Q15(ss_1,tier->power[i]) + 1 + MULT16_32_Q15(ss,tier->Xf[i]);
+   }
+}
+
+/* Adds the output of the tiers for the current frame to out */
+static void echo_tiers_add(SpeexEchoState *st, int chan, spx_word16_t *out, int foreground)
+{
+   int t, i;
+   for (t=0;t<st->nb_tiers;t++)
+   {
+      EchoTier *tier = &st->tiers[t];
+      const spx_word16_t *y = tier->y;
+#ifdef TWO_PATH
+      if (foreground)
+         y = tier->yf;
+#endif
+      y += chan*2*tier->block + tier->block + tier->phase*st->frame_size;
+      for (i=0;i<st->frame_size;i++)
+         out[i] = EXTRACT16(SATURATE16(ADD32(EXTEND32(out[i]), EXTEND32(y[i])), 32767));
+   }
+#ifndef TWO_PATH
+   (void)foreground;
+#endif
+}
+
+/* Keeps the error of the frame for the tiers, and adapts those whose block
+   ends with this frame */
+static void echo_tiers_end(SpeexEchoState *st, spx_word16_t RER, spx_word16_t adapt_rate)
+{
+   int t, i, chan;
+   const int C = st->C;
+   for (t=0;t<st->nb_tiers;t++)
+   {
+      EchoTier *tier = &st->tiers[t];
+      const int B = tier->block;
+      /* The error of a frame the head won't adapt on either (saturation or
+         a silent far end) is left out of the gradient of the block */
+      for (chan = 0; chan < C; chan++)
+      {
+         spx_word16_t *e = tier->e+chan*2*B+B+tier->phase*st->frame_size;
+         if (st->saturated || st->frame_skip)
+         {
+            for (i=0;i<st->frame_size;i++)
+               e[i] = 0;
+         } else {
+            SPEEX_COPY(e, st->e+chan*st->window_size+st->frame_size, st->frame_size);
+         }
+      }
+      if (++tier->phase < tier->frames)
+         continue;
+
+      /* Each bin of the block spectrum uses the adaptation mask of the frame
+         bin at the same frequency, normalised by its own far-end power */
+      for (i=0;i<=B;i++)
+      {
+         if (st->adapted)
+            tier->power_1[i] = mdf_adapt_mask(st, i/tier->frames, RER, tier->power[i]);
+         else
+            tier->power_1[i] = FLOAT_SHL(FLOAT_DIV32(EXTEND32(adapt_rate),ADD32(tier->power[i],10)),WEIGHT_SHIFT+1);
+      }
+      st->cur_tier = t;
+      echo_run_tasks(st, echo_task_tier_error, C);
+      mdf_partition_amp(tier->W, tier->spec_size, tier->M, C*st->K, tier->shift, 0, tier->M, tier->amp);
+      if (st->adapted)
+         mdf_tiers_prop(st);
+      echo_run_tasks(st, echo_task_tier_adapt, C*st->K);
+      tier->count++;
+      tier->phase = 0;
+   }
+}
+
+/* Energy of a partition from its amplitude, without the 1 the amplitude
+   starts from */
+static inline spx_word32_t mdf_amp_energy(spx_word16_t amp)
+{
+   return SHR32(MAX32(0, SUB32(MULT16_16(amp,amp),1)),10);
+}
+
+/* In sparse mode, the partitions at both ends of the filter whose energy is
+   below SPARSE_FLOOR times that of the strongest partition are not adapted,
+   except every SPARSE_PROBE frames, when the whole filter is, so that a
+   change of the echo path is still seen. Between probes, their weights are
+   set to zero, so that they can be left out of the filtering. The amplitudes
+   of the partitions are those computed for the proportional adaptation rate.
+   This only applies to filters without tiers. */
+static void mdf_sparse_range(SpeexEchoState *st)
+{
+   int i, j, chan;
+   const int SK = st->spec_size*st->K, M = st->M;
+   int first = 0, last = st->M;
+   st->probe = 0;
+   if (st->sparse && !st->nb_tiers && st->adapted)
+   {
+      spx_word32_t peak = 0, limit;
+      for (i=0;i<st->M;i++)
+         peak = MAX32(peak, mdf_amp_energy(st->amp[i]));
+      limit = MULT16_32_Q15(SPARSE_FLOOR, peak);
+      while (last > 1 && mdf_amp_energy(st->amp[last-1]) < limit)
+         last--;
+      while (first < last-1 && mdf_amp_energy(st->amp[first]) < limit)
+         first++;
+      /* Keep one more partition on each side for the tail of the echo */
+      first = first > 0 ? first-1 : 0;
+      last = last < st->M ? last+1 : st->M;
+      st->probe = st->cancel_count%SPARSE_PROBE == 0;
+   }
+   st->first = first;
+   st->last = last;
+   if (st->probe)
+   {
+      st->used_first = 0;
+      st->used_last = M;
+   } else if (first > st->used_first || last < st->used_last) {
+      /* What a probe adapted in the partitions left out is dropped */
+      for (j=st->used_first;j<st->used_last;j++)
+      {
+         if (j >= first && j < last)
+            continue;
+         for (chan=0;chan<st->C;chan++)
+         {
+            SPEEX_MEMSET(&st->W[chan*SK*M + j*SK], 0, SK);
+#ifdef TWO_PATH
+            SPEEX_MEMSET(&st->foreground[chan*SK*M + j*SK], 0, SK);
+#endif
+         }
+         st->amp[j] = 0;
+      }
+      st->used_first = first;
+      st->used_last = last;
+   } else {
+      /* Partitions coming back into the range have zero weights */
+      if (first < st->used_first)
+         st->used_first = first;
+      if (last > st->used_last)
+         st->used_last = last;
+   }
+}
+
+static inline int mdf_popcount(spx_uint32_t v)
+{
+   v = v - ((v>>1)&0x55555555);
+   v = (v&0x33333333) + ((v>>2)&0x33333333);
+   return (((v + (v>>4))&0x0F0F0F0F)*0x01010101)>>24;
+}
+
+/* Binary spectrum of the two frames in buf: bit b is set when band b is
+   above its average, which avg keeps track of */
+static spx_uint32_t mdf_delay_bits(SpeexEchoState *st, const spx_word16_t *buf, spx_word32_t *avg, spx_word32_t *energy)
+{
+   int i, b;
+   EchoDelay *dl = st->delay;
+   EchoWorker *w = &st->workers[0];
+   const int bins = st->frame_size/2;
+   spx_uint32_t bits = 0;
+   spx_word32_t total = 0;
+   for (i=0;i<st->window_size;i++)
+      w->wtmp[i] = MULT16_16_Q15(st->window[i], buf[i]);
+   mdf_fft(w, w->wtmp, dl->spec);
+   MDF_KERNEL(st, power_spectrum)(dl->spec, dl->ps, st->spec_size);
+   /* The bands cover the lower half of the spectrum, where most of the
+      energy of speech is */
+   for (b=0;b<dl->bands;b++)
+   {
+      spx_word32_t e = 0;
+      for (i=1+b*bins/dl->bands;i<1+(b+1)*bins/dl->bands;i++)
+         e = ADD32(e, SHR32(dl->ps[i],6));
+      if (e > avg[b])
+         bits |= (spx_uint32_t)1<<b;
+      avg[b] = ADD32(avg[b], MULT16_32_Q15(QCONST16(.02f,15), SUB32(e, avg[b])));
+      total = ADD32(total, SHR32(e,5));
+   }
+   *energy = total;
+   return bits;
+}
+
+/* Moves the M partitions of len values in buf so that partition j gets
+   partition j+delta, and clears the ones that have nothing to get */
+#define MDF_SHIFT_PARTITIONS(buf, M, len, delta) do { \
+      int n_ = (M) - ((delta) > 0 ? (delta) : -(delta)); \
+      if (n_ < 0) n_ = 0; \
+      if ((delta) > 0) { \
+         SPEEX_MOVE(buf, (buf)+((M)-n_)*(len), n_*(len)); \
+         SPEEX_MEMSET((buf)+n_*(len), 0, ((M)-n_)*(len)); \
+      } else { \
+         SPEEX_MOVE((buf)+((M)-n_)*(len), buf, n_*(len)); \
+         SPEEX_MEMSET(buf, 0, ((M)-n_)*(len)); \
+      } \
+   } while (0)
+
+/* Moves the far end to a new delay. The filter keeps the echo path it has
+   learnt by moving its partitions along, and the far-end spectra of the
+   partitions follow. With tiers, this is only done for the partitions of
+   frame_size: the tiers can't move by a frame, so they adapt to the new
+   delay like to any change of the echo path. */
+static void mdf_delay_set(SpeexEchoState *st, int delay)
+{
+   int i, j, chan, speak;
+   EchoDelay *dl = st->delay;
+   const int N = st->window_size, S = st->spec_size, M = st->M, C = st->C, K = st->K, F = st->frame_size;
+   const int R = dl->max+2;
+   const int delta = delay - dl->delay;
+   dl->delay = delay;
+   for (chan = 0; chan < C; chan++)
+   {
+      MDF_SHIFT_PARTITIONS(st->W+chan*S*K*M, M, S*K, delta);
+#ifdef TWO_PATH
+      MDF_SHIFT_PARTITIONS(st->foreground+chan*S*K*M, M, S*K, delta);
+#endif
+   }
+   MDF_SHIFT_PARTITIONS(st->amp, M, 1, delta);
+   st->used_first = 0;
+   st->used_last = M;
+   /* Partition j of X (which holds M+1) now starts delta slots further */
+   st->X_pos = ((st->X_pos+delta)%(M+1)+M+1)%(M+1);
+   for (j=0;j<=M;j++)
+   {
+      const int slot = (st->X_pos+j)%(M+1);
+      if (j+delta > M)
+      {
+         for (i=0;i<S*K;i++)
+            st->X[slot*S*K+i] = 0;
+      } else if (j+delta < 0) {
+         /* Newer than any partition there was, but still in the delay line:
+            partition j is the previous frame and the one before, from j+1
+            frames back */
+         EchoWorker *w = &st->workers[0];
+         for (speak = 0; speak < K; speak++)
+         {
+            const spx_word16_t *buf = dl->buf + speak*R*F;
+            SPEEX_COPY(w->wtmp, buf + (dl->pos-j-delay-2+2*R)%R*F, F);
+            SPEEX_COPY(w->wtmp+F, buf + (dl->pos-j-delay-1+2*R)%R*F, F);
+            mdf_fft(w, w->wtmp, &st->X[slot*S*K+speak*S]);
+         }
+      }
+   }
+   /* The previous frame of x, at the new delay */
+   for (speak = 0; speak < K; speak++)
+      SPEEX_COPY(st->x+speak*N+F, dl->buf + (speak*R + (dl->pos-delay-1+R)%R)*F, F);
+}
+
+/* Updates the delay search with the newest far-end frame, which is in slot
+   pos of the delay line, and the near end in input, then gives x the far end
+   at the delay found */
+static void mdf_delay_update(SpeexEchoState *st)
+{
+   int i, k, chan, speak, best, sum;
+   EchoDelay *dl = st->delay;
+   const int N = st->window_size, C = st->C, K = st->K, F = st->frame_size;
+   const int R = dl->max+2;
+   spx_uint32_t near;
+   spx_word32_t energy;
+
+   SPEEX_MOVE(dl->far, dl->far+F, F);
+   SPEEX_MOVE(dl->near, dl->near+F, F);
+   for (i=0;i<F;i++)
+   {
+      spx_word32_t tmp = 0;
+      for (speak = 0; speak < K; speak++)
+         tmp = ADD32(tmp, EXTEND32(dl->buf[(speak*R+dl->pos)*F+i]));
+      dl->far[F+i] = EXTRACT16(DIV32(tmp, K));
+      tmp = 0;
+      for (chan = 0; chan < C; chan++)
+         tmp = ADD32(tmp, EXTEND32(st->input[chan*F+i]));
+      dl->near[F+i] = EXTRACT16(DIV32(tmp, C));
+   }
+   dl->bits[dl->pos] = mdf_delay_bits(st, dl->far, dl->far_avg, &energy);
+   dl->on[dl->pos] = energy > 0 && energy > MULT16_32_Q15(QCONST16(.25f,15), dl->far_level);
+   dl->far_level = ADD32(dl->far_level, MULT16_32_Q15(QCONST16(.01f,15), SUB32(energy, dl->far_level)));
+   if (dl->on[dl->pos])
+      dl->frames++;
+   near = mdf_delay_bits(st, dl->near, dl->near_avg, &energy);
+
+   /* Far-end frames that were too quiet say nothing about the delay */
+   for (k=0;k<=dl->max;k++)
+   {
+      const int slot = (dl->pos-k+R)%R;
+      if (dl->on[slot])
+         dl->cost[k] += (mdf_popcount(near^dl->bits[slot])<<3) - (dl->cost[k]>>5);
+   }
+   best = 0;
+   sum = 0;
+   for (k=0;k<=dl->max;k++)
+   {
+      sum += dl->cost[k];
+      if (dl->cost[k] < dl->cost[best])
+         best = k;
+   }
+   /* The best delay has to stand clearly out from the average, and stay the
+      best for a while */
+   if (dl->frames >= DELAY_STABLE && 4*(dl->max+1)*dl->cost[best] < 3*sum)
+   {
+      if (best == dl->best)
+         dl->count++;
+      else
+         dl->count = 1;
+      dl->best = best;
+   } else {
+      dl->count = 0;
+   }
+   if (dl->count >= DELAY_STABLE)
+   {
+      const int delay = best > DELAY_MARGIN ? best-DELAY_MARGIN : 0;
+      if (delay != dl->delay)
+         mdf_delay_set(st, delay);
+   }
+
+   for (speak = 0; speak < K; speak++)
+   {
+      SPEEX_MOVE(st->x+speak*N, st->x+speak*N+F, F);
+      SPEEX_COPY(st->x+speak*N+F, dl->buf + (speak*R + (dl->pos-dl->delay+R)%R)*F, F);
+   }
+}
+
+/* The steps of a frame that work on one microphone (or one microphone and
+   loudspeaker pair) are tasks that can run on several threads. Each one
+   only writes the data of its channel, and the sums over the channels are
+   added up afterwards in channel order, so the output does not depend on
+   the number of threads. */
+
+/* Converts the far end signal of one loudspeaker to the frequency domain */
+static void echo_task_far_end(SpeexEchoState *st, int speak, EchoWorker *w)
+{
+   const int N = st->window_size, S = st->spec_size, K = st->K;
+   mdf_fft(w, st->x+speak*N, &st->X[st->X_pos*S*K+speak*S]);
+}
+
+#ifdef TWO_PATH
+/* Filters the far end signal with the foreground filter of one microphone */
+static void echo_task_foreground(SpeexEchoState *st, int chan, EchoWorker *w)
+{
+   int i;
+   const int N = st->window_size, S = st->spec_size, M = st->M, K = st->K;
+   const int first = st->used_first, len = st->used_last-st->used_first;
+   MDF_KERNEL(st, spectral_mul_accum16)(st->X, (st->X_pos+first)%(M+1)*K, (M+1)*K, st->foreground+chan*S*K*M+first*S*K, st->Y+chan*S, S, len*K);
+   mdf_ifft(w, st->Y+chan*S, st->e+chan*N);
+   echo_tiers_add(st, chan, st->e+chan*N+st->frame_size, 1);
+   for (i=0;i<st->frame_size;i++)
+      st->e[chan*N+i] = SUB16(st->input[chan*st->frame_size+i], st->e[chan*N+i+st->frame_size]);
+   st->chan_sums[chan] = mdf_inner_prod(st->e+chan*N, st->e+chan*N, st->frame_size);
+}
+#endif
+
+/* Gradient step and constraint on the weights of one microphone and
+   loudspeaker pair */
+static void echo_task_adapt(SpeexEchoState *st, int index, EchoWorker *w)
+{
+   int i, j;
+   const int N = st->window_size, S = st->spec_size, M = st->M, K = st->K;
+   const int chan = index/K, speak = index%K;
+   const int first = st->probe ? 0 : st->first, last = st->probe ? M : st->last;
+
+   /* Compute weight gradient */
+   if (st->frame_adapt)
+   {
+      for (j=last-1;j>=first;j--)
+      {
+         /* Partition j+1: E is the error of the previous frame */
+         const int slot = st->X_pos+j+1 <= M ? st->X_pos+j+1 : st->X_pos+j-M;
+         MDF_KERNEL(st, weighted_spectral_mul_conj)(st->power_1, FLOAT_SHL(PSEUDOFLOAT(st->prop[j]),-15), &st->X[slot*S*K+speak*S], st->E+chan*S, &st->W[chan*S*K*M + j*S*K + speak*S], S);
+      }
+   }
+
+   /* Update weight to prevent circular convolution (MDF / AUMDF) */
+   for (j=0;j<M;j++)
+   {
+      const int sparse = j < st->first || j >= st->last;
+      /* This is a variant of the Alternatively Updated MDF (AUMDF) */
+      /* Remove the "if" to make this an MDF filter */
+      /* In sparse mode, the partitions that only adapt on probe frames are
+         all constrained then, as their turn may never fall on one */
+      if (sparse ? st->probe : (j==0 || st->cancel_count%(M-1) == j-1))
+      {
+#ifdef FIXED_POINT
+         for (i=0;i<N;i++)
+            w->wtmp2[i] = EXTRACT16(PSHR32(st->W[chan*S*K*M + j*S*K + speak*S + i],NORMALIZE_SCALEDOWN+16));
+         mdf_ifft(w, w->wtmp2, w->wtmp);
+         for (i=0;i<st->frame_size;i++)
+         {
+            w->wtmp[i]=0;
+         }
+         for (i=st->frame_size;i<N;i++)
+         {
+            w->wtmp[i]=SHL16(w->wtmp[i],NORMALIZE_SCALEUP);
+         }
+         mdf_fft(w, w->wtmp, w->wtmp2);
+         /* The "-1" in the shift is a sort of kludge that trades less efficient update speed for decrease noise */
+         for (i=0;i<N;i++)
+            st->W[chan*S*K*M + j*S*K + speak*S + i] -= SHL32(EXTEND32(w->wtmp2[i]),16+NORMALIZE_SCALEDOWN-NORMALIZE_SCALEUP-1);
+#else
+         mdf_ifft(w, &st->W[chan*S*K*M + j*S*K + speak*S], w->wtmp);
+         for (i=st->frame_size;i<N;i++)
+         {
+            w->wtmp[i]=0;
+         }
+         mdf_fft(w, w->wtmp, &st->W[chan*S*K*M + j*S*K + speak*S]);
+#endif
+      }
+   }
+}
+
+#ifdef TWO_PATH
+/* Filters the far end signal with the background filter of one microphone */
+static void echo_task_background(SpeexEchoState *st, int chan, EchoWorker *w)
+{
+   int i;
+   const int N = st->window_size, S = st->spec_size, M = st->M, K = st->K, C = st->C;
+   const int first = st->used_first, len = st->used_last-st->used_first;
+   MDF_KERNEL(st, spectral_mul_accum)(st->X, (st->X_pos+first)%(M+1)*K, (M+1)*K, st->W+chan*S*K*M+first*S*K, st->Y+chan*S, S, len*K);
+   mdf_ifft(w, st->Y+chan*S, st->y+chan*N);
+   echo_tiers_add(st, chan, st->y+chan*N+st->frame_size, 0);
+   for (i=0;i<st->frame_size;i++)
+      st->e[chan*N+i] = SUB16(st->e[chan*N+i+st->frame_size], st->y[chan*N+i+st->frame_size]);
+   st->chan_sums[chan] = 10+mdf_inner_prod(st->e+chan*N, st->e+chan*N, st->frame_size);
+   for (i=0;i<st->frame_size;i++)
+      st->e[chan*N+i] = SUB16(st->input[chan*st->frame_size+i], st->y[chan*N+i+st->frame_size]);
+   st->chan_sums[C+chan] = mdf_inner_prod(st->e+chan*N, st->e+chan*N, st->frame_size);
+}
+#endif
+
+/* Computes the output of one microphone, and its error and echo spectra */
+static void echo_task_output(SpeexEchoState *st, int chan, EchoWorker *w)
+{
+   int i;
+   const int N = st->window_size, S = st->spec_size, C = st->C;
+   spx_int16_t *out = st->frame_out;
+
+   /* Compute error signal (for the output with de-emphasis) */
+   for (i=0;i<st->frame_size;i++)
+   {
+      spx_word32_t tmp_out;
+#ifdef TWO_PATH
+      tmp_out = SUB32(EXTEND32(st->input[chan*st->frame_size+i]), EXTEND32(st->e[chan*N+i+st->frame_size]));
+#else
+      tmp_out = SUB32(EXTEND32(st->input[chan*st->frame_size+i]), EXTEND32(st->y[chan*N+i+st->frame_size]));
+#endif
+      tmp_out = ADD32(tmp_out, EXTEND32(MULT16_16_P15(st->preemph, st->memE[chan])));
+      out[i*C+chan] = WORD2INT(tmp_out);
+      st->memE[chan] = tmp_out;
+   }
+
+   /* Compute error signal (filter update version) */
+   for (i=0;i<st->frame_size;i++)
+   {
+      st->e[chan*N+i+st->frame_size] = st->e[chan*N+i];
+      st->e[chan*N+i] = 0;
+   }
+
+   /* Compute a bunch of correlations */
+   /* FIXME: bad merge */
+   st->chan_sums[chan] = mdf_inner_prod(st->e+chan*N+st->frame_size, st->y+chan*N+st->frame_size, st->frame_size);
+   st->chan_sums[C+chan] = mdf_inner_prod(st->y+chan*N+st->frame_size, st->y+chan*N+st->frame_size, st->frame_size);
+   st->chan_sums[2*C+chan] = mdf_inner_prod(st->input+chan*st->frame_size, st->input+chan*st->frame_size, st->frame_size);
+
+   /* Convert error to frequency domain */
+   mdf_fft(w, st->e+chan*N, st->E+chan*S);
+   for (i=0;i<st->frame_size;i++)
+      st->y[i+chan*N] = 0;
+   mdf_fft(w, st->y+chan*N, st->Y+chan*S);
+}
+
+/** Performs echo cancellation on a frame */
+EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, const spx_int16_t *far_end, spx_int16_t *out)
+{
+   int i,j, chan, speak;
+   int N,S,M, C, K;
+   spx_word32_t Syy,See,Sxx,Sdd, Sff;
+#ifdef TWO_PATH
+   spx_word32_t Dbf;
+   int update_foreground;
+#endif
+   spx_word32_t Sey;
+   spx_word16_t ss, ss_1;
+   spx_float_t Pey = FLOAT_ONE, Pyy=FLOAT_ONE;
+   spx_float_t alpha, alpha_1;
+   spx_word16_t RER;
+   spx_word16_t adapt_rate=0;
+   spx_word32_t tmp32;
+
+   N = st->window_size;
+   S = st->spec_size;
+   M = st->M;
+   C = st->C;
+   K = st->K;
+
+   st->cancel_count++;
+#ifdef FIXED_POINT
+   ss=DIV32_16(11469,st->adapt_M);
+   ss_1 = SUB16(32767,ss);
+#else
+   ss=.35/st->adapt_M;
+   ss_1 = 1-ss;
+#endif
+
+   for (chan = 0; chan < C; chan++)
+   {
       /* Apply a notch filter to make sure DC doesn't end up causing problems */
       filter_dc_notch16(in+chan, st->notch_radius, st->input+chan*st->frame_size, st->frame_size, st->notch_mem+2*chan, C);
       /* Copy input data to buffer and apply pre-emphasis */
@@ -743,12 +2050,19 @@ EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, c
       }
    }
 
+   /* With the delay search, the far end goes through the delay line first */
+   if (st->delay)
+      st->delay->pos = (st->delay->pos+1)%(st->delay->max+2);
    for (speak = 0; speak < K; speak++)
    {
+      spx_word16_t *x = st->x+speak*N+st->frame_size;
+      if (st->delay)
+         x = st->delay->buf + (speak*(st->delay->max+2) + st->delay->pos)*st->frame_size;
       for (i=0;i<st->frame_size;i++)
       {
          spx_word32_t tmp32;
-         st->x[speak*N+i] = st->x[speak*N+i+st->frame_size];
+         if (!st->delay)
+            st->x[speak*N+i] = st->x[speak*N+i+st->frame_size];
          tmp32 = SUB32(EXTEND32(far_end[i*K+speak]), EXTEND32(MULT16_16_P15(st->preemph, st->memX[speak])));
 #ifdef FIXED_POINT
          /*FIXME: If saturation occurs here, we need to freeze adaptation for M frames (not just one) */
@@ -763,106 +2077,69 @@ EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, c
             st->saturated = M+1;
          }
 #endif
-         st->x[speak*N+i+st->frame_size] = EXTRACT16(tmp32);
+         x[i] = EXTRACT16(tmp32);
          st->memX[speak] = far_end[i*K+speak];
       }
    }
+   if (st->delay)
+      mdf_delay_update(st);
 
-   for (speak = 0; speak < K; speak++)
-   {
-      /* Shift memory: this could be optimized eventually*/
-      for (j=M-1;j>=0;j--)
-      {
-         for (i=0;i<N;i++)
-            st->X[(j+1)*N*K+speak*N+i] = st->X[j*N*K+speak*N+i];
-      }
-      /* Convert x (echo input) to frequency domain */
-      spx_fft(st->fft_table, st->x+speak*N, &st->X[speak*N]);
-   }
+   /* The oldest frame of X is overwritten by the newest one, which becomes
+      partition 0. Partition j is at slot (X_pos+j)%(M+1). */
+   st->X_pos = st->X_pos ? st->X_pos-1 : M;
+   /* Convert x (echo input) to frequency domain */
+   echo_run_tasks(st, echo_task_far_end, K);
+   echo_tiers_start(st);
+   mdf_sparse_range(st);
 
    Sxx = 0;
    for (speak = 0; speak < K; speak++)
    {
       Sxx += mdf_inner_prod(st->x+speak*N+st->frame_size, st->x+speak*N+st->frame_size, st->frame_size);
-      power_spectrum_accum(st->X+speak*N, st->Xf, N);
+      MDF_KERNEL(st, power_spectrum_accum)(st->X+st->X_pos*S*K+speak*S, st->Xf, S);
    }
 
+   /* Once the far end has been silent (below -70 dBFS) for longer than the
+      filter, there is no echo to learn from and the weights are left alone */
+   if (Sxx < SHR32(MULT16_16(st->frame_size, 100),6))
+      st->silent++;
+   else
+      st->silent = 0;
+   st->frame_skip = st->silent > st->adapt_M+1;
+   if (st->frame_skip)
+      st->skipped++;
+
    Sff = 0;
-   for (chan = 0; chan < C; chan++)
-   {
 #ifdef TWO_PATH
-      /* Compute foreground filter */
-      spectral_mul_accum16(st->X, st->foreground+chan*N*K*M, st->Y+chan*N, N, M*K);
-      spx_ifft(st->fft_table, st->Y+chan*N, st->e+chan*N);
-      for (i=0;i<st->frame_size;i++)
-         st->e[chan*N+i] = SUB16(st->input[chan*st->frame_size+i], st->e[chan*N+i+st->frame_size]);
-      Sff += mdf_inner_prod(st->e+chan*N, st->e+chan*N, st->frame_size);
+   /* Compute foreground filter */
+   echo_run_tasks(st, echo_task_foreground, C);
+   for (chan = 0; chan < C; chan++)
+      Sff += st->chan_sums[chan];
 #endif
-   }
 
    /* Adjust proportional adaption rate */
    /* FIXME: Adjust that for C, K*/
-   if (st->adapted)
-      mdf_adjust_prop (st->W, N, M, C*K, st->prop);
-   /* Compute weight gradient */
-   if (st->saturated == 0)
+   if (st->adapted && !st->frame_skip)
    {
-      for (chan = 0; chan < C; chan++)
-      {
-         for (speak = 0; speak < K; speak++)
-         {
-            for (j=M-1;j>=0;j--)
-            {
-               weighted_spectral_mul_conj(st->power_1, FLOAT_SHL(PSEUDOFLOAT(st->prop[j]),-15), &st->X[(j+1)*N*K+speak*N], st->E+chan*N, st->PHI, N);
-               for (i=0;i<N;i++)
-                  st->W[chan*N*K*M + j*N*K + speak*N + i] += st->PHI[i];
-            }
-         }
-      }
-   } else {
-      st->saturated--;
+      /* The weights of the partitions that don't adapt don't change */
+      if (st->probe)
+         mdf_partition_amp(st->W, S, M, C*K, 0, 0, M, st->amp);
+      else
+         mdf_partition_amp(st->W, S, M, C*K, 0, st->first, st->last, st->amp);
+      if (st->nb_tiers)
+         mdf_tiers_prop(st);
+      else
+         mdf_adjust_prop(st->amp, M, st->prop);
    }
-
+   st->frame_adapt = st->saturated == 0;
+   if (!st->frame_adapt)
+      st->saturated--;
+   if (st->frame_skip)
+      st->frame_adapt = 0;
    /* FIXME: MC conversion required */
-   /* Update weight to prevent circular convolution (MDF / AUMDF) */
-   for (chan = 0; chan < C; chan++)
-   {
-      for (speak = 0; speak < K; speak++)
-      {
-         for (j=0;j<M;j++)
-         {
-            /* This is a variant of the Alternatively Updated MDF (AUMDF) */
-            /* Remove the "if" to make this an MDF filter */
-            if (j==0 || st->cancel_count%(M-1) == j-1)
-            {
-#ifdef FIXED_POINT
-               for (i=0;i<N;i++)
-                  st->wtmp2[i] = EXTRACT16(PSHR32(st->W[chan*N*K*M + j*N*K + speak*N + i],NORMALIZE_SCALEDOWN+16));
-               spx_ifft(st->fft_table, st->wtmp2, st->wtmp);
-               for (i=0;i<st->frame_size;i++)
-               {
-                  st->wtmp[i]=0;
-               }
-               for (i=st->frame_size;i<N;i++)
-               {
-                  st->wtmp[i]=SHL16(st->wtmp[i],NORMALIZE_SCALEUP);
-               }
-               spx_fft(st->fft_table, st->wtmp, st->wtmp2);
-               /* The "-1" in the shift is a sort of kludge that trades less efficient update speed for decrease noise */
-               for (i=0;i<N;i++)
-                  st->W[chan*N*K*M + j*N*K + speak*N + i] -= SHL32(EXTEND32(st->wtmp2[i]),16+NORMALIZE_SCALEDOWN-NORMALIZE_SCALEUP-1);
-#else
-               spx_ifft(st->fft_table, &st->W[chan*N*K*M + j*N*K + speak*N], st->wtmp);
-               for (i=st->frame_size;i<N;i++)
-               {
-                  st->wtmp[i]=0;
-               }
-               spx_fft(st->fft_table, st->wtmp, &st->W[chan*N*K*M + j*N*K + speak*N]);
-#endif
-            }
-         }
-      }
-   }
+   /* Compute weight gradient and update weight to prevent circular convolution */
+   if (!st->frame_skip)
+      echo_run_tasks(st, echo_task_adapt, C*K);
 
    /* So we can use power_spectrum_accum */
    for (i=0;i<=st->frame_size;i++)
@@ -871,17 +2148,22 @@ EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, c
    Dbf = 0;
    See = 0;
 #ifdef TWO_PATH
-   /* Difference in response, this is used to estimate the variance of our residual power estimate */
-   for (chan = 0; chan < C; chan++)
+   if (st->frame_skip)
    {
-      spectral_mul_accum(st->X, st->W+chan*N*K*M, st->Y+chan*N, N, M*K);
-      spx_ifft(st->fft_table, st->Y+chan*N, st->y+chan*N);
-      for (i=0;i<st->frame_size;i++)
-         st->e[chan*N+i] = SUB16(st->e[chan*N+i+st->frame_size], st->y[chan*N+i+st->frame_size]);
-      Dbf += 10+mdf_inner_prod(st->e+chan*N, st->e+chan*N, st->frame_size);
-      for (i=0;i<st->frame_size;i++)
-         st->e[chan*N+i] = SUB16(st->input[chan*st->frame_size+i], st->y[chan*N+i+st->frame_size]);
-      See += mdf_inner_prod(st->e+chan*N, st->e+chan*N, st->frame_size);
+      /* Both filters only see silence, so the foreground output stands for
+         the background one and neither of them replaces the other */
+      for (chan = 0; chan < C; chan++)
+         for (i=0;i<st->frame_size;i++)
+            st->y[chan*N+i+st->frame_size] = st->e[chan*N+i+st->frame_size];
+      See = Sff;
+   } else {
+      /* Difference in response, this is used to estimate the variance of our residual power estimate */
+      echo_run_tasks(st, echo_task_background, C);
+      for (chan = 0; chan < C; chan++)
+      {
+         Dbf += st->chan_sums[chan];
+         See += st->chan_sums[C+chan];
+      }
    }
 #endif
 
@@ -891,121 +2173,114 @@ EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, c
 
 #ifdef TWO_PATH
    /* Logic for updating the foreground filter */
-
-   /* For two time windows, compute the mean of the energy difference, as well as the variance */
-   st->Davg1 = ADD32(MULT16_32_Q15(QCONST16(.6f,15),st->Davg1), MULT16_32_Q15(QCONST16(.4f,15),SUB32(Sff,See)));
-   st->Davg2 = ADD32(MULT16_32_Q15(QCONST16(.85f,15),st->Davg2), MULT16_32_Q15(QCONST16(.15f,15),SUB32(Sff,See)));
-   st->Dvar1 = FLOAT_ADD(FLOAT_MULT(VAR1_SMOOTH, st->Dvar1), FLOAT_MUL32U(MULT16_32_Q15(QCONST16(.4f,15),Sff), MULT16_32_Q15(QCONST16(.4f,15),Dbf)));
-   st->Dvar2 = FLOAT_ADD(FLOAT_MULT(VAR2_SMOOTH, st->Dvar2), FLOAT_MUL32U(MULT16_32_Q15(QCONST16(.15f,15),Sff), MULT16_32_Q15(QCONST16(.15f,15),Dbf)));
-
-   /* Equivalent float code:
-   st->Davg1 = .6*st->Davg1 + .4*(Sff-See);
-   st->Davg2 = .85*st->Davg2 + .15*(Sff-See);
-   st->Dvar1 = .36*st->Dvar1 + .16*Sff*Dbf;
-   st->Dvar2 = .7225*st->Dvar2 + .0225*Sff*Dbf;
-   */
-
-   update_foreground = 0;
-   /* Check if we have a statistically significant reduction in the residual echo */
-   /* Note that this is *not* Gaussian, so we need to be careful about the longer tail */
-   if (FLOAT_GT(FLOAT_MUL32U(SUB32(Sff,See),ABS32(SUB32(Sff,See))), FLOAT_MUL32U(Sff,Dbf)))
-      update_foreground = 1;
-   else if (FLOAT_GT(FLOAT_MUL32U(st->Davg1, ABS32(st->Davg1)), FLOAT_MULT(VAR1_UPDATE,(st->Dvar1))))
-      update_foreground = 1;
-   else if (FLOAT_GT(FLOAT_MUL32U(st->Davg2, ABS32(st->Davg2)), FLOAT_MULT(VAR2_UPDATE,(st->Dvar2))))
-      update_foreground = 1;
-
-   /* Do we update? */
-   if (update_foreground)
-   {
-      st->Davg1 = st->Davg2 = 0;
-      st->Dvar1 = st->Dvar2 = FLOAT_ZERO;
-      /* Copy background filter to foreground filter */
-      for (i=0;i<N*M*C*K;i++)
-         st->foreground[i] = EXTRACT16(PSHR32(st->W[i],16));
-      /* Apply a smooth transition so as to not introduce blocking artifacts */
-      for (chan = 0; chan < C; chan++)
-         for (i=0;i<st->frame_size;i++)
-            st->e[chan*N+i+st->frame_size] = MULT16_16_Q15(st->window[i+st->frame_size],st->e[chan*N+i+st->frame_size]) + MULT16_16_Q15(st->window[i],st->y[chan*N+i+st->frame_size]);
-   } else {
-      int reset_background=0;
-      /* Otherwise, check if the background filter is significantly worse */
-      if (FLOAT_GT(FLOAT_MUL32U(NEG32(SUB32(Sff,See)),ABS32(SUB32(Sff,See))), FLOAT_MULT(VAR_BACKTRACK,FLOAT_MUL32U(Sff,Dbf))))
-         reset_background = 1;
-      if (FLOAT_GT(FLOAT_MUL32U(NEG32(st->Davg1), ABS32(st->Davg1)), FLOAT_MULT(VAR_BACKTRACK,st->Dvar1)))
-         reset_background = 1;
-      if (FLOAT_GT(FLOAT_MUL32U(NEG32(st->Davg2), ABS32(st->Davg2)), FLOAT_MULT(VAR_BACKTRACK,st->Dvar2)))
-         reset_background = 1;
-      if (reset_background)
+   if (!st->frame_skip)
+   {
+      /* For two time windows, compute the mean of the energy difference, as well as the variance */
+      st->Davg1 = ADD32(MULT16_32_Q15(QCONST16(.6f,15),st->Davg1), MULT16_32_Q15(QCONST16(.4f,15),SUB32(Sff,See)));
+      st->Davg2 = ADD32(MULT16_32_Q15(QCONST16(.85f,15),st->Davg2), MULT16_32_Q15(QCONST16(.15f,15),SUB32(Sff,See)));
+      st->Dvar1 = FLOAT_ADD(FLOAT_MULT(VAR1_SMOOTH, st->Dvar1), FLOAT_MUL32U(MULT16_32_Q15(QCONST16(.4f,15),Sff), MULT16_32_Q15(QCONST16(.4f,15),Dbf)));
+      st->Dvar2 = FLOAT_ADD(FLOAT_MULT(VAR2_SMOOTH, st->Dvar2), FLOAT_MUL32U(MULT16_32_Q15(QCONST16(.15f,15),Sff), MULT16_32_Q15(QCONST16(.15f,15),Dbf)));
+
+      /* Equivalent float code:
+      st->Davg1 = .6*st->Davg1 + .4*(Sff-See);
+      st->Davg2 = .85*st->Davg2 + .15*(Sff-See);
+      st->Dvar1 = .36*st->Dvar1 + .16*Sff*Dbf;
+      st->Dvar2 = .7225*st->Dvar2 + .0225*Sff*Dbf;
+      */
+
+      update_foreground = 0;
+      /* Check if we have a statistically significant reduction in the residual echo */
+      /* Note that this is *not* Gaussian, so we need to be careful about the longer tail */
+      if (FLOAT_GT(FLOAT_MUL32U(SUB32(Sff,See),ABS32(SUB32(Sff,See))), FLOAT_MUL32U(Sff,Dbf)))
+         update_foreground = 1;
+      else if (FLOAT_GT(FLOAT_MUL32U(st->Davg1, ABS32(st->Davg1)), FLOAT_MULT(VAR1_UPDATE,(st->Dvar1))))
+         update_foreground = 1;
+      else if (FLOAT_GT(FLOAT_MUL32U(st->Davg2, ABS32(st->Davg2)), FLOAT_MULT(VAR2_UPDATE,(st->Dvar2))))
+         update_foreground = 1;
+
+      /* Do we update? */
+      if (update_foreground)
       {
-         /* Copy foreground filter to background filter */
-         for (i=0;i<N*M*C*K;i++)
-            st->W[i] = SHL32(EXTEND32(st->foreground[i]),16);
-         /* We also need to copy the output so as to get correct adaptation */
-         for (chan = 0; chan < C; chan++)
+         st->Davg1 = st->Davg2 = 0;
+         st->Dvar1 = st->Dvar2 = FLOAT_ZERO;
+         /* Copy background filter to foreground filter */
+         for (i=0;i<S*M*C*K;i++)
+            st->foreground[i] = EXTRACT16(PSHR32(st->W[i],16));
+         for (j=0;j<st->nb_tiers;j++)
          {
+            EchoTier *tier = &st->tiers[j];
+            for (i=0;i<tier->spec_size*tier->M*C*K;i++)
+               tier->foreground[i] = EXTRACT16(PSHR32(tier->W[i],16));
+            /* The rest of the block now comes from the background filter */
+            SPEEX_COPY(tier->yf, tier->y, C*2*tier->block);
+         }
+         /* Apply a smooth transition so as to not introduce blocking artifacts */
+         for (chan = 0; chan < C; chan++)
             for (i=0;i<st->frame_size;i++)
-               st->y[chan*N+i+st->frame_size] = st->e[chan*N+i+st->frame_size];
-            for (i=0;i<st->frame_size;i++)
-               st->e[chan*N+i] = SUB16(st->input[chan*st->frame_size+i], st->y[chan*N+i+st->frame_size]);
+               st->e[chan*N+i+st->frame_size] = MULT16_16_Q15(st->window[i+st->frame_size],st->e[chan*N+i+st->frame_size]) + MULT16_16_Q15(st->window[i],st->y[chan*N+i+st->frame_size]);
+      } else {
+         int reset_background=0;
+         /* Otherwise, check if the background filter is significantly worse */
+         if (FLOAT_GT(FLOAT_MUL32U(NEG32(SUB32(Sff,See)),ABS32(SUB32(Sff,See))), FLOAT_MULT(VAR_BACKTRACK,FLOAT_MUL32U(Sff,Dbf))))
+            reset_background = 1;
+         if (FLOAT_GT(FLOAT_MUL32U(NEG32(st->Davg1), ABS32(st->Davg1)), FLOAT_MULT(VAR_BACKTRACK,st->Dvar1)))
+            reset_background = 1;
+         if (FLOAT_GT(FLOAT_MUL32U(NEG32(st->Davg2), ABS32(st->Davg2)), FLOAT_MULT(VAR_BACKTRACK,st->Dvar2)))
+            reset_background = 1;
+         if (reset_background)
+         {
+            /* Copy foreground filter to background filter */
+            for (i=0;i<S*M*C*K;i++)
+               st->W[i] = SHL32(EXTEND32(st->foreground[i]),16);
+            for (j=0;j<st->nb_tiers;j++)
+            {
+               EchoTier *tier = &st->tiers[j];
+               for (i=0;i<tier->spec_size*tier->M*C*K;i++)
+                  tier->W[i] = SHL32(EXTEND32(tier->foreground[i]),16);
+               SPEEX_COPY(tier->y, tier->yf, C*2*tier->block);
+            }
+            /* We also need to copy the output so as to get correct adaptation */
+            for (chan = 0; chan < C; chan++)
+            {
+               for (i=0;i<st->frame_size;i++)
+                  st->y[chan*N+i+st->frame_size] = st->e[chan*N+i+st->frame_size];
+               for (i=0;i<st->frame_size;i++)
+                  st->e[chan*N+i] = SUB16(st->input[chan*st->frame_size+i], st->y[chan*N+i+st->frame_size]);
+            }
+            See = Sff;
+            st->Davg1 = st->Davg2 = 0;
+            st->Dvar1 = st->Dvar2 = FLOAT_ZERO;
          }
-         See = Sff;
-         st->Davg1 = st->Davg2 = 0;
-         st->Dvar1 = st->Dvar2 = FLOAT_ZERO;
       }
    }
 #endif
 
+   st->frame_out = out;
+   echo_run_tasks(st, echo_task_output, C);
+
    Sey = Syy = Sdd = 0;
    for (chan = 0; chan < C; chan++)
    {
-      /* Compute error signal (for the output with de-emphasis) */
-      for (i=0;i<st->frame_size;i++)
-      {
-         spx_word32_t tmp_out;
-#ifdef TWO_PATH
-         tmp_out = SUB32(EXTEND32(st->input[chan*st->frame_size+i]), EXTEND32(st->e[chan*N+i+st->frame_size]));
-#else
-         tmp_out = SUB32(EXTEND32(st->input[chan*st->frame_size+i]), EXTEND32(st->y[chan*N+i+st->frame_size]));
-#endif
-         tmp_out = ADD32(tmp_out, EXTEND32(MULT16_16_P15(st->preemph, st->memE[chan])));
-      /* This is an arbitrary test for saturation in the microphone signal */
-         if (in[i*C+chan] <= -32000 || in[i*C+chan] >= 32000)
-         {
-         if (st->saturated == 0)
-            st->saturated = 1;
-         }
-         out[i*C+chan] = WORD2INT(tmp_out);
-         st->memE[chan] = tmp_out;
-      }
-
 #ifdef DUMP_ECHO_CANCEL_DATA
       dump_audio(in, far_end, out, st->frame_size);
 #endif
-
-      /* Compute error signal (filter update version) */
-      for (i=0;i<st->frame_size;i++)
-      {
-         st->e[chan*N+i+st->frame_size] = st->e[chan*N+i];
-         st->e[chan*N+i] = 0;
-      }
-
-      /* Compute a bunch of correlations */
-      /* FIXME: bad merge */
-      Sey += mdf_inner_prod(st->e+chan*N+st->frame_size, st->y+chan*N+st->frame_size, st->frame_size);
-      Syy += mdf_inner_prod(st->y+chan*N+st->frame_size, st->y+chan*N+st->frame_size, st->frame_size);
-      Sdd += mdf_inner_prod(st->input+chan*st->frame_size, st->input+chan*st->frame_size, st->frame_size);
-
-      /* Convert error to frequency domain */
-      spx_fft(st->fft_table, st->e+chan*N, st->E+chan*N);
-      for (i=0;i<st->frame_size;i++)
-         st->y[i+chan*N] = 0;
-      spx_fft(st->fft_table, st->y+chan*N, st->Y+chan*N);
+      Sey += st->chan_sums[chan];
+      Syy += st->chan_sums[C+chan];
+      Sdd += st->chan_sums[2*C+chan];
 
       /* Compute power spectrum of echo (X), error (E) and filter response (Y) */
-      power_spectrum_accum(st->E+chan*N, st->Rf, N);
-      power_spectrum_accum(st->Y+chan*N, st->Yf, N);
+      MDF_KERNEL(st, power_spectrum_accum)(st->E+chan*S, st->Rf, S);
+      MDF_KERNEL(st, power_spectrum_accum)(st->Y+chan*S, st->Yf, S);
+   }
 
+   /* This is an arbitrary test for saturation in the microphone signal */
+   for (i=0;i<C*st->frame_size;i++)
+   {
+      if (in[i] <= -32000 || in[i] >= 32000)
+      {
+         if (st->saturated == 0)
+            st->saturated = 1;
+      }
    }
 
    /*printf ("%f %f %f %f\n", Sff, See, Syy, Sdd, st->update_cond);*/
@@ -1032,7 +2307,7 @@ EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, c
    if (st->screwed_up>=50)
    {
       speex_warning("The echo canceller started acting funny and got slapped (reset). It swears it will behave now.");
-      speex_echo_state_reset(st);
+      echo_state_reset(st);
       return;
    }
 
@@ -1042,7 +2317,7 @@ EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, c
    for (speak = 0; speak < K; speak++)
    {
       Sxx += mdf_inner_prod(st->x+speak*N+st->frame_size, st->x+speak*N+st->frame_size, st->frame_size);
-      power_spectrum_accum(st->X+speak*N, st->Xf, N);
+      MDF_KERNEL(st, power_spectrum_accum)(st->X+st->X_pos*S*K+speak*S, st->Xf, S);
    }
 
 
@@ -1121,7 +2396,7 @@ EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, c
 #endif
 
    /* We consider that the filter has had minimal adaptation if the following is true*/
-   if (!st->adapted && st->sum_adapt > SHL32(EXTEND32(M),15) && MULT16_32_Q15(st->leak_estimate,Syy) > MULT16_32_Q15(QCONST16(.03f,15),Syy))
+   if (!st->adapted && st->sum_adapt > SHL32(EXTEND32(st->adapt_M),15) && MULT16_32_Q15(st->leak_estimate,Syy) > MULT16_32_Q15(QCONST16(.03f,15),Syy))
    {
       st->adapted = 1;
    }
@@ -1130,26 +2405,9 @@ EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, c
    {
       /* Normal learning rate calculation once we're past the minimal adaptation phase */
       for (i=0;i<=st->frame_size;i++)
-      {
-         spx_word32_t r, e;
-         /* Compute frequency-domain adaptation mask */
-         r = MULT16_32_Q15(st->leak_estimate,SHL32(st->Yf[i],3));
-         e = SHL32(st->Rf[i],3)+1;
-#ifdef FIXED_POINT
-         if (r>SHR32(e,1))
-            r = SHR32(e,1);
-#else
-         if (r>.5*e)
-            r = .5*e;
-#endif
-         r = MULT16_32_Q15(QCONST16(.7,15),r) + MULT16_32_Q15(QCONST16(.3,15),(spx_word32_t)(MULT16_32_Q15(RER,e)));
-         /*st->power_1[i] = adapt_rate*r/(e*(1+st->power[i]));*/
-         st->power_1[i] = FLOAT_SHL(FLOAT_DIV32_FLOAT(r,FLOAT_MUL32U(e,st->power[i]+10)),WEIGHT_SHIFT+16);
-      }
+         st->power_1[i] = mdf_adapt_mask(st, i, RER, st->power[i]);
    } else {
       /* Temporary adaption rate if filter is not yet adapted enough */
-      spx_word16_t adapt_rate=0;
-
       if (Sxx > SHR32(MULT16_16(N, 1000),6))
       {
          tmp32 = MULT16_32_Q15(QCONST16(.25f, 15), Sxx);
@@ -1169,6 +2427,7 @@ EXPORT void speex_echo_cancellation(SpeexEchoState *st, const spx_int16_t *in, c
       /* How much have we adapted so far? */
       st->sum_adapt = ADD32(st->sum_adapt,adapt_rate);
    }
+   echo_tiers_end(st, RER, adapt_rate);
 
    /* FIXME: MC conversion required */
       for (i=0;i<st->frame_size;i++)
@@ -1200,8 +2459,8 @@ void speex_echo_get_residual(SpeexEchoState *st, spx_word32_t *residual_echo, in
       st->y[i] = MULT16_16_Q15(st->window[i],st->last_y[i]);
 
    /* Compute power spectrum of the echo */
-   spx_fft(st->fft_table, st->y, st->Y);
-   power_spectrum(st->Y, residual_echo, N);
+   mdf_fft(&st->workers[0], st->y, st->Y);
+   MDF_KERNEL(st, power_spectrum)(st->Y, st->Yf, st->spec_size);
 
 #ifdef FIXED_POINT
    if (st->leak_estimate > 16383)
@@ -1216,7 +2475,7 @@ void speex_echo_get_residual(SpeexEchoState *st, spx_word32_t *residual_echo, in
 #endif
    /* Estimate residual echo */
    for (i=0;i<=st->frame_size;i++)
-      residual_echo[i] = (spx_int32_t)MULT16_32_Q15(leak2,residual_echo[i]);
+      residual_echo[i] = (spx_int32_t)MULT16_32_Q15(leak2,st->Yf[i]);
 
 }
 
@@ -1250,30 +2509,292 @@ EXPORT int speex_echo_ctl(SpeexEchoState *st, int request, void *ptr)
          break;
       case SPEEX_ECHO_GET_IMPULSE_RESPONSE_SIZE:
          /*FIXME: Implement this for multiple channels */
-         *((spx_int32_t *)ptr) = st->M * st->frame_size;
+         *((spx_int32_t *)ptr) = st->adapt_M * st->frame_size;
          break;
       case SPEEX_ECHO_GET_IMPULSE_RESPONSE:
       {
-         int M = st->M, N = st->window_size, n = st->frame_size, i, j;
+         int M = st->M, S = st->spec_size, n = st->frame_size, i, j, t;
          spx_int32_t *filt = (spx_int32_t *) ptr;
+         EchoWorker *w = &st->workers[0];
          for(j=0;j<M;j++)
          {
             /*FIXME: Implement this for multiple channels */
 #ifdef FIXED_POINT
-            for (i=0;i<N;i++)
-               st->wtmp2[i] = EXTRACT16(PSHR32(st->W[j*N+i],16+NORMALIZE_SCALEDOWN));
-            spx_ifft(st->fft_table, st->wtmp2, st->wtmp);
+            for (i=0;i<S;i++)
+               w->wtmp2[i] = EXTRACT16(PSHR32(st->W[j*S+i],16+NORMALIZE_SCALEDOWN));
+            mdf_ifft(w, w->wtmp2, w->wtmp);
 #else
-            spx_ifft(st->fft_table, &st->W[j*N], st->wtmp);
+            mdf_ifft(w, &st->W[j*S], w->wtmp);
 #endif
             for(i=0;i<n;i++)
-               filt[j*n+i] = PSHR32(MULT16_16(32767,st->wtmp[i]), WEIGHT_SHIFT-NORMALIZE_SCALEDOWN);
+               filt[j*n+i] = PSHR32(MULT16_16(32767,w->wtmp[i]), WEIGHT_SHIFT-NORMALIZE_SCALEDOWN);
+         }
+         filt += M*n;
+         for (t=0;t<st->nb_tiers;t++)
+         {
+            EchoTier *tier = &st->tiers[t];
+            const int TS = tier->spec_size, B = tier->block;
+            for(j=0;j<tier->M;j++)
+            {
+#ifdef FIXED_POINT
+               for (i=0;i<2*B;i++)
+                  w->wtmp2[i] = EXTRACT16(PSHR32(tier->W[j*TS*st->K+i],16+NORMALIZE_SCALEDOWN));
+               tier_ifft(w, t, w->wtmp2, w->wtmp);
+#else
+               tier_ifft(w, t, &tier->W[j*TS*st->K], w->wtmp);
+#endif
+               /* The weights scale with the FFT size */
+               for(i=0;i<B;i++)
+                  filt[j*B+i] = PSHR32(MULT16_16(32767,w->wtmp[i]), WEIGHT_SHIFT-NORMALIZE_SCALEDOWN)/tier->frames;
+            }
+            filt += tier->M*B;
          }
       }
          break;
+      case SPEEX_ECHO_SET_THREADS:
+         return echo_set_threads(st, *(int*)ptr);
+      case SPEEX_ECHO_GET_THREADS:
+#ifdef USE_PTHREADS
+         (*(int*)ptr) = st->nb_threads;
+#else
+         (*(int*)ptr) = 0;
+#endif
+         break;
+      case SPEEX_ECHO_SET_SPARSE:
+         st->sparse = *(int*)ptr != 0;
+         break;
+      case SPEEX_ECHO_GET_SPARSE:
+         (*(int*)ptr) = st->sparse;
+         break;
+      case SPEEX_ECHO_SET_DELAY_SEARCH:
+         if ((*(int*)ptr) > DELAY_MAX)
+            return -1;
+         mdf_delay_init(st, ((*(int*)ptr) + st->frame_size - 1)/st->frame_size);
+         break;
+      case SPEEX_ECHO_GET_DELAY_SEARCH:
+         (*(int*)ptr) = st->delay ? st->delay->max*st->frame_size : 0;
+         break;
+      case SPEEX_ECHO_GET_DELAY:
+         (*(int*)ptr) = st->delay ? st->delay->delay*st->frame_size : 0;
+         break;
+      case SPEEX_ECHO_GET_SKIPPED_FRAMES:
+         (*(spx_int32_t*)ptr) = st->skipped;
+         break;
       default:
          speex_warning_int("Unknown speex_echo_ctl request: ", request);
          return -1;
    }
    return 0;
 }
+
+/* A batch gives each thread (the caller being thread 0) a queue of jobs.
+   Jobs go back to the queue of the thread that last ran their state, as long
+   as that keeps the queues even, so a state's filter stays in the same
+   cache from frame to frame. A thread takes jobs from the front of its own
+   queue, and once it is empty, steals them from the end of the others. */
+
+struct EchoBatchQueue {
+   int head;   /* Next job taken by the owner */
+   int tail;   /* End of the queue, where the other threads steal from */
+#ifdef USE_PTHREADS
+   pthread_mutex_t lock;
+#endif
+};
+
+struct SpeexEchoBatch_ {
+   SpeexEchoJob *jobs;
+   int *order;    /* Job indices grouped by queue, then the queue of each job */
+   int alloc_size;
+   int nb_queues;
+   struct EchoBatchQueue *queues;
+   int stolen;
+#ifdef USE_PTHREADS
+   SpxThreadPool *pool;
+#endif
+};
+
+/* Microseconds from an arbitrary origin, only meant for differences */
+static spx_uint32_t echo_batch_time(void)
+{
+#ifdef CLOCK_MONOTONIC
+   struct timespec t;
+   if (clock_gettime(CLOCK_MONOTONIC, &t) == 0)
+      return (spx_uint32_t)t.tv_sec*1000000 + (spx_uint32_t)(t.tv_nsec/1000);
+#endif
+   return 0;
+}
+
+#ifdef USE_PTHREADS
+/* Takes the next job of queue q, from its end if steal is set */
+static int echo_batch_take(SpeexEchoBatch *batch, int q, int steal)
+{
+   struct EchoBatchQueue *queue = &batch->queues[q];
+   int job = -1;
+   pthread_mutex_lock(&queue->lock);
+   if (queue->head < queue->tail)
+      job = batch->order[steal ? --queue->tail : queue->head++];
+   pthread_mutex_unlock(&queue->lock);
+   return job;
+}
+
+/* Runs the jobs of queue id, then those left in the other queues */
+static void echo_batch_run(void *arg, int id)
+{
+   SpeexEchoBatch *batch = (SpeexEchoBatch *)arg;
+   int stolen = 0;
+   int q = id;
+   for (;;)
+   {
+      SpeexEchoJob *job;
+      int i = echo_batch_take(batch, q, q != id);
+      if (i < 0)
+      {
+         /* Go on to the next queue that still has jobs, if any */
+         if ((q = (q+1)%batch->nb_queues) == id)
+            break;
+         continue;
+      }
+      job = &batch->jobs[i];
+      speex_echo_cancellation(job->st, job->rec, job->play, job->out);
+      job->st->batch_owner = id+1;
+      if (q != id)
+         stolen++;
+   }
+   spx_pool_lock(batch->pool);
+   batch->stolen += stolen;
+   spx_pool_unlock(batch->pool);
+}
+
+/* Fills the queues, keeping each state with its last thread where possible */
+static void echo_batch_assign(SpeexEchoBatch *batch, int nb_jobs)
+{
+   const int nb_queues = batch->nb_queues;
+   const int target = (nb_jobs + nb_queues - 1)/nb_queues;
+   int *queue_of = batch->order + nb_jobs;
+   int i, q, pos;
+
+   for (q=0;q<nb_queues;q++)
+      batch->queues[q].tail = 0;
+   for (i=0;i<nb_jobs;i++)
+   {
+      q = batch->jobs[i].st->batch_owner-1;
+      if (q >= 0 && q < nb_queues && batch->queues[q].tail < target)
+         batch->queues[q].tail++;
+      else
+         q = -1;
+      queue_of[i] = q;
+   }
+   /* The other jobs go to the shortest queues */
+   for (i=0;i<nb_jobs;i++)
+   {
+      if (queue_of[i] < 0)
+      {
+         int best = 0;
+         for (q=1;q<nb_queues;q++)
+            if (batch->queues[q].tail < batch->queues[best].tail)
+               best = q;
+         batch->queues[best].tail++;
+         queue_of[i] = best;
+      }
+   }
+   pos = 0;
+   for (q=0;q<nb_queues;q++)
+   {
+      batch->queues[q].head = pos;
+      pos += batch->queues[q].tail;
+      batch->queues[q].tail = batch->queues[q].head;
+   }
+   for (i=0;i<nb_jobs;i++)
+      batch->order[batch->queues[queue_of[i]].tail++] = i;
+}
+#endif
+
+EXPORT SpeexEchoBatch *speex_echo_batch_init(int nb_threads)
+{
+   SpeexEchoBatch *batch;
+
+   if (nb_threads < 0)
+      return NULL;
+#ifndef USE_PTHREADS
+   nb_threads = 0;
+#endif
+   batch = (SpeexEchoBatch *)speex_alloc(sizeof(SpeexEchoBatch));
+   if (!batch)
+      return NULL;
+   batch->queues = (struct EchoBatchQueue *)speex_alloc((nb_threads+1)*sizeof(struct EchoBatchQueue));
+   if (!batch->queues)
+   {
+      speex_free(batch);
+      return NULL;
+   }
+#ifdef USE_PTHREADS
+   /* One queue per worker, and one for the caller */
+   for (batch->nb_queues=0;batch->nb_queues<nb_threads+1;batch->nb_queues++)
+      pthread_mutex_init(&batch->queues[batch->nb_queues].lock, NULL);
+   if (nb_threads > 0)
+   {
+      batch->pool = spx_pool_create(nb_threads, echo_batch_run, batch);
+      if (!batch->pool)
+      {
+         speex_echo_batch_destroy(batch);
+         return NULL;
+      }
+   }
+#else
+   batch->nb_queues = 1;
+#endif
+   return batch;
+}
+
+EXPORT void speex_echo_batch_destroy(SpeexEchoBatch *batch)
+{
+#ifdef USE_PTHREADS
+   int i;
+   if (batch->pool)
+      spx_pool_destroy(batch->pool);
+   for (i=0;i<batch->nb_queues;i++)
+      pthread_mutex_destroy(&batch->queues[i].lock);
+#endif
+   speex_free(batch->queues);
+   speex_free(batch->order);
+   speex_free(batch);
+}
+
+EXPORT void speex_echo_batch_process(SpeexEchoBatch *batch, SpeexEchoJob *jobs, int nb_jobs, SpeexEchoBatchStats *stats)
+{
+   int i;
+   spx_uint32_t start = echo_batch_time();
+
+   batch->jobs = jobs;
+   batch->stolen = 0;
+   if (nb_jobs > batch->alloc_size)
+   {
+      int *order = NULL;
+      if (nb_jobs <= INT_MAX/(2*(int)sizeof(int)))
+         order = (int *)speex_realloc(batch->order, 2*nb_jobs*sizeof(int));
+      if (order)
+      {
+         batch->order = order;
+         batch->alloc_size = nb_jobs;
+      }
+   }
+#ifdef USE_PTHREADS
+   if (batch->pool && nb_jobs > 1 && nb_jobs <= batch->alloc_size)
+   {
+      echo_batch_assign(batch, nb_jobs);
+      spx_pool_run(batch->pool);
+   } else
+#endif
+   {
+      /* Everything on the calling thread, leaving the thread of each state
+         as it was */
+      for (i=0;i<nb_jobs;i++)
+         speex_echo_cancellation(jobs[i].st, jobs[i].rec, jobs[i].play, jobs[i].out);
+   }
+
+   if (stats)
+   {
+      stats->wall_time = echo_batch_time() - start;
+      stats->stolen = batch->stolen;
+   }
+}
@@ -0,0 +1,206 @@
+/* Copyright (C) 2026 Xiph.Org Foundation */
+/**
+   @file mdf_avx2.h
+   @brief Echo canceller spectral functions (AVX2/FMA version, selected at runtime)
+*/
+/*
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Xiph.org Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <immintrin.h>
+
+/* Four bins (eight floats) per iteration, in the packed layout described in
+   mdf_sse.h. The fused multiply-adds round once where the generic code
+   rounds twice, so the results are only close to the generic ones. */
+
+AVX2_TARGET static inline void power_spectrum_avx2(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i, j;
+   ps[0]=X[0]*X[0];
+   for (i=1,j=1;i+16<N;i+=16,j+=8)
+   {
+      __m256 a = _mm256_loadu_ps(X+i);
+      __m256 b = _mm256_loadu_ps(X+i+8);
+      /* Bins 0,1,4,5 in the low half and 2,3,6,7 in the high one */
+      __m256 re = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+      __m256 im = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+      __m256 p = _mm256_fmadd_ps(re, re, _mm256_mul_ps(im, im));
+      _mm256_storeu_ps(ps+j, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(p), _MM_SHUFFLE(3,1,2,0))));
+   }
+   for (;i<N-1;i+=2,j++)
+      ps[j] = X[i]*X[i] + X[i+1]*X[i+1];
+   ps[j]=X[i]*X[i];
+}
+
+AVX2_TARGET static inline void power_spectrum_accum_avx2(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i, j;
+   ps[0]+=X[0]*X[0];
+   for (i=1,j=1;i+16<N;i+=16,j+=8)
+   {
+      __m256 a = _mm256_loadu_ps(X+i);
+      __m256 b = _mm256_loadu_ps(X+i+8);
+      __m256 re = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+      __m256 im = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+      __m256 p = _mm256_fmadd_ps(re, re, _mm256_mul_ps(im, im));
+      p = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(p), _MM_SHUFFLE(3,1,2,0)));
+      _mm256_storeu_ps(ps+j, _mm256_add_ps(_mm256_loadu_ps(ps+j), p));
+   }
+   for (;i<N-1;i+=2,j++)
+      ps[j] += X[i]*X[i] + X[i+1]*X[i+1];
+   ps[j]+=X[i]*X[i];
+}
+
+AVX2_TARGET static inline void spectral_mul_accum_avx2(const spx_word16_t *X, int start, int R, const spx_word32_t *Y, spx_word16_t *acc, int N, int M)
+{
+   int i,j;
+   const spx_word16_t *Xb = X + start*N;
+   for (i=0;i<N;i++)
+      acc[i] = 0;
+   for (j=0;j<M;j++)
+   {
+      acc[0] += Xb[0]*Y[0];
+      for (i=1;i+8<N;i+=8)
+      {
+         __m256 x = _mm256_loadu_ps(Xb+i);
+         __m256 y = _mm256_loadu_ps(Y+i);
+         __m256 xs = _mm256_permute_ps(x, _MM_SHUFFLE(2,3,0,1));
+         /* xr*yr - xi*yi in the even lanes, xi*yr + xr*yi in the odd ones */
+         __m256 p = _mm256_fmaddsub_ps(x, _mm256_moveldup_ps(y), _mm256_mul_ps(xs, _mm256_movehdup_ps(y)));
+         _mm256_storeu_ps(acc+i, _mm256_add_ps(_mm256_loadu_ps(acc+i), p));
+      }
+      for (;i<N-1;i+=2)
+      {
+         acc[i] += (Xb[i]*Y[i] - Xb[i+1]*Y[i+1]);
+         acc[i+1] += (Xb[i+1]*Y[i] + Xb[i]*Y[i+1]);
+      }
+      acc[i] += Xb[i]*Y[i];
+      Xb += N;
+      if (Xb == X + R*N)
+         Xb = X;
+      Y += N;
+   }
+}
+#define spectral_mul_accum16_avx2 spectral_mul_accum_avx2
+
+AVX2_TARGET static inline void weighted_spectral_mul_conj_avx2(const spx_float_t *w, const spx_float_t p, const spx_word16_t *X, const spx_word16_t *Y, spx_word32_t *prod, int N)
+{
+   int i, j;
+   const __m256 sign = _mm256_castsi256_ps(_mm256_set_epi32(0x80000000, 0, 0x80000000, 0, 0x80000000, 0, 0x80000000, 0));
+   const __m256 pp = _mm256_set1_ps(p);
+   prod[0] += (p*w[0])*(X[0]*Y[0]);
+   for (i=1,j=1;i+8<N;i+=8,j+=4)
+   {
+      __m256 x = _mm256_loadu_ps(X+i);
+      __m256 y = _mm256_loadu_ps(Y+i);
+      __m256 xs = _mm256_permute_ps(x, _MM_SHUFFLE(2,3,0,1));
+      /* w[j..j+3], each repeated for the real and imaginary parts */
+      __m256 W = _mm256_mul_ps(pp, _mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm_loadu_ps(w+j)), _mm256_set_epi32(3,3,2,2,1,1,0,0)));
+      /* xr*yr + xi*yi in the even lanes, and xi*yr - xr*yi negated in the
+         odd ones */
+      __m256 c = _mm256_xor_ps(_mm256_fmsubadd_ps(x, _mm256_moveldup_ps(y), _mm256_mul_ps(xs, _mm256_movehdup_ps(y))), sign);
+      _mm256_storeu_ps(prod+i, _mm256_fmadd_ps(W, c, _mm256_loadu_ps(prod+i)));
+   }
+   for (;i<N-1;i+=2,j++)
+   {
+      spx_float_t W = p*w[j];
+      prod[i] += W*(X[i]*Y[i] + X[i+1]*Y[i+1]);
+      prod[i+1] += W*(-X[i+1]*Y[i] + X[i]*Y[i+1]);
+   }
+   prod[i] += (p*w[j])*(X[i]*Y[i]);
+}
+
+/* Split spectra, as in mdf_sse.h, with the products fused the same way as
+   in the packed versions above */
+
+AVX2_TARGET static inline void power_spectrum_split_avx2(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i+=8)
+   {
+      __m256 re = _mm256_loadu_ps(X+i);
+      __m256 im = _mm256_loadu_ps(X+B+i);
+      _mm256_storeu_ps(ps+i, _mm256_fmadd_ps(re, re, _mm256_mul_ps(im, im)));
+   }
+}
+
+AVX2_TARGET static inline void power_spectrum_accum_split_avx2(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i+=8)
+   {
+      __m256 re = _mm256_loadu_ps(X+i);
+      __m256 im = _mm256_loadu_ps(X+B+i);
+      _mm256_storeu_ps(ps+i, _mm256_add_ps(_mm256_loadu_ps(ps+i), _mm256_fmadd_ps(re, re, _mm256_mul_ps(im, im))));
+   }
+}
+
+AVX2_TARGET static inline void spectral_mul_accum_split_avx2(const spx_word16_t *X, int start, int R, const spx_word32_t *Y, spx_word16_t *acc, int N, int M)
+{
+   int i,j;
+   const int B = N/2;
+   const spx_word16_t *Xb = X + start*N;
+   for (i=0;i<N;i++)
+      acc[i] = 0;
+   for (j=0;j<M;j++)
+   {
+      for (i=0;i<B;i+=8)
+      {
+         __m256 xr = _mm256_loadu_ps(Xb+i);
+         __m256 xi = _mm256_loadu_ps(Xb+B+i);
+         __m256 yr = _mm256_loadu_ps(Y+i);
+         __m256 yi = _mm256_loadu_ps(Y+B+i);
+         _mm256_storeu_ps(acc+i, _mm256_add_ps(_mm256_loadu_ps(acc+i), _mm256_fmsub_ps(xr, yr, _mm256_mul_ps(xi, yi))));
+         _mm256_storeu_ps(acc+B+i, _mm256_add_ps(_mm256_loadu_ps(acc+B+i), _mm256_fmadd_ps(xi, yr, _mm256_mul_ps(xr, yi))));
+      }
+      Xb += N;
+      if (Xb == X + R*N)
+         Xb = X;
+      Y += N;
+   }
+}
+#define spectral_mul_accum16_split_avx2 spectral_mul_accum_split_avx2
+
+AVX2_TARGET static inline void weighted_spectral_mul_conj_split_avx2(const spx_float_t *w, const spx_float_t p, const spx_word16_t *X, const spx_word16_t *Y, spx_word32_t *prod, int N)
+{
+   int i;
+   const int B = N/2;
+   const __m256 pp = _mm256_set1_ps(p);
+   for (i=0;i<B;i+=8)
+   {
+      __m256 W = _mm256_mul_ps(pp, _mm256_loadu_ps(w+i));
+      __m256 xr = _mm256_loadu_ps(X+i);
+      __m256 xi = _mm256_loadu_ps(X+B+i);
+      __m256 yr = _mm256_loadu_ps(Y+i);
+      __m256 yi = _mm256_loadu_ps(Y+B+i);
+      _mm256_storeu_ps(prod+i, _mm256_fmadd_ps(W, _mm256_fmadd_ps(xr, yr, _mm256_mul_ps(xi, yi)), _mm256_loadu_ps(prod+i)));
+      _mm256_storeu_ps(prod+B+i, _mm256_fmadd_ps(W, _mm256_fnmadd_ps(xi, yr, _mm256_mul_ps(xr, yi)), _mm256_loadu_ps(prod+B+i)));
+   }
+}
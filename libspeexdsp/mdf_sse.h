@@ -0,0 +1,216 @@
+/* Copyright (C) 2026 Xiph.Org Foundation */
+/**
+   @file mdf_sse.h
+   @brief Echo canceller spectral functions (SSE version)
+*/
+/*
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Xiph.org Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <xmmintrin.h>
+
+/* The spectra are in the packed layout of the real FFT: X[0] is the DC
+   term, X[N-1] the Nyquist term, and X[i], X[i+1] (i odd) are the real and
+   imaginary parts of one bin. The loops below take two bins (four floats)
+   at a time from X[1], with unaligned loads, and finish the bins that are
+   left like the generic code. Every product and sum is done in the same
+   order as in the generic code, so the results are bit-exact. */
+
+/* Complex products of x by y for two bins: the real part first gets
+   -xi*yi, which is how the generic code subtracts it */
+static inline __m128 complex_mul_sse(__m128 x, __m128 y)
+{
+   const __m128 sign = _mm_set_ps(1.f, -1.f, 1.f, -1.f);
+   __m128 yr = _mm_shuffle_ps(y, y, _MM_SHUFFLE(2,2,0,0));
+   __m128 yi = _mm_shuffle_ps(y, y, _MM_SHUFFLE(3,3,1,1));
+   __m128 xs = _mm_shuffle_ps(x, x, _MM_SHUFFLE(2,3,0,1));
+   return _mm_add_ps(_mm_mul_ps(x, yr), _mm_mul_ps(_mm_mul_ps(xs, yi), sign));
+}
+
+#define OVERRIDE_POWER_SPECTRUM
+static inline void power_spectrum(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i, j;
+   ps[0]=X[0]*X[0];
+   for (i=1,j=1;i+8<N;i+=8,j+=4)
+   {
+      __m128 a = _mm_loadu_ps(X+i);
+      __m128 b = _mm_loadu_ps(X+i+4);
+      __m128 re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+      __m128 im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+      _mm_storeu_ps(ps+j, _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im)));
+   }
+   for (;i<N-1;i+=2,j++)
+      ps[j] = X[i]*X[i] + X[i+1]*X[i+1];
+   ps[j]=X[i]*X[i];
+}
+
+#define OVERRIDE_POWER_SPECTRUM_ACCUM
+static inline void power_spectrum_accum(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i, j;
+   ps[0]+=X[0]*X[0];
+   for (i=1,j=1;i+8<N;i+=8,j+=4)
+   {
+      __m128 a = _mm_loadu_ps(X+i);
+      __m128 b = _mm_loadu_ps(X+i+4);
+      __m128 re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+      __m128 im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+      _mm_storeu_ps(ps+j, _mm_add_ps(_mm_loadu_ps(ps+j), _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im))));
+   }
+   for (;i<N-1;i+=2,j++)
+      ps[j] += X[i]*X[i] + X[i+1]*X[i+1];
+   ps[j]+=X[i]*X[i];
+}
+
+#define OVERRIDE_SPECTRAL_MUL_ACCUM
+static inline void spectral_mul_accum(const spx_word16_t *X, int start, int R, const spx_word32_t *Y, spx_word16_t *acc, int N, int M)
+{
+   int i,j;
+   const spx_word16_t *Xb = X + start*N;
+   for (i=0;i<N;i++)
+      acc[i] = 0;
+   for (j=0;j<M;j++)
+   {
+      acc[0] += Xb[0]*Y[0];
+      for (i=1;i+4<N;i+=4)
+         _mm_storeu_ps(acc+i, _mm_add_ps(_mm_loadu_ps(acc+i), complex_mul_sse(_mm_loadu_ps(Xb+i), _mm_loadu_ps(Y+i))));
+      for (;i<N-1;i+=2)
+      {
+         acc[i] += (Xb[i]*Y[i] - Xb[i+1]*Y[i+1]);
+         acc[i+1] += (Xb[i+1]*Y[i] + Xb[i]*Y[i+1]);
+      }
+      acc[i] += Xb[i]*Y[i];
+      Xb += N;
+      if (Xb == X + R*N)
+         Xb = X;
+      Y += N;
+   }
+}
+
+#define OVERRIDE_WEIGHTED_SPECTRAL_MUL_CONJ
+static inline void weighted_spectral_mul_conj(const spx_float_t *w, const spx_float_t p, const spx_word16_t *X, const spx_word16_t *Y, spx_word32_t *prod, int N)
+{
+   int i, j;
+   const __m128 sign = _mm_set_ps(-1.f, 1.f, -1.f, 1.f);
+   const __m128 pp = _mm_set1_ps(p);
+   prod[0] += (p*w[0])*(X[0]*Y[0]);
+   for (i=1,j=1;i+4<N;i+=4,j+=2)
+   {
+      __m128 x = _mm_loadu_ps(X+i);
+      __m128 y = _mm_loadu_ps(Y+i);
+      __m128 wj = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)(w+j));
+      __m128 W = _mm_mul_ps(pp, _mm_shuffle_ps(wj, wj, _MM_SHUFFLE(1,1,0,0)));
+      __m128 yr = _mm_shuffle_ps(y, y, _MM_SHUFFLE(2,2,0,0));
+      __m128 yi = _mm_shuffle_ps(y, y, _MM_SHUFFLE(3,3,1,1));
+      __m128 xs = _mm_shuffle_ps(x, x, _MM_SHUFFLE(2,3,0,1));
+      /* Conjugate of x times y: the imaginary part starts from -xi*yr */
+      __m128 c = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(x, yr), sign), _mm_mul_ps(xs, yi));
+      _mm_storeu_ps(prod+i, _mm_add_ps(_mm_loadu_ps(prod+i), _mm_mul_ps(W, c)));
+   }
+   for (;i<N-1;i+=2,j++)
+   {
+      spx_float_t W = p*w[j];
+      prod[i] += W*(X[i]*Y[i] + X[i+1]*Y[i+1]);
+      prod[i+1] += W*(-X[i+1]*Y[i] + X[i]*Y[i+1]);
+   }
+   prod[i] += (p*w[j])*(X[i]*Y[i]);
+}
+
+/* Split spectra of N values hold the real parts of N/2 bins, then their
+   imaginary parts. N/2 is a multiple of 8, so there is no tail. */
+
+#define OVERRIDE_POWER_SPECTRUM_SPLIT
+static inline void power_spectrum_split(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i+=4)
+   {
+      __m128 re = _mm_loadu_ps(X+i);
+      __m128 im = _mm_loadu_ps(X+B+i);
+      _mm_storeu_ps(ps+i, _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im)));
+   }
+}
+
+#define OVERRIDE_POWER_SPECTRUM_ACCUM_SPLIT
+static inline void power_spectrum_accum_split(const spx_word16_t *X, spx_word32_t *ps, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i+=4)
+   {
+      __m128 re = _mm_loadu_ps(X+i);
+      __m128 im = _mm_loadu_ps(X+B+i);
+      _mm_storeu_ps(ps+i, _mm_add_ps(_mm_loadu_ps(ps+i), _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im))));
+   }
+}
+
+#define OVERRIDE_SPECTRAL_MUL_ACCUM_SPLIT
+static inline void spectral_mul_accum_split(const spx_word16_t *X, int start, int R, const spx_word32_t *Y, spx_word16_t *acc, int N, int M)
+{
+   int i,j;
+   const int B = N/2;
+   const spx_word16_t *Xb = X + start*N;
+   for (i=0;i<N;i++)
+      acc[i] = 0;
+   for (j=0;j<M;j++)
+   {
+      for (i=0;i<B;i+=4)
+      {
+         __m128 xr = _mm_loadu_ps(Xb+i);
+         __m128 xi = _mm_loadu_ps(Xb+B+i);
+         __m128 yr = _mm_loadu_ps(Y+i);
+         __m128 yi = _mm_loadu_ps(Y+B+i);
+         _mm_storeu_ps(acc+i, _mm_add_ps(_mm_loadu_ps(acc+i), _mm_sub_ps(_mm_mul_ps(xr, yr), _mm_mul_ps(xi, yi))));
+         _mm_storeu_ps(acc+B+i, _mm_add_ps(_mm_loadu_ps(acc+B+i), _mm_add_ps(_mm_mul_ps(xi, yr), _mm_mul_ps(xr, yi))));
+      }
+      Xb += N;
+      if (Xb == X + R*N)
+         Xb = X;
+      Y += N;
+   }
+}
+
+#define OVERRIDE_WEIGHTED_SPECTRAL_MUL_CONJ_SPLIT
+static inline void weighted_spectral_mul_conj_split(const spx_float_t *w, const spx_float_t p, const spx_word16_t *X, const spx_word16_t *Y, spx_word32_t *prod, int N)
+{
+   int i;
+   const int B = N/2;
+   const __m128 pp = _mm_set1_ps(p);
+   for (i=0;i<B;i+=4)
+   {
+      __m128 W = _mm_mul_ps(pp, _mm_loadu_ps(w+i));
+      __m128 xr = _mm_loadu_ps(X+i);
+      __m128 xi = _mm_loadu_ps(X+B+i);
+      __m128 yr = _mm_loadu_ps(Y+i);
+      __m128 yi = _mm_loadu_ps(Y+B+i);
+      _mm_storeu_ps(prod+i, _mm_add_ps(_mm_loadu_ps(prod+i), _mm_mul_ps(W, _mm_add_ps(_mm_mul_ps(xr, yr), _mm_mul_ps(xi, yi)))));
+      _mm_storeu_ps(prod+B+i, _mm_add_ps(_mm_loadu_ps(prod+B+i), _mm_mul_ps(W, _mm_sub_ps(_mm_mul_ps(xr, yi), _mm_mul_ps(xi, yr)))));
+   }
+}
@@ -63,9 +63,11 @@
 
 #ifdef OUTSIDE_SPEEX
 #include <stdlib.h>
+#include <string.h>
 static void *speex_alloc(int size) {return calloc(size,1);}
 static void *speex_realloc(void *ptr, int size) {return realloc(ptr, size);}
 static void speex_free(void *ptr) {free(ptr);}
+#define SPEEX_MOVE(dst, src, n) (memmove((dst), (src), (n)*sizeof(*(dst))))
 #ifndef EXPORT
 #define EXPORT
 #endif
@@ -74,6 +76,7 @@ static void speex_free(void *ptr) {free(ptr);}
 #else /* OUTSIDE_SPEEX */
 
 #include "speex/speex_resampler.h"
+#include "speex/speex_buffer.h"
 #include "arch.h"
 #include "os_support.h"
 #endif /* OUTSIDE_SPEEX */
@@ -81,6 +84,11 @@ static void speex_free(void *ptr) {free(ptr);}
 #include <math.h>
 #include <limits.h>
 
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#include "threadpool.h"
+#endif
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
@@ -96,28 +104,65 @@ static void speex_free(void *ptr) {free(ptr);}
 #define UINT32_MAX 4294967295U
 #endif
 
-#ifdef USE_SSE
+/* The fixed-point x86 kernels only need SSE2 integer instructions */
+#if defined(USE_SSE) || (defined(FIXED_POINT) && defined(USE_SSE2))
 #include "resample_sse.h"
 #endif
 
+#ifdef USE_AVX2
+#include "x86cpu.h"
+#include "resample_avx2.h"
+#endif
+
 #ifdef USE_NEON
 #include "resample_neon.h"
 #endif
 
-/* Number of elements to allocate on the stack */
-#ifdef VAR_ARRAYS
-#define FIXED_STACK_ALLOC 8192
+typedef int (*resampler_basic_func)(SpeexResamplerState *, spx_uint32_t , const spx_word16_t *, spx_uint32_t *, void *, spx_uint32_t *);
+typedef int (*resampler_interleaved_func)(SpeexResamplerState *, const spx_word16_t *, spx_uint32_t *, void *, spx_uint32_t *);
+
+/* The format held by the filter memory and computed by the kernels */
+#ifdef FIXED_POINT
+#define NATIVE_FORMAT SPEEX_RESAMPLER_FORMAT_S16
 #else
-#define FIXED_STACK_ALLOC 1024
+#define NATIVE_FORMAT SPEEX_RESAMPLER_FORMAT_FLOAT
 #endif
 
-typedef int (*resampler_basic_func)(SpeexResamplerState *, spx_uint32_t , const spx_word16_t *, spx_uint32_t *, spx_word16_t *, spx_uint32_t *);
+/* Below this many channels, interleaved streams go through the per-channel
+   path even when the channel-interleaved kernels are enabled */
+#define INTERLEAVED_MIN_CHANNELS 8
+
+/* Large down-sampling ratios can be handled by a cascade of half-band
+   decimators in front of the fractional filter, which then sees a smaller
+   ratio and needs a much shorter filter */
+#define MAX_HALFBAND_STAGES 8
+#define MAX_HALFBAND_TAPS 64
+
+/* The pull functions ask for about this many input frames at a time */
+#define PULL_CHUNK 1024
+
+/* A linear-phase half-band FIR of length 4m+3. Apart from the centre tap
+   (0.5), only the 2m+2 taps at odd distances from it are non-zero, and they
+   are symmetric, so only h[0], h[2], ..., h[2m] are stored. */
+struct HalfbandStage {
+   int len;
+   spx_word16_t *taps;
+   spx_uint32_t alloc_size;
+   spx_word16_t *mem;       /* Per-channel input buffers of alloc_size */
+   spx_uint32_t *fill;      /* Per-channel number of samples in mem */
+};
 
 struct SpeexResamplerState_ {
    spx_uint32_t in_rate;
    spx_uint32_t out_rate;
    spx_uint32_t num_rate;
    spx_uint32_t den_rate;
+   /* The reduced ratio asked for. num_rate/den_rate is the ratio of the
+      fractional filter, after the half-band stages. */
+   spx_uint32_t ratio_num;
+   spx_uint32_t ratio_den;
+   int          nb_stages;
+   struct HalfbandStage stages[MAX_HALFBAND_STAGES];
 
    int    quality;
    spx_uint32_t nb_channels;
@@ -126,23 +171,53 @@ struct SpeexResamplerState_ {
    spx_uint32_t buffer_size;
    int          int_advance;
    int          frac_advance;
+   /* In asrc mode, samp_frac_num is a 32-bit fraction of an input sample
+      and the step is int_advance + step_frac/2^32 */
+   int          asrc;
+   spx_uint32_t step_frac;
+   int          phase;
+   spx_uint32_t filt_delay;  /* Delay of the filter, in input samples */
    float  cutoff;
    spx_uint32_t oversample;
    int          initialised;
-   int          started;
+   int          use_avx2;
 
    /* These are per-channel */
+   int          *started;     /* Only written by the thread running the channel */
    spx_int32_t  *last_sample;
    spx_uint32_t *samp_frac_num;
    spx_uint32_t *magic_samples;
 
    spx_word16_t *mem;
-   spx_word16_t *sinc_table;
-   spx_uint32_t sinc_table_length;
+   const spx_word16_t *sinc_table;
+   struct SincTable *sinc_entry;
    resampler_basic_func resampler_ptr;
+   int    use_direct;
+
+   /* Channel-interleaved history (and interpolated taps) used by the
+      interleaved process functions, when speex_resampler_set_interleaved()
+      enabled them */
+   int    interleaved;
+   resampler_interleaved_func interleaved_ptr;
+   spx_word16_t *ihist;
+   spx_uint32_t ihist_alloc_size;
 
    int    in_stride;
    int    out_stride;
+   int    out_format;  /* Format the resamplers write, set by each process call */
+
+   /* Input of the pull functions, and where it is read to. The last
+      output can depend on a sample that the filter doesn't consume yet, so
+      that frame stays at the start of pull_buf for the next call. */
+   speex_resampler_input_func input_func;
+   void  *input_user;
+#ifndef OUTSIDE_SPEEX
+   SpeexBuffer *input_buffer;
+#endif
+   int    input_format;
+   void  *pull_buf;
+   spx_uint32_t pull_alloc_size;  /* In frames */
+   spx_uint32_t pull_fill;        /* Frames left over in pull_buf */
 } ;
 
 static const double kaiser12_table[68] = {
@@ -243,7 +318,8 @@ static double compute_func(float x, const struct FuncDef *func)
    double interp[4];
    int ind;
    y = x*func->oversample;
-   ind = (int)floor(y);
+   /* x is never negative, so this is floor() */
+   ind = (int)y;
    frac = (y-ind);
    /* CSE with handle the repeated powers */
    interp[3] =  -0.1666666667*frac + 0.1666666667*(frac*frac*frac);
@@ -271,35 +347,53 @@ int main(int argc, char **argv)
 #endif
 
 #ifdef FIXED_POINT
-/* The slow way of computing a sinc for the table. Should improve that some day */
-static spx_word16_t sinc(float cutoff, float x, int N, const struct FuncDef *window_func)
-{
-   /*fprintf (stderr, "%f ", x);*/
-   float xx = x * cutoff;
-   if (fabs(x)<1e-6f)
-      return WORD2INT(32768.*cutoff);
-   else if (fabs(x) > .5f*N)
-      return 0;
-   /*FIXME: Can it really be any slower than this? */
-   return WORD2INT(32768.*cutoff*sin(M_PI*xx)/(M_PI*xx) * compute_func(fabs(2.*x/N), window_func));
-}
+#define SINC_WORD(x) WORD2INT(32768.*(x))
 #else
-/* The slow way of computing a sinc for the table. Should improve that some day */
-static spx_word16_t sinc(float cutoff, float x, int N, const struct FuncDef *window_func)
-{
-   /*fprintf (stderr, "%f ", x);*/
-   float xx = x * cutoff;
-   if (fabs(x)<1e-6)
-      return cutoff;
-   else if (fabs(x) > .5*N)
-      return 0;
-   /*FIXME: Can it really be any slower than this? */
-   return cutoff*sin(M_PI*xx)/(M_PI*xx) * compute_func(fabs(2.*x/N), window_func);
-}
+#define SINC_WORD(x) (x)
 #endif
 
+/* Returns sin(pi*cutoff*j) and cos(pi*cutoff*j) interleaved for the n
+   integers j starting at j0, or NULL if it could not be allocated. */
+static double *sinc_phase_init(float cutoff, spx_int32_t j0, spx_uint32_t n)
+{
+   double *sc;
+   spx_uint32_t k;
+   if (n > INT_MAX/(2*sizeof(double)))
+      return NULL;
+   sc = (double *)speex_alloc(2*n*sizeof(double));
+   if (!sc)
+      return NULL;
+   for (k=0;k<n;k++)
+   {
+      sc[2*k] = sin(M_PI*cutoff*(j0+(spx_int32_t)k));
+      sc[2*k+1] = cos(M_PI*cutoff*(j0+(spx_int32_t)k));
+   }
+   return sc;
+}
+
+/* Windowed sinc for a whole phase of the table: out[k*stride] gets the tap
+   at x = j0+k+frac for k in [0, n), sc being the output of sinc_phase_init()
+   starting at j0. The sine is split as sin(pi*cutoff*(j0+k) + pi*cutoff*frac)
+   so that a phase costs a single sin()/cos() pair instead of one per tap. */
+static void sinc_phase(float cutoff, int N, const struct FuncDef *window_func, const double *sc, spx_int32_t j0, double frac, spx_uint32_t n, spx_word16_t *out, spx_uint32_t stride)
+{
+   const double sf = sin(M_PI*cutoff*frac);
+   const double cf = cos(M_PI*cutoff*frac);
+   spx_uint32_t k;
+   for (k=0;k<n;k++)
+   {
+      const double x = (j0+(spx_int32_t)k) + frac;
+      if (fabs(x)<1e-6)
+         out[k*stride] = SINC_WORD(cutoff);
+      else if (fabs(x) > .5*N)
+         out[k*stride] = 0;
+      else
+         out[k*stride] = SINC_WORD((sc[2*k]*cf + sc[2*k+1]*sf)/(M_PI*x) * compute_func(fabs(2.*x/N), window_func));
+   }
+}
+
 #ifdef FIXED_POINT
-static void cubic_coef(spx_word16_t x, spx_word16_t interp[4])
+static inline void cubic_coef(spx_word16_t x, spx_word16_t interp[4])
 {
    /* Compute interpolation coefficients. I'm not sure whether this corresponds to cubic interpolation
    but I know it's MMSE-optimal on a sinc */
@@ -315,7 +409,7 @@ static void cubic_coef(spx_word16_t x, spx_word16_t interp[4])
       interp[2]+=1;
 }
 #else
-static void cubic_coef(spx_word16_t frac, spx_word16_t interp[4])
+static inline void cubic_coef(spx_word16_t frac, spx_word16_t interp[4])
 {
    /* Compute interpolation coefficients. I'm not sure whether this corresponds to cubic interpolation
    but I know it's MMSE-optimal on a sinc */
@@ -328,17 +422,291 @@ static void cubic_coef(spx_word16_t frac, spx_word16_t interp[4])
 }
 #endif
 
-static int resampler_basic_direct_single(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, spx_word16_t *out, spx_uint32_t *out_len)
+#ifndef OVERRIDE_INNER_PRODUCT_SINGLE
+static inline spx_word32_t inner_product_single(const spx_word16_t *a, const spx_word16_t *b, unsigned int len)
+{
+   unsigned int j;
+   spx_word32_t sum = 0;
+   for(j=0;j<len;j++) sum += MULT16_16(a[j], b[j]);
+
+/*    This code is slower on most DSPs which have only 2 accumulators.
+      Plus this this forces truncation to 32 bits and you lose the HW guard bits.
+      I think we can trust the compiler and let it vectorize and/or unroll itself.
+      spx_word32_t accum[4] = {0,0,0,0};
+      for(j=0;j<len;j+=4) {
+        accum[0] += MULT16_16(a[j], b[j]);
+        accum[1] += MULT16_16(a[j+1], b[j+1]);
+        accum[2] += MULT16_16(a[j+2], b[j+2]);
+        accum[3] += MULT16_16(a[j+3], b[j+3]);
+      }
+      sum = accum[0] + accum[1] + accum[2] + accum[3];
+*/
+   return SATURATE32PSHR(sum, 15, 32767);
+}
+#endif
+
+#ifndef OVERRIDE_INTERPOLATE_PRODUCT_SINGLE
+static inline spx_word32_t interpolate_product_single(const spx_word16_t *a, const spx_word16_t *b, unsigned int len, const spx_uint32_t oversample, spx_word16_t *frac)
+{
+   unsigned int j;
+   spx_word32_t sum;
+   spx_word32_t accum[4] = {0,0,0,0};
+
+   for(j=0;j<len;j++) {
+     const spx_word16_t curr_in=a[j];
+     accum[0] += MULT16_16(curr_in,b[j*oversample]);
+     accum[1] += MULT16_16(curr_in,b[j*oversample+1]);
+     accum[2] += MULT16_16(curr_in,b[j*oversample+2]);
+     accum[3] += MULT16_16(curr_in,b[j*oversample+3]);
+   }
+
+   sum = MULT16_32_Q15(frac[0],accum[0]) + MULT16_32_Q15(frac[1],accum[1]) + MULT16_32_Q15(frac[2],accum[2]) + MULT16_32_Q15(frac[3],accum[3]);
+   return SATURATE32PSHR(sum, 15, 32767);
+}
+#endif
+
+#ifndef FIXED_POINT
+#ifndef OVERRIDE_INNER_PRODUCT_DOUBLE
+static inline double inner_product_double(const spx_word16_t *a, const spx_word16_t *b, unsigned int len)
+{
+   unsigned int j;
+   double accum[4] = {0,0,0,0};
+
+   for(j=0;j<len;j+=4) {
+     accum[0] += a[j]*b[j];
+     accum[1] += a[j+1]*b[j+1];
+     accum[2] += a[j+2]*b[j+2];
+     accum[3] += a[j+3]*b[j+3];
+   }
+   return accum[0] + accum[1] + accum[2] + accum[3];
+}
+#endif
+
+#ifndef OVERRIDE_INTERPOLATE_PRODUCT_DOUBLE
+static inline double interpolate_product_double(const spx_word16_t *a, const spx_word16_t *b, unsigned int len, const spx_uint32_t oversample, spx_word16_t *frac)
+{
+   unsigned int j;
+   double accum[4] = {0,0,0,0};
+
+   for(j=0;j<len;j++) {
+     const double curr_in=a[j];
+     accum[0] += MULT16_16(curr_in,b[j*oversample]);
+     accum[1] += MULT16_16(curr_in,b[j*oversample+1]);
+     accum[2] += MULT16_16(curr_in,b[j*oversample+2]);
+     accum[3] += MULT16_16(curr_in,b[j*oversample+3]);
+   }
+
+   return MULT16_32_Q15(frac[0],accum[0]) + MULT16_32_Q15(frac[1],accum[1]) + MULT16_32_Q15(frac[2],accum[2]) + MULT16_32_Q15(frac[3],accum[3]);
+}
+#endif
+#endif
+
+/* The interleaved kernels compute one output frame of a channel-interleaved
+   stream: out[c] is the product of the len taps in a with the samples
+   b[j*channels+c]. The taps are shared by all channels of the frame. */
+#ifndef OVERRIDE_INTERLEAVED_PRODUCT_SINGLE
+static inline void interleaved_product_single(const spx_word16_t *a, const spx_word16_t *b, unsigned int len, unsigned int channels, spx_word16_t *out)
+{
+   unsigned int c, j;
+   for (c=0;c+4<=channels;c+=4)
+   {
+      spx_word32_t accum[4] = {0,0,0,0};
+      for(j=0;j<len;j++) {
+        const spx_word16_t *x = b+j*channels+c;
+        accum[0] += MULT16_16(a[j], x[0]);
+        accum[1] += MULT16_16(a[j], x[1]);
+        accum[2] += MULT16_16(a[j], x[2]);
+        accum[3] += MULT16_16(a[j], x[3]);
+      }
+      out[c] = SATURATE32PSHR(accum[0], 15, 32767);
+      out[c+1] = SATURATE32PSHR(accum[1], 15, 32767);
+      out[c+2] = SATURATE32PSHR(accum[2], 15, 32767);
+      out[c+3] = SATURATE32PSHR(accum[3], 15, 32767);
+   }
+   for (;c<channels;c++)
+   {
+      spx_word32_t sum = 0;
+      for(j=0;j<len;j++)
+         sum += MULT16_16(a[j], b[j*channels+c]);
+      out[c] = SATURATE32PSHR(sum, 15, 32767);
+   }
+}
+#endif
+
+/* Interpolates the len filter taps for one output phase, so that an
+   interpolated filter can be shared by all channels of a frame */
+static inline void interpolate_taps(const spx_word16_t *b, unsigned int len, const spx_uint32_t oversample, const spx_word16_t *frac, spx_word16_t *taps)
+{
+   unsigned int j;
+   for(j=0;j<len;j++) {
+     const spx_word16_t *t = b+j*oversample;
+     spx_word32_t sum = MULT16_16(frac[0],t[0]) + MULT16_16(frac[1],t[1]) + MULT16_16(frac[2],t[2]) + MULT16_16(frac[3],t[3]);
+     taps[j] = SATURATE32PSHR(sum, 15, 32767);
+   }
+}
+
+/* Conversions between the native samples and the formats of
+   speex_resampler_process_format(). All formats have the same full scale as
+   the int API: 1<<15 for S16, 1<<23 for S24, 1<<31 for S32 and 32768.f for
+   FLOAT and F64. Input is converted as it is copied into the filter memory,
+   and output as the resamplers store it. */
+static size_t format_size(int format)
+{
+   switch (format)
+   {
+      case SPEEX_RESAMPLER_FORMAT_S16:
+         return sizeof(spx_int16_t);
+      case SPEEX_RESAMPLER_FORMAT_S24:
+         return 3;
+      case SPEEX_RESAMPLER_FORMAT_S32:
+         return sizeof(spx_int32_t);
+      case SPEEX_RESAMPLER_FORMAT_FLOAT:
+         return sizeof(float);
+      case SPEEX_RESAMPLER_FORMAT_F64:
+         return sizeof(double);
+      default:
+         return 0;
+   }
+}
+
+#define FORMAT_ADVANCE(ptr, format, n) ((char *)(ptr) + (size_t)(n)*format_size(format))
+
+/* Packed 24-bit samples are little-endian */
+static inline spx_int32_t load_s24(const unsigned char *p)
+{
+   return (spx_int32_t)((spx_uint32_t)p[0] | ((spx_uint32_t)p[1] << 8) | ((spx_uint32_t)p[2] << 16) | ((p[2] & 0x80) ? 0xff000000 : 0));
+}
+
+static inline void store_s24(unsigned char *p, spx_int32_t x)
+{
+   p[0] = x & 0xff;
+   p[1] = (x >> 8) & 0xff;
+   p[2] = (x >> 16) & 0xff;
+}
+
+#ifdef FIXED_POINT
+/* Rounds x>>shift to 16 bits, saturating. The rounding can't overflow. */
+static inline spx_word16_t int_to_word(spx_int32_t x, int shift)
+{
+   x = (x >> shift) + ((x >> (shift-1)) & 1);
+   return x > 32767 ? 32767 : x;
+}
+#else
+static inline spx_int32_t float_to_int(float x, double scale, double max)
+{
+   double y = floor(.5 + scale*x);
+   return y > max ? (spx_int32_t)max : (y < -max-1. ? (spx_int32_t)(-max-1.) : (spx_int32_t)y);
+}
+#endif
+
+/* Converts n samples from in (every stride-th one) into the native x */
+static void load_samples(spx_word16_t *x, const void *in, int format, int stride, spx_uint32_t n)
+{
+   spx_uint32_t j;
+   switch (format)
+   {
+      case SPEEX_RESAMPLER_FORMAT_S16:
+         for (j=0;j<n;j++)
+            x[j] = ((const spx_int16_t *)in)[j*stride];
+         break;
+      case SPEEX_RESAMPLER_FORMAT_S24:
+         for (j=0;j<n;j++)
+#ifdef FIXED_POINT
+            x[j] = int_to_word(load_s24((const unsigned char *)in + 3*j*stride), 8);
+#else
+            x[j] = load_s24((const unsigned char *)in + 3*j*stride) * (1.f/256);
+#endif
+         break;
+      case SPEEX_RESAMPLER_FORMAT_S32:
+         for (j=0;j<n;j++)
+#ifdef FIXED_POINT
+            x[j] = int_to_word(((const spx_int32_t *)in)[j*stride], 16);
+#else
+            x[j] = ((const spx_int32_t *)in)[j*stride] * (1.f/65536);
+#endif
+         break;
+      case SPEEX_RESAMPLER_FORMAT_FLOAT:
+         for (j=0;j<n;j++)
+#ifdef FIXED_POINT
+            x[j] = WORD2INT(((const float *)in)[j*stride]);
+#else
+            x[j] = ((const float *)in)[j*stride];
+#endif
+         break;
+      case SPEEX_RESAMPLER_FORMAT_F64:
+         for (j=0;j<n;j++)
+#ifdef FIXED_POINT
+            x[j] = WORD2INT(((const double *)in)[j*stride]);
+#else
+            x[j] = ((const double *)in)[j*stride];
+#endif
+         break;
+   }
+}
+
+/* Stores the native output sample x as out[i] */
+static inline void store_sample(void *out, int format, spx_uint32_t i, spx_word32_t x)
+{
+   /* Keep the native case a single predictable branch in the hot loops */
+   if (format == NATIVE_FORMAT)
+   {
+      ((spx_word16_t *)out)[i] = x;
+      return;
+   }
+   switch (format)
+   {
+#ifdef FIXED_POINT
+      case SPEEX_RESAMPLER_FORMAT_S16:
+         ((spx_int16_t *)out)[i] = x;
+         break;
+      case SPEEX_RESAMPLER_FORMAT_S24:
+         store_s24((unsigned char *)out + 3*i, x*256);
+         break;
+      case SPEEX_RESAMPLER_FORMAT_S32:
+         ((spx_int32_t *)out)[i] = x*65536;
+         break;
+#else
+      case SPEEX_RESAMPLER_FORMAT_S16:
+         ((spx_int16_t *)out)[i] = WORD2INT(x);
+         break;
+      case SPEEX_RESAMPLER_FORMAT_S24:
+         store_s24((unsigned char *)out + 3*i, float_to_int(x, 256., 8388607.));
+         break;
+      case SPEEX_RESAMPLER_FORMAT_S32:
+         ((spx_int32_t *)out)[i] = float_to_int(x, 65536., 2147483647.);
+         break;
+#endif
+      case SPEEX_RESAMPLER_FORMAT_FLOAT:
+         ((float *)out)[i] = x;
+         break;
+      case SPEEX_RESAMPLER_FORMAT_F64:
+         ((double *)out)[i] = x;
+         break;
+   }
+}
+
+/* The resampler loops below are written once and take the inner product
+   kernel as an argument. Each resampler_ptr candidate is a thin wrapper that
+   passes a constant kernel, so the compiler inlines both the loop and the
+   kernel (with the wrapper's target ISA). The wrappers also pass the native
+   output format as a constant, so that case keeps a plain store. */
+typedef spx_word32_t (*inner_product_single_func)(const spx_word16_t *, const spx_word16_t *, unsigned int);
+typedef spx_word32_t (*interpolate_product_single_func)(const spx_word16_t *, const spx_word16_t *, unsigned int, const spx_uint32_t, spx_word16_t *);
+#ifndef FIXED_POINT
+typedef double (*inner_product_double_func)(const spx_word16_t *, const spx_word16_t *, unsigned int);
+typedef double (*interpolate_product_double_func)(const spx_word16_t *, const spx_word16_t *, unsigned int, const spx_uint32_t, spx_word16_t *);
+#endif
+typedef void (*interleaved_product_single_func)(const spx_word16_t *, const spx_word16_t *, unsigned int, unsigned int, spx_word16_t *);
+
+/* The filter length and the phase stepping are arguments as well, so that
+   the specialised resamplers below can make them constants */
+static inline int resampler_direct_single_loop(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len, inner_product_single_func product, const int out_format, const int N, const int int_advance, const int frac_advance, const spx_uint32_t den_rate)
 {
-   const int N = st->filt_len;
    int out_sample = 0;
    int last_sample = st->last_sample[channel_index];
    spx_uint32_t samp_frac_num = st->samp_frac_num[channel_index];
    const spx_word16_t *sinc_table = st->sinc_table;
    const int out_stride = st->out_stride;
-   const int int_advance = st->int_advance;
-   const int frac_advance = st->frac_advance;
-   const spx_uint32_t den_rate = st->den_rate;
    spx_word32_t sum;
 
    while (!(last_sample >= (spx_int32_t)*in_len || out_sample >= (spx_int32_t)*out_len))
@@ -346,29 +714,9 @@ static int resampler_basic_direct_single(SpeexResamplerState *st, spx_uint32_t c
       const spx_word16_t *sinct = & sinc_table[samp_frac_num*N];
       const spx_word16_t *iptr = & in[last_sample];
 
-#ifndef OVERRIDE_INNER_PRODUCT_SINGLE
-      int j;
-      sum = 0;
-      for(j=0;j<N;j++) sum += MULT16_16(sinct[j], iptr[j]);
-
-/*    This code is slower on most DSPs which have only 2 accumulators.
-      Plus this this forces truncation to 32 bits and you lose the HW guard bits.
-      I think we can trust the compiler and let it vectorize and/or unroll itself.
-      spx_word32_t accum[4] = {0,0,0,0};
-      for(j=0;j<N;j+=4) {
-        accum[0] += MULT16_16(sinct[j], iptr[j]);
-        accum[1] += MULT16_16(sinct[j+1], iptr[j+1]);
-        accum[2] += MULT16_16(sinct[j+2], iptr[j+2]);
-        accum[3] += MULT16_16(sinct[j+3], iptr[j+3]);
-      }
-      sum = accum[0] + accum[1] + accum[2] + accum[3];
-*/
-      sum = SATURATE32PSHR(sum, 15, 32767);
-#else
-      sum = inner_product_single(sinct, iptr, N);
-#endif
+      sum = product(sinct, iptr, N);
 
-      out[out_stride * out_sample++] = sum;
+      store_sample(out, out_format, out_stride * out_sample++, sum);
       last_sample += int_advance;
       samp_frac_num += frac_advance;
       if (samp_frac_num >= den_rate)
@@ -386,7 +734,7 @@ static int resampler_basic_direct_single(SpeexResamplerState *st, spx_uint32_t c
 #ifdef FIXED_POINT
 #else
 /* This is the same as the previous function, except with a double-precision accumulator */
-static int resampler_basic_direct_double(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, spx_word16_t *out, spx_uint32_t *out_len)
+static inline int resampler_direct_double_loop(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len, inner_product_double_func product, const int out_format)
 {
    const int N = st->filt_len;
    int out_sample = 0;
@@ -404,22 +752,9 @@ static int resampler_basic_direct_double(SpeexResamplerState *st, spx_uint32_t c
       const spx_word16_t *sinct = & sinc_table[samp_frac_num*N];
       const spx_word16_t *iptr = & in[last_sample];
 
-#ifndef OVERRIDE_INNER_PRODUCT_DOUBLE
-      int j;
-      double accum[4] = {0,0,0,0};
-
-      for(j=0;j<N;j+=4) {
-        accum[0] += sinct[j]*iptr[j];
-        accum[1] += sinct[j+1]*iptr[j+1];
-        accum[2] += sinct[j+2]*iptr[j+2];
-        accum[3] += sinct[j+3]*iptr[j+3];
-      }
-      sum = accum[0] + accum[1] + accum[2] + accum[3];
-#else
-      sum = inner_product_double(sinct, iptr, N);
-#endif
+      sum = product(sinct, iptr, N);
 
-      out[out_stride * out_sample++] = PSHR32(sum, 15);
+      store_sample(out, out_format, out_stride * out_sample++, PSHR32(sum, 15));
       last_sample += int_advance;
       samp_frac_num += frac_advance;
       if (samp_frac_num >= den_rate)
@@ -435,52 +770,32 @@ static int resampler_basic_direct_double(SpeexResamplerState *st, spx_uint32_t c
 }
 #endif
 
-static int resampler_basic_interpolate_single(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, spx_word16_t *out, spx_uint32_t *out_len)
+/* Like resampler_direct_single_loop(), the oversampling of the table is an
+   argument too */
+static inline int resampler_interpolate_single_loop(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len, interpolate_product_single_func product, const int out_format, const int N, const spx_uint32_t oversample, const int int_advance, const int frac_advance, const spx_uint32_t den_rate)
 {
-   const int N = st->filt_len;
    int out_sample = 0;
    int last_sample = st->last_sample[channel_index];
    spx_uint32_t samp_frac_num = st->samp_frac_num[channel_index];
    const int out_stride = st->out_stride;
-   const int int_advance = st->int_advance;
-   const int frac_advance = st->frac_advance;
-   const spx_uint32_t den_rate = st->den_rate;
    spx_word32_t sum;
 
    while (!(last_sample >= (spx_int32_t)*in_len || out_sample >= (spx_int32_t)*out_len))
    {
       const spx_word16_t *iptr = & in[last_sample];
 
-      const int offset = samp_frac_num*st->oversample/st->den_rate;
+      const int offset = samp_frac_num*oversample/den_rate;
 #ifdef FIXED_POINT
-      const spx_word16_t frac = PDIV32(SHL32((samp_frac_num*st->oversample) % st->den_rate,15),st->den_rate);
+      const spx_word16_t frac = PDIV32(SHL32((samp_frac_num*oversample) % den_rate,15),den_rate);
 #else
-      const spx_word16_t frac = ((float)((samp_frac_num*st->oversample) % st->den_rate))/st->den_rate;
+      const spx_word16_t frac = ((float)((samp_frac_num*oversample) % den_rate))/den_rate;
 #endif
       spx_word16_t interp[4];
 
-
-#ifndef OVERRIDE_INTERPOLATE_PRODUCT_SINGLE
-      int j;
-      spx_word32_t accum[4] = {0,0,0,0};
-
-      for(j=0;j<N;j++) {
-        const spx_word16_t curr_in=iptr[j];
-        accum[0] += MULT16_16(curr_in,st->sinc_table[4+(j+1)*st->oversample-offset-2]);
-        accum[1] += MULT16_16(curr_in,st->sinc_table[4+(j+1)*st->oversample-offset-1]);
-        accum[2] += MULT16_16(curr_in,st->sinc_table[4+(j+1)*st->oversample-offset]);
-        accum[3] += MULT16_16(curr_in,st->sinc_table[4+(j+1)*st->oversample-offset+1]);
-      }
-
-      cubic_coef(frac, interp);
-      sum = MULT16_32_Q15(interp[0],accum[0]) + MULT16_32_Q15(interp[1],accum[1]) + MULT16_32_Q15(interp[2],accum[2]) + MULT16_32_Q15(interp[3],accum[3]);
-      sum = SATURATE32PSHR(sum, 15, 32767);
-#else
       cubic_coef(frac, interp);
-      sum = interpolate_product_single(iptr, st->sinc_table + st->oversample + 4 - offset - 2, N, st->oversample, interp);
-#endif
+      sum = product(iptr, st->sinc_table + oversample + 4 - offset - 2, N, oversample, interp);
 
-      out[out_stride * out_sample++] = sum;
+      store_sample(out, out_format, out_stride * out_sample++, sum);
       last_sample += int_advance;
       samp_frac_num += frac_advance;
       if (samp_frac_num >= den_rate)
@@ -498,7 +813,7 @@ static int resampler_basic_interpolate_single(SpeexResamplerState *st, spx_uint3
 #ifdef FIXED_POINT
 #else
 /* This is the same as the previous function, except with a double-precision accumulator */
-static int resampler_basic_interpolate_double(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, spx_word16_t *out, spx_uint32_t *out_len)
+static inline int resampler_interpolate_double_loop(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len, interpolate_product_double_func product, const int out_format)
 {
    const int N = st->filt_len;
    int out_sample = 0;
@@ -515,34 +830,13 @@ static int resampler_basic_interpolate_double(SpeexResamplerState *st, spx_uint3
       const spx_word16_t *iptr = & in[last_sample];
 
       const int offset = samp_frac_num*st->oversample/st->den_rate;
-#ifdef FIXED_POINT
-      const spx_word16_t frac = PDIV32(SHL32((samp_frac_num*st->oversample) % st->den_rate,15),st->den_rate);
-#else
       const spx_word16_t frac = ((float)((samp_frac_num*st->oversample) % st->den_rate))/st->den_rate;
-#endif
       spx_word16_t interp[4];
 
-
-#ifndef OVERRIDE_INTERPOLATE_PRODUCT_DOUBLE
-      int j;
-      double accum[4] = {0,0,0,0};
-
-      for(j=0;j<N;j++) {
-        const double curr_in=iptr[j];
-        accum[0] += MULT16_16(curr_in,st->sinc_table[4+(j+1)*st->oversample-offset-2]);
-        accum[1] += MULT16_16(curr_in,st->sinc_table[4+(j+1)*st->oversample-offset-1]);
-        accum[2] += MULT16_16(curr_in,st->sinc_table[4+(j+1)*st->oversample-offset]);
-        accum[3] += MULT16_16(curr_in,st->sinc_table[4+(j+1)*st->oversample-offset+1]);
-      }
-
       cubic_coef(frac, interp);
-      sum = MULT16_32_Q15(interp[0],accum[0]) + MULT16_32_Q15(interp[1],accum[1]) + MULT16_32_Q15(interp[2],accum[2]) + MULT16_32_Q15(interp[3],accum[3]);
-#else
-      cubic_coef(frac, interp);
-      sum = interpolate_product_double(iptr, st->sinc_table + st->oversample + 4 - offset - 2, N, st->oversample, interp);
-#endif
+      sum = product(iptr, st->sinc_table + st->oversample + 4 - offset - 2, N, st->oversample, interp);
 
-      out[out_stride * out_sample++] = PSHR32(sum,15);
+      store_sample(out, out_format, out_stride * out_sample++, PSHR32(sum,15));
       last_sample += int_advance;
       samp_frac_num += frac_advance;
       if (samp_frac_num >= den_rate)
@@ -558,31 +852,43 @@ static int resampler_basic_interpolate_double(SpeexResamplerState *st, spx_uint3
 }
 #endif
 
-/* This resampler is used to produce zero output in situations where memory
-   for the filter could not be allocated.  The expected numbers of input and
-   output samples are still processed so that callers failing to check error
-   codes are not surprised, possibly getting into infinite loops. */
-static int resampler_basic_zero(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, spx_word16_t *out, spx_uint32_t *out_len)
+/* Same as the interpolating resampler, except that the position is kept as a
+   32-bit fraction of an input sample. The step can then be changed at any
+   time without touching the filter. */
+static inline int resampler_asrc_single_loop(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len, interpolate_product_single_func product, const int out_format)
 {
+   const int N = st->filt_len;
    int out_sample = 0;
    int last_sample = st->last_sample[channel_index];
    spx_uint32_t samp_frac_num = st->samp_frac_num[channel_index];
    const int out_stride = st->out_stride;
    const int int_advance = st->int_advance;
-   const int frac_advance = st->frac_advance;
-   const spx_uint32_t den_rate = st->den_rate;
+   const spx_uint32_t step_frac = st->step_frac;
+   const spx_uint32_t oversample = st->oversample;
+   spx_word32_t sum;
 
-   (void)in;
    while (!(last_sample >= (spx_int32_t)*in_len || out_sample >= (spx_int32_t)*out_len))
    {
-      out[out_stride * out_sample++] = 0;
+      const spx_word16_t *iptr = & in[last_sample];
+
+      /* Position in the table: the integer part of samp_frac_num*oversample/2^32
+         and, from the wrapped product, the fractional part */
+      const int offset = ((samp_frac_num >> 16) * oversample + (((samp_frac_num & 0xffff) * oversample) >> 16)) >> 16;
+#ifdef FIXED_POINT
+      const spx_word16_t frac = (samp_frac_num * oversample) >> 17;
+#else
+      const spx_word16_t frac = (samp_frac_num * oversample) * (1.f/4294967296.f);
+#endif
+      spx_word16_t interp[4];
+
+      cubic_coef(frac, interp);
+      sum = product(iptr, st->sinc_table + oversample + 4 - offset - 2, N, oversample, interp);
+
+      store_sample(out, out_format, out_stride * out_sample++, sum);
       last_sample += int_advance;
-      samp_frac_num += frac_advance;
-      if (samp_frac_num >= den_rate)
-      {
-         samp_frac_num -= den_rate;
+      samp_frac_num += step_frac;
+      if (samp_frac_num < step_frac)
          last_sample++;
-      }
    }
 
    st->last_sample[channel_index] = last_sample;
@@ -590,40 +896,979 @@ static int resampler_basic_zero(SpeexResamplerState *st, spx_uint32_t channel_in
    return out_sample;
 }
 
-static int multiply_frac(spx_uint32_t *result, spx_uint32_t value, spx_uint32_t num, spx_uint32_t den)
+#ifdef FIXED_POINT
+#else
+/* This is the same as the previous function, except with a double-precision accumulator */
+static inline int resampler_asrc_double_loop(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len, interpolate_product_double_func product, const int out_format)
 {
-   spx_uint32_t major = value / den;
-   spx_uint32_t remain = value % den;
-   /* TODO: Could use 64 bits operation to check for overflow. But only guaranteed in C99+ */
-   if (remain > UINT32_MAX / num || major > UINT32_MAX / num
-       || major * num > UINT32_MAX - remain * num / den)
-      return RESAMPLER_ERR_OVERFLOW;
-   *result = remain * num / den + major * num;
-   return RESAMPLER_ERR_SUCCESS;
+   const int N = st->filt_len;
+   int out_sample = 0;
+   int last_sample = st->last_sample[channel_index];
+   spx_uint32_t samp_frac_num = st->samp_frac_num[channel_index];
+   const int out_stride = st->out_stride;
+   const int int_advance = st->int_advance;
+   const spx_uint32_t step_frac = st->step_frac;
+   const spx_uint32_t oversample = st->oversample;
+   spx_word32_t sum;
+
+   while (!(last_sample >= (spx_int32_t)*in_len || out_sample >= (spx_int32_t)*out_len))
+   {
+      const spx_word16_t *iptr = & in[last_sample];
+
+      const int offset = ((samp_frac_num >> 16) * oversample + (((samp_frac_num & 0xffff) * oversample) >> 16)) >> 16;
+      const spx_word16_t frac = (samp_frac_num * oversample) * (1.f/4294967296.f);
+      spx_word16_t interp[4];
+
+      cubic_coef(frac, interp);
+      sum = product(iptr, st->sinc_table + oversample + 4 - offset - 2, N, oversample, interp);
+
+      store_sample(out, out_format, out_stride * out_sample++, PSHR32(sum,15));
+      last_sample += int_advance;
+      samp_frac_num += step_frac;
+      if (samp_frac_num < step_frac)
+         last_sample++;
+   }
+
+   st->last_sample[channel_index] = last_sample;
+   st->samp_frac_num[channel_index] = samp_frac_num;
+   return out_sample;
 }
+#endif
 
-static int update_filter(SpeexResamplerState *st)
+static int resampler_basic_direct_single(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
 {
-   spx_uint32_t old_length = st->filt_len;
-   spx_uint32_t old_alloc_size = st->mem_alloc_size;
-   int use_direct;
-   spx_uint32_t min_sinc_table_length;
-   spx_uint32_t min_alloc_size;
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_single, NATIVE_FORMAT, st->filt_len, st->int_advance, st->frac_advance, st->den_rate);
+   return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_single, st->out_format, st->filt_len, st->int_advance, st->frac_advance, st->den_rate);
+}
 
-   st->int_advance = st->num_rate/st->den_rate;
-   st->frac_advance = st->num_rate%st->den_rate;
-   st->oversample = quality_map[st->quality].oversample;
-   st->filt_len = quality_map[st->quality].base_length;
+static int resampler_basic_interpolate_single(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_interpolate_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single, NATIVE_FORMAT, st->filt_len, st->oversample, st->int_advance, st->frac_advance, st->den_rate);
+   return resampler_interpolate_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single, st->out_format, st->filt_len, st->oversample, st->int_advance, st->frac_advance, st->den_rate);
+}
 
-   if (st->num_rate > st->den_rate)
-   {
-      /* down-sampling */
-      st->cutoff = quality_map[st->quality].downsample_bandwidth * st->den_rate / st->num_rate;
-      if (multiply_frac(&st->filt_len,st->filt_len,st->num_rate,st->den_rate) != RESAMPLER_ERR_SUCCESS)
-         goto fail;
-      /* Round up to make sure we have a multiple of 8 for SSE */
-      st->filt_len = ((st->filt_len-1)&(~0x7))+8;
-      if (2*st->den_rate < st->num_rate)
+static int resampler_basic_asrc_single(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_asrc_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single, NATIVE_FORMAT);
+   return resampler_asrc_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single, st->out_format);
+}
+
+#ifndef FIXED_POINT
+/* The higher qualities accumulate in double precision, except with a direct
+   table when there is a compensated kernel, which is faster there */
+#ifdef OVERRIDE_COMPENSATED_PRODUCTS
+static int resampler_basic_direct_compensated(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_compensated, NATIVE_FORMAT, st->filt_len, st->int_advance, st->frac_advance, st->den_rate);
+   return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_compensated, st->out_format, st->filt_len, st->int_advance, st->frac_advance, st->den_rate);
+}
+#else
+static int resampler_basic_direct_double(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_direct_double_loop(st, channel_index, in, in_len, out, out_len, inner_product_double, NATIVE_FORMAT);
+   return resampler_direct_double_loop(st, channel_index, in, in_len, out, out_len, inner_product_double, st->out_format);
+}
+#endif
+
+static int resampler_basic_interpolate_double(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_interpolate_double_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_double, NATIVE_FORMAT);
+   return resampler_interpolate_double_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_double, st->out_format);
+}
+
+static int resampler_basic_asrc_double(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_asrc_double_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_double, NATIVE_FORMAT);
+   return resampler_asrc_double_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_double, st->out_format);
+}
+#endif
+
+#ifdef USE_AVX2
+/* Same resamplers, built for AVX2/FMA. These are only selected by
+   update_filter() when the CPU reports support for them. */
+AVX2_TARGET static int resampler_basic_direct_single_avx2(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_single_avx2, NATIVE_FORMAT, st->filt_len, st->int_advance, st->frac_advance, st->den_rate);
+   return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_single_avx2, st->out_format, st->filt_len, st->int_advance, st->frac_advance, st->den_rate);
+}
+
+AVX2_TARGET static int resampler_basic_interpolate_single_avx2(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_interpolate_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single_avx2, NATIVE_FORMAT, st->filt_len, st->oversample, st->int_advance, st->frac_advance, st->den_rate);
+   return resampler_interpolate_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single_avx2, st->out_format, st->filt_len, st->oversample, st->int_advance, st->frac_advance, st->den_rate);
+}
+
+AVX2_TARGET static int resampler_basic_asrc_single_avx2(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_asrc_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single_avx2, NATIVE_FORMAT);
+   return resampler_asrc_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single_avx2, st->out_format);
+}
+
+#ifndef FIXED_POINT
+AVX2_TARGET static int resampler_basic_direct_compensated_avx2(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_compensated_avx2, NATIVE_FORMAT, st->filt_len, st->int_advance, st->frac_advance, st->den_rate);
+   return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_compensated_avx2, st->out_format, st->filt_len, st->int_advance, st->frac_advance, st->den_rate);
+}
+
+AVX2_TARGET static int resampler_basic_interpolate_double_avx2(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_interpolate_double_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_double_avx2, NATIVE_FORMAT);
+   return resampler_interpolate_double_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_double_avx2, st->out_format);
+}
+
+AVX2_TARGET static int resampler_basic_asrc_double_avx2(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   if (st->out_format == NATIVE_FORMAT)
+      return resampler_asrc_double_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_double_avx2, NATIVE_FORMAT);
+   return resampler_asrc_double_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_double_avx2, st->out_format);
+}
+#endif
+#endif
+
+/* Resamplers specialised for the usual telephony and media ratios at
+   qualities 3 to 5 (num/den being the reduced ratio and N the filter length
+   update_filter() picks for them). With all of these known at compile time,
+   the inner product is fully unrolled and the phase stepping folds into
+   constants. Other output formats use the generic loop. The integer ratios
+   get a direct table. 44.1k <-> 48k keeps the interpolated one (os being its
+   oversampling), as a direct one would have 160 phases and take several
+   times longer to build at init, and there the divisions by den that find
+   the phase become multiplications. */
+#define DIRECT_SPECIALIZATIONS(X) \
+   X(  1,   2,  48) X(  1,   2,  64) X(  1,   2,  80) /*  8k -> 16k  */ \
+   X(  2,   1,  96) X(  2,   1, 128) X(  2,   1, 160) /* 16k ->  8k  */ \
+   X(  1,   3,  48) X(  1,   3,  64) X(  1,   3,  80) /* 16k -> 48k  */ \
+   X(  3,   1, 144) X(  3,   1, 192) X(  3,   1, 240) /* 48k -> 16k  */
+#define INTERPOLATE_SPECIALIZATIONS(X) \
+   X(147, 160,  48,  8) X(147, 160,  64,  8) X(147, 160,  80, 16) /* 44.1k -> 48k */ \
+   X(160, 147,  56,  8) X(160, 147,  72,  8) X(160, 147,  88, 16) /* 48k -> 44.1k */
+
+struct ResamplerSpecialization {
+   spx_uint32_t num_rate;
+   spx_uint32_t den_rate;
+   spx_uint32_t filt_len;
+   spx_uint32_t oversample; /* 0 for a direct table */
+   resampler_basic_func func;
+};
+
+#define DIRECT_SPECIALIZED(num, den, N) \
+static int resampler_direct_##num##_##den##_##N(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len) \
+{ \
+   if (st->out_format == NATIVE_FORMAT) \
+      return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_single, NATIVE_FORMAT, N, num/den, num%den, den); \
+   return resampler_basic_direct_single(st, channel_index, in, in_len, out, out_len); \
+}
+#define DIRECT_SPECIALIZATION_ENTRY(num, den, N) {num, den, N, 0, resampler_direct_##num##_##den##_##N},
+#define INTERPOLATE_SPECIALIZED(num, den, N, os) \
+static int resampler_interpolate_##num##_##den##_##N(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len) \
+{ \
+   if (st->out_format == NATIVE_FORMAT) \
+      return resampler_interpolate_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single, NATIVE_FORMAT, N, os, num/den, num%den, den); \
+   return resampler_basic_interpolate_single(st, channel_index, in, in_len, out, out_len); \
+}
+#define INTERPOLATE_SPECIALIZATION_ENTRY(num, den, N, os) {num, den, N, os, resampler_interpolate_##num##_##den##_##N},
+
+DIRECT_SPECIALIZATIONS(DIRECT_SPECIALIZED)
+INTERPOLATE_SPECIALIZATIONS(INTERPOLATE_SPECIALIZED)
+static const struct ResamplerSpecialization specializations[] = {
+   DIRECT_SPECIALIZATIONS(DIRECT_SPECIALIZATION_ENTRY)
+   INTERPOLATE_SPECIALIZATIONS(INTERPOLATE_SPECIALIZATION_ENTRY)
+};
+
+#ifdef USE_AVX2
+#define DIRECT_SPECIALIZED_AVX2(num, den, N) \
+AVX2_TARGET static int resampler_direct_##num##_##den##_##N##_avx2(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len) \
+{ \
+   if (st->out_format == NATIVE_FORMAT) \
+      return resampler_direct_single_loop(st, channel_index, in, in_len, out, out_len, inner_product_single_avx2, NATIVE_FORMAT, N, num/den, num%den, den); \
+   return resampler_basic_direct_single_avx2(st, channel_index, in, in_len, out, out_len); \
+}
+#define DIRECT_SPECIALIZATION_ENTRY_AVX2(num, den, N) {num, den, N, 0, resampler_direct_##num##_##den##_##N##_avx2},
+#define INTERPOLATE_SPECIALIZED_AVX2(num, den, N, os) \
+AVX2_TARGET static int resampler_interpolate_##num##_##den##_##N##_avx2(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len) \
+{ \
+   if (st->out_format == NATIVE_FORMAT) \
+      return resampler_interpolate_single_loop(st, channel_index, in, in_len, out, out_len, interpolate_product_single_avx2, NATIVE_FORMAT, N, os, num/den, num%den, den); \
+   return resampler_basic_interpolate_single_avx2(st, channel_index, in, in_len, out, out_len); \
+}
+#define INTERPOLATE_SPECIALIZATION_ENTRY_AVX2(num, den, N, os) {num, den, N, os, resampler_interpolate_##num##_##den##_##N##_avx2},
+
+DIRECT_SPECIALIZATIONS(DIRECT_SPECIALIZED_AVX2)
+INTERPOLATE_SPECIALIZATIONS(INTERPOLATE_SPECIALIZED_AVX2)
+static const struct ResamplerSpecialization specializations_avx2[] = {
+   DIRECT_SPECIALIZATIONS(DIRECT_SPECIALIZATION_ENTRY_AVX2)
+   INTERPOLATE_SPECIALIZATIONS(INTERPOLATE_SPECIALIZATION_ENTRY_AVX2)
+};
+#endif
+
+/* Specialised resampler for the current ratio, filter length and table of
+   st, or NULL if there is none */
+static resampler_basic_func resampler_specialization(const SpeexResamplerState *st, int use_direct)
+{
+   const struct ResamplerSpecialization *list = specializations;
+   const spx_uint32_t oversample = use_direct ? 0 : st->oversample;
+   unsigned int i;
+#ifndef FIXED_POINT
+   /* These use the compensated or double-precision kernels */
+   if (st->quality>8)
+      return NULL;
+#endif
+#ifdef USE_AVX2
+   if (st->use_avx2)
+      list = specializations_avx2;
+#endif
+   for (i=0;i<sizeof(specializations)/sizeof(specializations[0]);i++)
+      if (list[i].num_rate == st->num_rate && list[i].den_rate == st->den_rate && list[i].filt_len == st->filt_len && list[i].oversample == oversample)
+         return list[i].func;
+   return NULL;
+}
+
+/* Resamples all channels of a channel-interleaved buffer at once. Every
+   channel must be at the same position (last_sample and samp_frac_num),
+   which is what the interleaved process functions maintain. */
+static inline int resampler_interleaved_loop(SpeexResamplerState *st, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len, interleaved_product_single_func product)
+{
+   const int N = st->filt_len;
+   const spx_uint32_t channels = st->nb_channels;
+   int out_sample = 0;
+   int last_sample = st->last_sample[0];
+   spx_uint32_t samp_frac_num = st->samp_frac_num[0];
+   const spx_word16_t *sinc_table = st->sinc_table;
+   spx_word16_t *taps = st->ihist + channels*st->mem_alloc_size;
+   spx_word16_t *frame = taps + N;
+   const int out_format = st->out_format;
+   const int int_advance = st->int_advance;
+   const int frac_advance = st->frac_advance;
+   const spx_uint32_t den_rate = st->den_rate;
+   spx_uint32_t i;
+
+   while (!(last_sample >= (spx_int32_t)*in_len || out_sample >= (spx_int32_t)*out_len))
+   {
+      const spx_word16_t *sinct;
+
+      if (st->use_direct)
+      {
+         sinct = & sinc_table[samp_frac_num*N];
+      } else {
+         const int offset = samp_frac_num*st->oversample/st->den_rate;
+#ifdef FIXED_POINT
+         const spx_word16_t frac = PDIV32(SHL32((samp_frac_num*st->oversample) % st->den_rate,15),st->den_rate);
+#else
+         const spx_word16_t frac = ((float)((samp_frac_num*st->oversample) % st->den_rate))/st->den_rate;
+#endif
+         spx_word16_t interp[4];
+
+         cubic_coef(frac, interp);
+         interpolate_taps(sinc_table + st->oversample + 4 - offset - 2, N, st->oversample, interp, taps);
+         sinct = taps;
+      }
+
+      /* Other formats go through one native frame */
+      if (out_format == NATIVE_FORMAT)
+      {
+         product(sinct, & in[last_sample*channels], N, channels, (spx_word16_t *)out + out_sample*channels);
+      } else {
+         product(sinct, & in[last_sample*channels], N, channels, frame);
+         for (i=0;i<channels;i++)
+            store_sample(out, out_format, out_sample*channels+i, frame[i]);
+      }
+      out_sample++;
+      last_sample += int_advance;
+      samp_frac_num += frac_advance;
+      if (samp_frac_num >= den_rate)
+      {
+         samp_frac_num -= den_rate;
+         last_sample++;
+      }
+   }
+
+   for (i=0;i<channels;i++)
+   {
+      st->last_sample[i] = last_sample;
+      st->samp_frac_num[i] = samp_frac_num;
+   }
+   return out_sample;
+}
+
+static int resampler_basic_interleaved(SpeexResamplerState *st, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   return resampler_interleaved_loop(st, in, in_len, out, out_len, interleaved_product_single);
+}
+
+#ifdef USE_AVX2
+AVX2_TARGET static int resampler_basic_interleaved_avx2(SpeexResamplerState *st, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   return resampler_interleaved_loop(st, in, in_len, out, out_len, interleaved_product_single_avx2);
+}
+#endif
+
+/* This resampler is used to produce zero output in situations where memory
+   for the filter could not be allocated.  The expected numbers of input and
+   output samples are still processed so that callers failing to check error
+   codes are not surprised, possibly getting into infinite loops. */
+static int resampler_basic_zero(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   int out_sample = 0;
+   int last_sample = st->last_sample[channel_index];
+   spx_uint32_t samp_frac_num = st->samp_frac_num[channel_index];
+   const int out_stride = st->out_stride;
+   const int out_format = st->out_format;
+   const int int_advance = st->int_advance;
+   const int frac_advance = st->frac_advance;
+   const spx_uint32_t den_rate = st->den_rate;
+
+   (void)in;
+   while (!(last_sample >= (spx_int32_t)*in_len || out_sample >= (spx_int32_t)*out_len))
+   {
+      store_sample(out, out_format, out_stride * out_sample++, 0);
+      last_sample += int_advance;
+      samp_frac_num += frac_advance;
+      if (samp_frac_num >= den_rate)
+      {
+         samp_frac_num -= den_rate;
+         last_sample++;
+      }
+   }
+
+   st->last_sample[channel_index] = last_sample;
+   st->samp_frac_num[channel_index] = samp_frac_num;
+   return out_sample;
+}
+
+static int multiply_frac(spx_uint32_t *result, spx_uint32_t value, spx_uint32_t num, spx_uint32_t den)
+{
+   spx_uint32_t major = value / den;
+   spx_uint32_t remain = value % den;
+   /* TODO: Could use 64 bits operation to check for overflow. But only guaranteed in C99+ */
+   if (remain > UINT32_MAX / num || major > UINT32_MAX / num
+       || major * num > UINT32_MAX - remain * num / den)
+      return RESAMPLER_ERR_OVERFLOW;
+   *result = remain * num / den + major * num;
+   return RESAMPLER_ERR_SUCCESS;
+}
+
+static inline spx_uint32_t compute_gcd(spx_uint32_t a, spx_uint32_t b)
+{
+   while (b != 0)
+   {
+      spx_uint32_t temp = a;
+
+      a = b;
+      b = temp % b;
+   }
+   return a;
+}
+
+/* The filter table only depends on the quality, on the (reduced) ratio and
+   on its kind (direct or interpolated), so resamplers created with the same
+   parameters can use the same one. When thread support is available, tables
+   are kept in a process-wide cache and shared (read-only) between all the
+   states that use them. Otherwise, each state owns its table. */
+struct SincTable {
+   struct SincTable *next;
+   spx_uint32_t num_rate;
+   spx_uint32_t den_rate;
+   int quality;
+   int use_direct;
+   int phase;
+   spx_uint32_t delay;
+   int refcount;
+   spx_word16_t *table;
+};
+
+#ifdef USE_PTHREADS
+#define SINC_CACHE_SIZE 64
+static struct SincTable *sinc_cache[SINC_CACHE_SIZE];
+static pthread_mutex_t sinc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct SincTable **sinc_cache_bucket(spx_uint32_t num_rate, spx_uint32_t den_rate, int quality)
+{
+   return &sinc_cache[(num_rate*31 + den_rate*7 + quality) % SINC_CACHE_SIZE];
+}
+
+static struct SincTable *sinc_cache_find(struct SincTable *list, const SpeexResamplerState *st, int use_direct)
+{
+   for (;list;list=list->next)
+   {
+      if (list->num_rate == st->num_rate && list->den_rate == st->den_rate && list->quality == st->quality && list->use_direct == use_direct && list->phase == st->phase)
+         return list;
+   }
+   return NULL;
+}
+#endif
+
+/* In-place radix-2 FFT of n complex values (interleaved real and imaginary
+   parts), n being a power of two. w holds exp(-2*pi*i*k/n) for k < n/2, in the
+   same layout. sign is -1 for the forward transform and 1 for the inverse
+   one, which isn't scaled. Only used to design filters. */
+static void minphase_fft(double *x, const double *w, spx_uint32_t n, int sign)
+{
+   spx_uint32_t i, j, k, len;
+   for (i=1,j=0;i<n;i++)
+   {
+      spx_uint32_t bit = n>>1;
+      for (;j&bit;bit>>=1)
+         j ^= bit;
+      j ^= bit;
+      if (i < j)
+      {
+         double t;
+         t = x[2*i]; x[2*i] = x[2*j]; x[2*j] = t;
+         t = x[2*i+1]; x[2*i+1] = x[2*j+1]; x[2*j+1] = t;
+      }
+   }
+   for (len=2;len<=n;len<<=1)
+   {
+      const spx_uint32_t wstep = n/len;
+      for (i=0;i<n;i+=len)
+      {
+         double *a = x + 2*i;
+         double *b = x + 2*(i+len/2);
+         for (k=0;k<len/2;k++)
+         {
+            const double wr = w[2*k*wstep];
+            const double wi = -sign*w[2*k*wstep+1];
+            const double br = b[2*k]*wr - b[2*k+1]*wi;
+            const double bi = b[2*k]*wi + b[2*k+1]*wr;
+            b[2*k] = a[2*k] - br;
+            b[2*k+1] = a[2*k+1] - bi;
+            a[2*k] += br;
+            a[2*k+1] += bi;
+         }
+      }
+   }
+}
+
+/* Minimum-phase version of the windowed sinc of st, sampled every 1/step
+   input samples: h[k] is the response k/step samples after the input, for k
+   in [0, filt_len*step). It is derived from the linear-phase filter with the
+   real cepstrum (homomorphic method), so both have the same magnitude
+   response. Returns h (to be freed by the caller) and its group delay at DC
+   in input samples, or NULL if it could not be allocated. */
+static double *minphase_filter(const SpeexResamplerState *st, spx_uint32_t step, double *delay)
+{
+   const spx_uint32_t len = st->filt_len*step;
+   const double N = st->filt_len;
+   double *x, *w;
+   double peak = 0, floor_mag, sum = 0, moment = 0;
+   spx_uint32_t n = 1;
+   spx_uint32_t k;
+
+   /* Zero-padding keeps the aliasing of the cepstrum low. The buffer holds
+      n complex values and n/2 twiddles, with n < 16*len. */
+   if (len > INT_MAX/(48*sizeof(double)))
+      return NULL;
+   while (n < 8*len)
+      n <<= 1;
+   if (!(x = (double *)speex_alloc(3*n*sizeof(double))))
+      return NULL;
+   w = x + 2*n;
+   for (k=0;k<n/2;k++)
+   {
+      w[2*k] = cos(2*M_PI*k/n);
+      w[2*k+1] = -sin(2*M_PI*k/n);
+   }
+
+   for (k=0;k<=len;k++)
+   {
+      const double t = (double)k/step - N/2;
+      const double tt = t * st->cutoff;
+      if (fabs(t) < 1e-6)
+         x[2*k] = st->cutoff;
+      else
+         x[2*k] = st->cutoff*sin(M_PI*tt)/(M_PI*tt) * compute_func(fabs(2.*t/N), quality_map[st->quality].window_func);
+   }
+   minphase_fft(x, w, n, -1);
+
+   /* Log-magnitude, with a floor well below the stop-band for the zeros */
+   for (k=0;k<n;k++)
+   {
+      x[2*k] = sqrt(x[2*k]*x[2*k] + x[2*k+1]*x[2*k+1]);
+      if (x[2*k] > peak)
+         peak = x[2*k];
+   }
+   floor_mag = peak*1e-9;
+   for (k=0;k<n;k++)
+   {
+      x[2*k] = log(x[2*k] > floor_mag ? x[2*k] : floor_mag);
+      x[2*k+1] = 0;
+   }
+   minphase_fft(x, w, n, 1);
+
+   /* Fold the anti-causal part of the cepstrum onto the causal one */
+   x[0] /= n;
+   x[n] /= n;
+   for (k=1;k<n/2;k++)
+      x[2*k] *= 2./n;
+   for (k=0;k<n;k++)
+   {
+      if (k > n/2)
+         x[2*k] = 0;
+      x[2*k+1] = 0;
+   }
+   minphase_fft(x, w, n, -1);
+   for (k=0;k<n;k++)
+   {
+      const double m = exp(x[2*k]);
+      const double a = x[2*k+1];
+      x[2*k] = m*cos(a);
+      x[2*k+1] = m*sin(a);
+   }
+   minphase_fft(x, w, n, 1);
+
+   /* The response is moved to the start of the buffer */
+   for (k=0;k<len;k++)
+   {
+      x[k] = x[2*k]/n;
+      sum += x[k];
+      moment += k*x[k];
+   }
+   *delay = moment/sum/step;
+   return x;
+}
+
+static int sinc_table_fill(const SpeexResamplerState *st, spx_word16_t *table, int use_direct, spx_uint32_t *delay)
+{
+   if (st->phase == SPEEX_RESAMPLER_PHASE_MINIMUM)
+   {
+      /* The filter is aligned on the newest input sample instead of the
+         middle of the window, the tap of input j (out of filt_len) for a
+         position frac between samples being h(filt_len-1-j+frac) */
+      const spx_uint32_t N = st->filt_len;
+      const spx_uint32_t step = use_direct ? st->den_rate : st->oversample;
+      double *h;
+      double d;
+
+      if (!(h = minphase_filter(st, step, &d)))
+         return RESAMPLER_ERR_ALLOC_FAILED;
+      if (use_direct)
+      {
+         spx_uint32_t i, j;
+         for (i=0;i<st->den_rate;i++)
+            for (j=0;j<N;j++)
+               table[i*N+j] = SINC_WORD(h[(N-1-j)*step+i]);
+      } else {
+         spx_int32_t i;
+         for (i=0;i<(spx_int32_t)(N*step+8);i++)
+         {
+            const spx_int32_t k = N*step + 4 - i;
+            table[i] = k >= 0 && k < (spx_int32_t)(N*step) ? SINC_WORD(h[k]) : 0;
+         }
+      }
+      speex_free(h);
+      *delay = (spx_uint32_t)floor(d + .5);
+   } else if (use_direct)
+   {
+      /* Phase den_rate-i is phase i reversed, since the filter is even */
+      const spx_int32_t N = st->filt_len;
+      const spx_int32_t j0 = 1 - N/2;
+      spx_uint32_t i;
+      spx_int32_t j;
+      double *sc;
+
+      if (!(sc = sinc_phase_init(st->cutoff, j0, N)))
+         return RESAMPLER_ERR_ALLOC_FAILED;
+      for (i=0;i<=st->den_rate/2;i++)
+         sinc_phase(st->cutoff, N, quality_map[st->quality].window_func, sc, j0, -(double)i/st->den_rate, N, table+i*N, 1);
+      for (;i<st->den_rate;i++)
+         for (j=0;j<N;j++)
+            table[i*N+j] = table[(st->den_rate-i)*N+N-1-j];
+      speex_free(sc);
+      *delay = st->filt_len/2;
+   } else {
+      /* Entry i+4 is the tap at x = i/oversample - filt_len/2, for i in
+         [-4, oversample*filt_len+4). Writing i = a*oversample+b, phase b
+         holds every oversample-th entry and x = a - filt_len/2 + b/oversample.
+         Only the first half is computed, the rest is its mirror image. */
+      const spx_int32_t N = st->filt_len;
+      const spx_int32_t os = st->oversample;
+      const spx_int32_t amin = -((4+os-1)/os);
+      spx_int32_t b, i;
+      double *sc;
+
+      if (!(sc = sinc_phase_init(st->cutoff, amin - N/2, N/2 - amin + 1)))
+         return RESAMPLER_ERR_ALLOC_FAILED;
+      for (b=0;b<os;b++)
+      {
+         spx_int32_t alo = amin, ahi = N/2;
+         while (alo*os + b < -4)
+            alo++;
+         while (ahi*os + b > os*N/2)
+            ahi--;
+         sinc_phase(st->cutoff, N, quality_map[st->quality].window_func, sc + 2*(alo-amin), alo - N/2, b/(double)os, ahi - alo + 1, table + alo*os + b + 4, os);
+      }
+      for (i=os*N/2+1;i<os*N+4;i++)
+         table[i+4] = table[os*N-i+4];
+      speex_free(sc);
+      *delay = st->filt_len/2;
+   }
+   return RESAMPLER_ERR_SUCCESS;
+}
+
+/* Returns a table matching the current parameters of st, with one more
+   reference held on it, or NULL if it could not be allocated. */
+static struct SincTable *sinc_table_acquire(const SpeexResamplerState *st, int use_direct, spx_uint32_t length)
+{
+   struct SincTable *tab;
+#ifdef USE_PTHREADS
+   struct SincTable *other;
+   struct SincTable **bucket = sinc_cache_bucket(st->num_rate, st->den_rate, st->quality);
+
+   pthread_mutex_lock(&sinc_cache_lock);
+   tab = sinc_cache_find(*bucket, st, use_direct);
+   if (tab)
+      tab->refcount++;
+   pthread_mutex_unlock(&sinc_cache_lock);
+   if (tab)
+      return tab;
+#endif
+
+   if ((INT_MAX - sizeof(struct SincTable))/sizeof(spx_word16_t) < length)
+      return NULL;
+   tab = (struct SincTable *)speex_alloc(sizeof(struct SincTable) + length*sizeof(spx_word16_t));
+   if (!tab)
+      return NULL;
+   tab->num_rate = st->num_rate;
+   tab->den_rate = st->den_rate;
+   tab->quality = st->quality;
+   tab->use_direct = use_direct;
+   tab->phase = st->phase;
+   tab->refcount = 1;
+   tab->table = (spx_word16_t *)(tab+1);
+   /* Built outside of the lock since this is the slow part */
+   if (sinc_table_fill(st, tab->table, use_direct, &tab->delay) != RESAMPLER_ERR_SUCCESS)
+   {
+      speex_free(tab);
+      return NULL;
+   }
+
+#ifdef USE_PTHREADS
+   pthread_mutex_lock(&sinc_cache_lock);
+   /* Someone may have built the same table while we were busy */
+   other = sinc_cache_find(*bucket, st, use_direct);
+   if (other)
+   {
+      other->refcount++;
+   } else {
+      tab->next = *bucket;
+      *bucket = tab;
+   }
+   pthread_mutex_unlock(&sinc_cache_lock);
+   if (other)
+   {
+      speex_free(tab);
+      tab = other;
+   }
+#endif
+   return tab;
+}
+
+static void sinc_table_release(struct SincTable *tab)
+{
+   if (!tab)
+      return;
+#ifdef USE_PTHREADS
+   pthread_mutex_lock(&sinc_cache_lock);
+   if (--tab->refcount == 0)
+   {
+      struct SincTable **prev = sinc_cache_bucket(tab->num_rate, tab->den_rate, tab->quality);
+      while (*prev != tab)
+         prev = &(*prev)->next;
+      *prev = tab->next;
+   } else {
+      tab = NULL;
+   }
+   pthread_mutex_unlock(&sinc_cache_lock);
+#endif
+   speex_free(tab);
+}
+
+/* The half-band stages use the window of the current quality. The
+   transition of a half-band filter is centred on a quarter of its input
+   rate, and must not let anything alias into the final pass-band. Its
+   length is set from the (length x transition width) product of the
+   single-stage filter, base_length*(1-bandwidth): three times that keeps
+   the cascade within a few dB of the single-stage stop-band attenuation
+   and pass-band ripple, as the errors of the stages add up. */
+static int halfband_length(const SpeexResamplerState *st, int stage)
+{
+   const float bandwidth = quality_map[st->quality].downsample_bandwidth;
+   /* Input rate of this stage relative to the output rate (more than 4) */
+   const float ratio = (float)st->ratio_num / st->ratio_den / (1<<stage);
+   int len = (int)ceil(3.f*quality_map[st->quality].base_length*(1.f-bandwidth) / (.5f - bandwidth/ratio));
+   if (len < 3)
+      len = 3;
+   if (len > 4*MAX_HALFBAND_TAPS-1)
+      len = 4*MAX_HALFBAND_TAPS-1;
+   return (len/4)*4 + 3;
+}
+
+/* Cost per output sample of the fractional filter for a down-sampling ratio,
+   as chosen by update_filter(). The interpolating kernels compute four
+   products per tap. */
+static float fractional_cost(const SpeexResamplerState *st, float ratio, spx_uint32_t den_rate)
+{
+   float cost = quality_map[st->quality].base_length*ratio;
+#ifndef RESAMPLE_FULL_SINC_TABLE
+   int oversample = quality_map[st->quality].oversample;
+   if (ratio > 2)
+      oversample >>= 1;
+   if (ratio > 4)
+      oversample >>= 1;
+   if (ratio > 8)
+      oversample >>= 1;
+   if (ratio > 16)
+      oversample >>= 1;
+   if (oversample < 1)
+      oversample = 1;
+   if (den_rate > (spx_uint32_t)oversample)
+      cost *= 4;
+#endif
+   return cost;
+}
+
+/* Number of half-band stages in front of the fractional filter. Each stage
+   halves the ratio as long as more than 4 is left, but they are only used
+   when they cost less than the longer fractional filter they replace. A
+   stage of length 4m+3 needs m+2 multiplies for each of its outputs, and
+   these are counted eight times as they don't use the SIMD kernels. */
+static int halfband_stages(const SpeexResamplerState *st)
+{
+   float ratio = (float)st->ratio_num / st->ratio_den;
+   float cost = fractional_cost(st, ratio, st->ratio_den);
+   float stage_cost = 0;
+   int stages = 0;
+   int best = 0;
+   while (stages < MAX_HALFBAND_STAGES && st->ratio_den <= (UINT32_MAX >> (stages+3)) && st->ratio_num > st->ratio_den << (stages+2))
+   {
+      stage_cost += 8*ratio/2*((halfband_length(st, stages)+1)/4 + 1);
+      ratio /= 2;
+      stages++;
+      if (stage_cost + fractional_cost(st, ratio, st->ratio_den << stages) < cost)
+      {
+         cost = stage_cost + fractional_cost(st, ratio, st->ratio_den << stages);
+         best = stages;
+      }
+   }
+   return best;
+}
+
+/* Windowed sinc taps, normalised for unity gain at DC */
+static void halfband_taps(spx_word16_t *taps, int len, const struct FuncDef *window_func)
+{
+   double h[MAX_HALFBAND_TAPS];
+   double sum = .5;
+   int j;
+   for (j=0;j<(len+1)/4;j++)
+   {
+      double x = M_PI*.5*(2*j - (len-1)/2);
+      h[j] = .5*sin(x)/x * compute_func(fabs((4.*j - (len-1))/(len+1)), window_func);
+      sum += 2*h[j];
+   }
+   for (j=0;j<(len+1)/4;j++)
+#ifdef FIXED_POINT
+      taps[j] = WORD2INT(32768.*h[j]/sum);
+#else
+      taps[j] = h[j]/sum;
+#endif
+}
+
+static void halfband_clear(SpeexResamplerState *st, int stage, int fill)
+{
+   struct HalfbandStage *hb = &st->stages[stage];
+   spx_uint32_t i;
+   for (i=0;i<st->nb_channels*hb->alloc_size;i++)
+      hb->mem[i] = 0;
+   for (i=0;i<st->nb_channels;i++)
+      hb->fill[i] = fill;
+}
+
+static void halfband_free(struct HalfbandStage *hb)
+{
+   speex_free(hb->taps);
+   speex_free(hb->mem);
+   speex_free(hb->fill);
+   hb->taps = NULL;
+   hb->mem = NULL;
+   hb->fill = NULL;
+   hb->len = 0;
+   hb->alloc_size = 0;
+}
+
+/* Sets the number of half-band stages and the matching ratio for the
+   fractional filter. The stages themselves are set up by update_stages(). */
+static void halfband_set_count(SpeexResamplerState *st, int nb_stages)
+{
+   spx_uint32_t c;
+
+   if (nb_stages != st->nb_stages)
+   {
+      /* Keep the fractional position, now in units of the new den_rate */
+      for (c=0;c<st->nb_channels;c++)
+      {
+         if (nb_stages > st->nb_stages)
+            st->samp_frac_num[c] <<= nb_stages - st->nb_stages;
+         else
+            st->samp_frac_num[c] >>= st->nb_stages - nb_stages;
+      }
+      st->nb_stages = nb_stages;
+   }
+   st->num_rate = st->ratio_num;
+   st->den_rate = st->ratio_den << nb_stages;
+}
+
+/* Allocates the half-band stages so that each of them can take what the
+   fractional filter consumes in one go. The memory of stages whose size
+   doesn't change is kept. */
+static int update_stages(SpeexResamplerState *st)
+{
+   const spx_uint32_t chunk = st->mem_alloc_size - (st->filt_len-1);
+   int i;
+
+   for (i=0;i<MAX_HALFBAND_STAGES;i++)
+   {
+      struct HalfbandStage *hb = &st->stages[i];
+      int len = i < st->nb_stages ? halfband_length(st, i) : 0;
+      spx_uint32_t alloc_size = 0;
+
+      if (len)
+      {
+         if (chunk > (spx_uint32_t)((INT_MAX >> (st->nb_stages-i)) - len))
+            return RESAMPLER_ERR_ALLOC_FAILED;
+         alloc_size = len-1 + (chunk << (st->nb_stages-i));
+      }
+      if (len != hb->len || alloc_size != hb->alloc_size)
+      {
+         halfband_free(hb);
+         if (!len)
+            continue;
+         if (INT_MAX/sizeof(spx_word16_t)/st->nb_channels < alloc_size
+             || !(hb->taps = (spx_word16_t*)speex_alloc((len+1)/4*sizeof(spx_word16_t)))
+             || !(hb->mem = (spx_word16_t*)speex_alloc(st->nb_channels*alloc_size*sizeof(spx_word16_t)))
+             || !(hb->fill = (spx_uint32_t*)speex_alloc(st->nb_channels*sizeof(spx_uint32_t))))
+         {
+            halfband_free(hb);
+            return RESAMPLER_ERR_ALLOC_FAILED;
+         }
+         hb->len = len;
+         hb->alloc_size = alloc_size;
+         halfband_clear(st, i, len-1);
+      }
+      if (len)
+         halfband_taps(hb->taps, len, quality_map[st->quality].window_func);
+   }
+   return RESAMPLER_ERR_SUCCESS;
+}
+
+/* Decimates the n samples just appended to the first stage of channel_index
+   through the cascade. Returns the number of samples written to out. */
+static spx_uint32_t halfband_decimate(SpeexResamplerState *st, spx_uint32_t channel_index, spx_uint32_t n, spx_word16_t *out)
+{
+   int i;
+   for (i=0;i<st->nb_stages;i++)
+   {
+      const struct HalfbandStage *hb = &st->stages[i];
+      const int len = hb->len;
+      const int half = (len+1)/4;
+      spx_word16_t *mem = hb->mem + channel_index*hb->alloc_size;
+      spx_uint32_t fill = hb->fill[channel_index] + n;
+      spx_word16_t *y = (i == st->nb_stages-1) ? out : st->stages[i+1].mem + channel_index*st->stages[i+1].alloc_size + st->stages[i+1].fill[channel_index];
+      spx_uint32_t k;
+      int j;
+
+      n = fill >= (spx_uint32_t)len ? (fill-len)/2 + 1 : 0;
+      for (k=0;k<n;k++)
+      {
+         const spx_word16_t *x = mem + 2*k;
+         spx_word32_t sum = MULT16_16(QCONST16(.5f,15), x[(len-1)/2]);
+         for (j=0;j<half;j++)
+#ifdef FIXED_POINT
+            sum += MULT16_16(hb->taps[j], x[2*j]) + MULT16_16(hb->taps[j], x[len-1-2*j]);
+#else
+            sum += hb->taps[j] * (x[2*j] + x[len-1-2*j]);
+#endif
+         y[k] = SATURATE32PSHR(sum, 15, 32767);
+      }
+      fill -= 2*n;
+      for (k=0;k<fill;k++)
+         mem[k] = mem[k+2*n];
+      hb->fill[channel_index] = fill;
+   }
+   return n;
+}
+
+/* Step between output samples in asrc mode, from the requested ratio */
+static void asrc_update_step(SpeexResamplerState *st)
+{
+   st->int_advance = st->ratio_num/st->ratio_den;
+   st->step_frac = (spx_uint32_t)((double)(st->ratio_num%st->ratio_den)/st->ratio_den*4294967296.0);
+}
+
+/* Whether any channel has processed samples since st was created. Only
+   called by functions that can't run while channels are being processed. */
+static int resampler_started(const SpeexResamplerState *st)
+{
+   spx_uint32_t i;
+   for (i=0;i<st->nb_channels;i++)
+      if (st->started[i])
+         return 1;
+   return 0;
+}
+
+static int update_filter(SpeexResamplerState *st)
+{
+   spx_uint32_t old_length = st->filt_len;
+   spx_uint32_t old_alloc_size = st->mem_alloc_size;
+   int use_direct;
+   spx_uint32_t min_sinc_table_length;
+   spx_uint32_t min_alloc_size;
+   struct SincTable *sinc_entry;
+   resampler_basic_func specialized;
+
+   if (st->asrc)
+   {
+      /* The filter is built for the nominal rates, the ratio only sets the
+         step */
+      spx_uint32_t fact = compute_gcd(st->in_rate, st->out_rate);
+      st->num_rate = st->in_rate / fact;
+      st->den_rate = st->out_rate / fact;
+   } else {
+      /* The half-band stages are linear-phase, so they would bring most of
+         the delay back */
+      halfband_set_count(st, st->phase == SPEEX_RESAMPLER_PHASE_MINIMUM ? 0 : halfband_stages(st));
+   }
+
+   st->int_advance = st->num_rate/st->den_rate;
+   st->frac_advance = st->num_rate%st->den_rate;
+   st->oversample = quality_map[st->quality].oversample;
+   /* The minimum-phase response starts abruptly, so it needs a finer table
+      for the cubic interpolation to be as accurate */
+   if (st->phase == SPEEX_RESAMPLER_PHASE_MINIMUM && st->oversample < 32)
+      st->oversample = 32;
+   st->filt_len = quality_map[st->quality].base_length;
+
+   if (st->num_rate > st->den_rate)
+   {
+      /* down-sampling */
+      st->cutoff = quality_map[st->quality].downsample_bandwidth * st->den_rate / st->num_rate;
+      if (multiply_frac(&st->filt_len,st->filt_len,st->num_rate,st->den_rate) != RESAMPLER_ERR_SUCCESS)
+         goto fail;
+      /* Round up to make sure we have a multiple of 8 for SSE */
+      st->filt_len = ((st->filt_len-1)&(~0x7))+8;
+      if (2*st->den_rate < st->num_rate)
          st->oversample >>= 1;
       if (4*st->den_rate < st->num_rate)
          st->oversample >>= 1;
@@ -647,6 +1892,9 @@ static int update_filter(SpeexResamplerState *st)
    use_direct = st->filt_len*st->den_rate <= st->filt_len*st->oversample+8
                 && INT_MAX/sizeof(spx_word16_t)/st->den_rate >= st->filt_len;
 #endif
+   /* In asrc mode, the position isn't a multiple of 1/den_rate */
+   if (st->asrc)
+      use_direct = 0;
    if (use_direct)
    {
       min_sinc_table_length = st->filt_len*st->den_rate;
@@ -656,47 +1904,92 @@ static int update_filter(SpeexResamplerState *st)
 
       min_sinc_table_length = st->filt_len*st->oversample+8;
    }
-   if (st->sinc_table_length < min_sinc_table_length)
-   {
-      spx_word16_t *sinc_table = (spx_word16_t *)speex_realloc(st->sinc_table,min_sinc_table_length*sizeof(spx_word16_t));
-      if (!sinc_table)
-         goto fail;
+   sinc_entry = sinc_table_acquire(st, use_direct, min_sinc_table_length);
+   if (!sinc_entry)
+      goto fail;
+   sinc_table_release(st->sinc_entry);
+   st->sinc_entry = sinc_entry;
+   st->sinc_table = sinc_entry->table;
+   st->use_direct = use_direct;
+   st->filt_delay = sinc_entry->delay;
+
+   /* The interleaved kernels only have a plain single-precision accumulator,
+      so the higher qualities keep using the per-channel kernels */
+#ifdef FIXED_POINT
+   st->interleaved_ptr = resampler_basic_interleaved;
+#else
+   st->interleaved_ptr = st->quality>8 ? NULL : resampler_basic_interleaved;
+#endif
+   if (st->asrc)
+      st->interleaved_ptr = NULL;
+#ifdef USE_AVX2
+   if (st->use_avx2 && st->interleaved_ptr)
+      st->interleaved_ptr = resampler_basic_interleaved_avx2;
+#endif
 
-      st->sinc_table = sinc_table;
-      st->sinc_table_length = min_sinc_table_length;
-   }
+   specialized = resampler_specialization(st, use_direct);
    if (use_direct)
    {
-      spx_uint32_t i;
-      for (i=0;i<st->den_rate;i++)
-      {
-         spx_int32_t j;
-         for (j=0;j<st->filt_len;j++)
-         {
-            st->sinc_table[i*st->filt_len+j] = sinc(st->cutoff,((j-(spx_int32_t)st->filt_len/2+1)-((float)i)/st->den_rate), st->filt_len, quality_map[st->quality].window_func);
-         }
-      }
 #ifdef FIXED_POINT
       st->resampler_ptr = resampler_basic_direct_single;
+#ifdef USE_AVX2
+      if (st->use_avx2)
+         st->resampler_ptr = resampler_basic_direct_single_avx2;
+#endif
 #else
       if (st->quality>8)
+#ifdef OVERRIDE_COMPENSATED_PRODUCTS
+         st->resampler_ptr = resampler_basic_direct_compensated;
+#else
          st->resampler_ptr = resampler_basic_direct_double;
+#endif
       else
          st->resampler_ptr = resampler_basic_direct_single;
+#ifdef USE_AVX2
+      if (st->use_avx2)
+         st->resampler_ptr = st->quality>8 ? resampler_basic_direct_compensated_avx2 : resampler_basic_direct_single_avx2;
 #endif
+#endif
+      if (specialized)
+         st->resampler_ptr = specialized;
       /*fprintf (stderr, "resampler uses direct sinc table and normalised cutoff %f\n", cutoff);*/
+   } else if (st->asrc) {
+#ifdef FIXED_POINT
+      st->resampler_ptr = resampler_basic_asrc_single;
+#ifdef USE_AVX2
+      if (st->use_avx2)
+         st->resampler_ptr = resampler_basic_asrc_single_avx2;
+#endif
+#else
+      if (st->quality>8)
+         st->resampler_ptr = resampler_basic_asrc_double;
+      else
+         st->resampler_ptr = resampler_basic_asrc_single;
+#ifdef USE_AVX2
+      if (st->use_avx2)
+         st->resampler_ptr = st->quality>8 ? resampler_basic_asrc_double_avx2 : resampler_basic_asrc_single_avx2;
+#endif
+#endif
+      asrc_update_step(st);
    } else {
-      spx_int32_t i;
-      for (i=-4;i<(spx_int32_t)(st->oversample*st->filt_len+4);i++)
-         st->sinc_table[i+4] = sinc(st->cutoff,(i/(float)st->oversample - st->filt_len/2), st->filt_len, quality_map[st->quality].window_func);
 #ifdef FIXED_POINT
       st->resampler_ptr = resampler_basic_interpolate_single;
+#ifdef USE_AVX2
+      if (st->use_avx2)
+         st->resampler_ptr = resampler_basic_interpolate_single_avx2;
+#endif
 #else
       if (st->quality>8)
          st->resampler_ptr = resampler_basic_interpolate_double;
       else
          st->resampler_ptr = resampler_basic_interpolate_single;
+#ifdef USE_AVX2
+      if (st->use_avx2)
+         st->resampler_ptr = st->quality>8 ? resampler_basic_interpolate_double_avx2 : resampler_basic_interpolate_single_avx2;
 #endif
+#endif
+      if (specialized)
+         st->resampler_ptr = specialized;
       /*fprintf (stderr, "resampler uses interpolated sinc table and normalised cutoff %f\n", cutoff);*/
    }
 
@@ -705,8 +1998,10 @@ static int update_filter(SpeexResamplerState *st)
       due to handling of lots of corner cases. */
 
    /* Adding buffer_size to filt_len won't overflow here because filt_len
-      could be multiplied by sizeof(spx_word16_t) above. */
-   min_alloc_size = st->filt_len-1 + st->buffer_size;
+      could be multiplied by sizeof(spx_word16_t) above. The buffer must be
+      able to hold at least filt_len-1 input samples after the history for
+      speex_resampler_process_direct(). */
+   min_alloc_size = st->filt_len-1 + (st->buffer_size > st->filt_len-1 ? st->buffer_size : st->filt_len-1);
    if (min_alloc_size > st->mem_alloc_size)
    {
       spx_word16_t *mem;
@@ -718,12 +2013,33 @@ static int update_filter(SpeexResamplerState *st)
       st->mem = mem;
       st->mem_alloc_size = min_alloc_size;
    }
-   if (!st->started)
+   if (update_stages(st) != RESAMPLER_ERR_SUCCESS)
+      goto fail;
+   if (!resampler_started(st))
    {
       spx_uint32_t i;
       for (i=0;i<st->nb_channels*st->mem_alloc_size;i++)
          st->mem[i] = 0;
       /*speex_warning("reinit filter");*/
+   } else if (st->phase == SPEEX_RESAMPLER_PHASE_MINIMUM && st->filt_len != old_length)
+   {
+      spx_uint32_t i;
+      /* The minimum-phase filter is aligned on the newest sample, so only
+         the oldest part of the memory changes (and last_sample doesn't) */
+      for (i=st->nb_channels;i--;)
+      {
+         spx_uint32_t j;
+         if (st->filt_len > old_length)
+         {
+            for (j=old_length-1+st->magic_samples[i];j--;)
+               st->mem[i*st->mem_alloc_size+j+st->filt_len-old_length] = st->mem[i*old_alloc_size+j];
+            for (j=0;j<st->filt_len-old_length;j++)
+               st->mem[i*st->mem_alloc_size+j] = 0;
+         } else {
+            for (j=0;j<st->filt_len-1+st->magic_samples[i];j++)
+               st->mem[i*st->mem_alloc_size+j] = st->mem[i*st->mem_alloc_size+j+old_length-st->filt_len];
+         }
+      }
    } else if (st->filt_len > old_length)
    {
       spx_uint32_t i;
@@ -787,10 +2103,13 @@ static int update_filter(SpeexResamplerState *st)
 
 fail:
    st->resampler_ptr = resampler_basic_zero;
+   st->interleaved_ptr = NULL;
    /* st->mem may still contain consumed input samples for the filter.
       Restore filt_len so that filt_len - 1 still points to the position after
       the last of these samples. */
    st->filt_len = old_length;
+   halfband_set_count(st, 0);
+   update_stages(st);
    return RESAMPLER_ERR_ALLOC_FAILED;
 }
 
@@ -818,17 +2137,37 @@ EXPORT SpeexResamplerState *speex_resampler_init_frac(spx_uint32_t nb_channels,
       return NULL;
    }
    st->initialised = 0;
-   st->started = 0;
    st->in_rate = 0;
    st->out_rate = 0;
    st->num_rate = 0;
    st->den_rate = 0;
+   st->ratio_num = 0;
+   st->ratio_den = 0;
+   st->nb_stages = 0;
+   st->asrc = 0;
+   st->step_frac = 0;
+   st->phase = SPEEX_RESAMPLER_PHASE_LINEAR;
+   st->filt_delay = 0;
    st->quality = -1;
-   st->sinc_table_length = 0;
+   st->sinc_table = 0;
+   st->sinc_entry = 0;
    st->mem_alloc_size = 0;
    st->filt_len = 0;
    st->mem = 0;
    st->resampler_ptr = 0;
+   st->interleaved = 0;
+   st->interleaved_ptr = 0;
+   st->ihist = 0;
+   st->ihist_alloc_size = 0;
+   st->input_func = 0;
+   st->input_user = 0;
+#ifndef OUTSIDE_SPEEX
+   st->input_buffer = 0;
+#endif
+   st->input_format = NATIVE_FORMAT;
+   st->pull_buf = 0;
+   st->pull_alloc_size = 0;
+   st->pull_fill = 0;
 
    st->cutoff = 1.f;
    st->nb_channels = nb_channels;
@@ -837,7 +2176,15 @@ EXPORT SpeexResamplerState *speex_resampler_init_frac(spx_uint32_t nb_channels,
 
    st->buffer_size = 160;
 
+#ifdef USE_AVX2
+   st->use_avx2 = speex_cpu_has_avx2();
+#else
+   st->use_avx2 = 0;
+#endif
+
    /* Per channel data */
+   if (!(st->started = (int*)speex_alloc(nb_channels*sizeof(int))))
+      goto fail;
    if (!(st->last_sample = (spx_int32_t*)speex_alloc(nb_channels*sizeof(spx_int32_t))))
       goto fail;
    if (!(st->magic_samples = (spx_uint32_t*)speex_alloc(nb_channels*sizeof(spx_uint32_t))))
@@ -870,218 +2217,1013 @@ fail:
 
 EXPORT void speex_resampler_destroy(SpeexResamplerState *st)
 {
+   int i;
+   for (i=0;i<MAX_HALFBAND_STAGES;i++)
+      halfband_free(&st->stages[i]);
    speex_free(st->mem);
-   speex_free(st->sinc_table);
+   speex_free(st->ihist);
+   speex_free(st->pull_buf);
+   sinc_table_release(st->sinc_entry);
+   speex_free(st->started);
    speex_free(st->last_sample);
    speex_free(st->magic_samples);
    speex_free(st->samp_frac_num);
    speex_free(st);
 }
 
-static int speex_resampler_process_native(SpeexResamplerState *st, spx_uint32_t channel_index, spx_uint32_t *in_len, spx_word16_t *out, spx_uint32_t *out_len)
+static int speex_resampler_process_native(SpeexResamplerState *st, spx_uint32_t channel_index, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   int j=0;
+   const int N = st->filt_len;
+   int out_sample = 0;
+   spx_word16_t *mem = st->mem + channel_index * st->mem_alloc_size;
+   spx_uint32_t ilen;
+
+   /* Channels can run on different threads, so each has its own flag */
+   st->started[channel_index] = 1;
+
+   /* Call the right resampler through the function ptr */
+   out_sample = st->resampler_ptr(st, channel_index, mem, in_len, out, out_len);
+
+   if (st->last_sample[channel_index] < (spx_int32_t)*in_len)
+      *in_len = st->last_sample[channel_index];
+   *out_len = out_sample;
+   st->last_sample[channel_index] -= *in_len;
+
+   ilen = *in_len;
+
+   for(j=0;j<N-1;++j)
+     mem[j] = mem[j+ilen];
+
+   return RESAMPLER_ERR_SUCCESS;
+}
+
+/* With half-band stages, input goes to the first stage rather than to the
+   filter memory. Returns where the input of channel_index goes, and limits
+   *in_len to what the buffers can take and to about what is needed for
+   out_len more output samples. */
+static spx_word16_t *speex_resampler_cascade_input(SpeexResamplerState *st, spx_uint32_t channel_index, spx_uint32_t *in_len, spx_uint32_t out_len)
+{
+   const struct HalfbandStage *hb = &st->stages[0];
+   const spx_uint32_t chunk = st->mem_alloc_size - (st->filt_len-1);
+   spx_uint32_t max_len = chunk << st->nb_stages;
+   spx_uint32_t needed;
+
+   /* Input of the fractional filter needed for out_len samples */
+   if (multiply_frac(&needed, out_len, st->num_rate, st->den_rate) == RESAMPLER_ERR_SUCCESS && needed < chunk)
+   {
+      if (st->last_sample[channel_index] > 0)
+         needed += st->last_sample[channel_index];
+      if (needed < chunk)
+         max_len = (needed+1) << st->nb_stages;
+   }
+   if (*in_len > max_len)
+      *in_len = max_len;
+   return hb->mem + channel_index*hb->alloc_size + hb->fill[channel_index];
+}
+
+/* Runs the in_len samples written by the caller after
+   speex_resampler_cascade_input() through the half-band stages and the
+   fractional filter. The input is always consumed entirely, so decimated
+   samples the filter can't use yet are kept as magic samples. */
+static void speex_resampler_process_cascade(SpeexResamplerState *st, spx_uint32_t channel_index, spx_uint32_t in_len, void *out, spx_uint32_t *out_len)
+{
+   spx_uint32_t j;
+   const int N = st->filt_len;
+   spx_word16_t *mem = st->mem + channel_index * st->mem_alloc_size;
+   spx_uint32_t dlen = halfband_decimate(st, channel_index, in_len, mem + N - 1);
+   spx_uint32_t ilen = dlen;
+
+   speex_resampler_process_native(st, channel_index, &ilen, out, out_len);
+   if (ilen < dlen)
+   {
+      st->magic_samples[channel_index] = dlen - ilen;
+      for (j=0;j<dlen-ilen;j++)
+         mem[N-1+j] = mem[N-1+ilen+j];
+   }
+}
+
+static int speex_resampler_magic(SpeexResamplerState *st, spx_uint32_t channel_index, void **out, spx_uint32_t out_len) {
+   spx_uint32_t tmp_in_len = st->magic_samples[channel_index];
+   spx_word16_t *mem = st->mem + channel_index * st->mem_alloc_size;
+   const int N = st->filt_len;
+
+   speex_resampler_process_native(st, channel_index, &tmp_in_len, *out, &out_len);
+
+   st->magic_samples[channel_index] -= tmp_in_len;
+
+   /* If we couldn't process all "magic" input samples, save the rest for next time */
+   if (st->magic_samples[channel_index])
+   {
+      spx_uint32_t i;
+      for (i=0;i<st->magic_samples[channel_index];i++)
+         mem[N-1+i]=mem[N-1+i+tmp_in_len];
+   }
+   *out = FORMAT_ADVANCE(*out, st->out_format, out_len*st->out_stride);
+   return out_len;
+}
+
+/* Resamples contiguous native input without copying it into the filter
+   memory. Only the first filt_len-1 samples are copied after the history,
+   so that the windows that straddle the history can be computed from st->mem.
+   The remaining windows are read straight from the caller's buffer, and the
+   last filt_len-1 samples consumed become the new history. */
+static void speex_resampler_process_direct(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_word16_t *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   spx_uint32_t j;
+   spx_word16_t *mem = st->mem + channel_index * st->mem_alloc_size;
+   const spx_uint32_t filt_offs = st->filt_len - 1;
+   const spx_uint32_t ilen = *in_len;
+   spx_uint32_t ichunk = (ilen > filt_offs) ? filt_offs : ilen;
+   spx_uint32_t ochunk = *out_len;
+   spx_uint32_t olen;
+
+   for(j=0;j<ichunk;++j)
+      mem[j+filt_offs]=in[j];
+   speex_resampler_process_native(st, channel_index, &ichunk, out, &ochunk);
+   olen = *out_len - ochunk;
+
+   /* Once the first filt_len-1 samples are consumed, the history is exactly
+      the start of the caller's buffer */
+   if (ichunk == filt_offs && ilen > filt_offs && olen)
+   {
+      spx_uint32_t rchunk = ilen - filt_offs;
+      spx_uint32_t rout = olen;
+
+      rout = st->resampler_ptr(st, channel_index, in, &rchunk, FORMAT_ADVANCE(out, st->out_format, ochunk * st->out_stride), &rout);
+      if (st->last_sample[channel_index] < (spx_int32_t)rchunk)
+         rchunk = st->last_sample[channel_index];
+      st->last_sample[channel_index] -= rchunk;
+      for(j=0;j<filt_offs;++j)
+         mem[j] = in[j+rchunk];
+      ichunk += rchunk;
+      ochunk += rout;
+   }
+   *in_len = ichunk;
+   *out_len = ochunk;
+}
+
+/* Processes one channel in the output format set in st->out_format. This
+   only writes the state of channel_index, so that different channels can be
+   processed from different threads at the same time. */
+static int speex_resampler_process_channel(SpeexResamplerState *st, spx_uint32_t channel_index, int in_format, const void *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   spx_uint32_t ilen = *in_len;
+   spx_uint32_t olen = *out_len;
+   spx_word16_t *x = st->mem + channel_index * st->mem_alloc_size;
+   const int filt_offs = st->filt_len - 1;
+   const spx_uint32_t xlen = st->mem_alloc_size - filt_offs;
+   const int istride = st->in_stride;
+   const int out_format = st->out_format;
+
+   if (st->magic_samples[channel_index])
+      olen -= speex_resampler_magic(st, channel_index, &out, olen);
+   /* Copying costs about as much as it saves for short inputs */
+   if (! st->magic_samples[channel_index] && ! st->nb_stages && in && in_format == NATIVE_FORMAT && istride == 1 && ilen > 2*(spx_uint32_t)filt_offs) {
+      if (olen) {
+         spx_uint32_t ichunk = ilen;
+         spx_uint32_t ochunk = olen;
+         speex_resampler_process_direct(st, channel_index, (const spx_word16_t *)in, &ichunk, out, &ochunk);
+         ilen -= ichunk;
+         olen -= ochunk;
+      }
+   } else if (! st->magic_samples[channel_index]) {
+      while (ilen && olen) {
+        spx_uint32_t ichunk = (ilen > xlen) ? xlen : ilen;
+        spx_uint32_t ochunk = olen;
+        spx_word16_t *xin = x + filt_offs;
+
+        if (st->nb_stages) {
+           ichunk = ilen;
+           xin = speex_resampler_cascade_input(st, channel_index, &ichunk, olen);
+        }
+        if (in) {
+           load_samples(xin, in, in_format, istride, ichunk);
+        } else {
+           spx_uint32_t j;
+           for(j=0;j<ichunk;++j)
+              xin[j]=0;
+        }
+        if (st->nb_stages)
+           speex_resampler_process_cascade(st, channel_index, ichunk, out, &ochunk);
+        else
+           speex_resampler_process_native(st, channel_index, &ichunk, out, &ochunk);
+        ilen -= ichunk;
+        olen -= ochunk;
+        out = FORMAT_ADVANCE(out, out_format, ochunk * st->out_stride);
+        if (in)
+           in = FORMAT_ADVANCE(in, in_format, ichunk * istride);
+      }
+   }
+   *in_len -= ilen;
+   *out_len -= olen;
+   return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
+}
+
+EXPORT int speex_resampler_process_format(SpeexResamplerState *st, spx_uint32_t channel_index, int in_format, const void *in, spx_uint32_t *in_len, int out_format, void *out, spx_uint32_t *out_len)
+{
+   if (!format_size(in_format) || !format_size(out_format))
+      return RESAMPLER_ERR_INVALID_ARG;
+   /* Only written when it changes, so that channels can run on different
+      threads */
+   if (st->out_format != out_format)
+      st->out_format = out_format;
+   return speex_resampler_process_channel(st, channel_index, in_format, in, in_len, out, out_len);
+}
+
+EXPORT int speex_resampler_process_float(SpeexResamplerState *st, spx_uint32_t channel_index, const float *in, spx_uint32_t *in_len, float *out, spx_uint32_t *out_len)
+{
+   return speex_resampler_process_format(st, channel_index, SPEEX_RESAMPLER_FORMAT_FLOAT, in, in_len, SPEEX_RESAMPLER_FORMAT_FLOAT, out, out_len);
+}
+
+EXPORT int speex_resampler_process_int(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_int16_t *in, spx_uint32_t *in_len, spx_int16_t *out, spx_uint32_t *out_len)
+{
+   return speex_resampler_process_format(st, channel_index, SPEEX_RESAMPLER_FORMAT_S16, in, in_len, SPEEX_RESAMPLER_FORMAT_S16, out, out_len);
+}
+
+/* Checks whether an interleaved call can use the channel-interleaved
+   kernels, allocating the interleaved history if needed */
+static int speex_resampler_interleaved_ready(SpeexResamplerState *st)
+{
+   spx_uint32_t i;
+   spx_uint32_t size;
+   const spx_uint32_t channels = st->nb_channels;
+
+   if (!st->interleaved || !st->interleaved_ptr || st->nb_stages || channels < INTERLEAVED_MIN_CHANNELS)
+      return 0;
+   for (i=0;i<channels;i++)
+   {
+      if (st->magic_samples[i] || st->last_sample[i] != st->last_sample[0]
+          || st->samp_frac_num[i] != st->samp_frac_num[0])
+         return 0;
+   }
+   /* History for all channels, followed by the interpolated taps and one
+      output frame */
+   if (INT_MAX/sizeof(spx_word16_t)/channels <= st->mem_alloc_size + st->filt_len + 1)
+      return 0;
+   size = channels*(st->mem_alloc_size + 1) + st->filt_len;
+   if (size > st->ihist_alloc_size)
+   {
+      spx_word16_t *ihist = (spx_word16_t*)speex_realloc(st->ihist, size*sizeof(*ihist));
+      if (!ihist)
+         return 0;
+      st->ihist = ihist;
+      st->ihist_alloc_size = size;
+   }
+   return 1;
+}
+
+/* Processes an interleaved stream with the channel-interleaved kernels. A
+   NULL in means zero input. The history is gathered from the per-channel
+   memory and scattered back afterwards, so that the per-channel functions
+   can still be mixed with the interleaved ones. */
+static void speex_resampler_process_interleaved_native(SpeexResamplerState *st, int in_format, const void *in, spx_uint32_t *in_len, void *out, spx_uint32_t *out_len)
+{
+   spx_uint32_t i, j;
+   const spx_uint32_t channels = st->nb_channels;
+   const spx_uint32_t filt_offs = st->filt_len - 1;
+   const spx_uint32_t xlen = st->mem_alloc_size - filt_offs;
+   spx_word16_t *x = st->ihist;
+   spx_uint32_t ilen = *in_len;
+   spx_uint32_t olen = *out_len;
+
+   for (i=0;i<channels;i++)
+      st->started[i] = 1;
+
+   for (i=0;i<channels;i++)
+      for (j=0;j<filt_offs;j++)
+         x[j*channels+i] = st->mem[i*st->mem_alloc_size+j];
+
+   while (ilen && olen) {
+      spx_uint32_t ichunk = (ilen > xlen) ? xlen : ilen;
+      spx_uint32_t ochunk = olen;
+      spx_word16_t *xin = x + filt_offs*channels;
+
+      if (in) {
+         load_samples(xin, in, in_format, 1, ichunk*channels);
+      } else {
+         for (j=0;j<ichunk*channels;++j)
+            xin[j] = 0;
+      }
+
+      ochunk = st->interleaved_ptr(st, x, &ichunk, out, &ochunk);
+
+      if (st->last_sample[0] < (spx_int32_t)ichunk)
+         ichunk = st->last_sample[0];
+      for (i=0;i<channels;i++)
+         st->last_sample[i] -= ichunk;
+      for (j=0;j<filt_offs*channels;++j)
+         x[j] = x[j+ichunk*channels];
+
+      out = FORMAT_ADVANCE(out, st->out_format, ochunk*channels);
+      if (in)
+         in = FORMAT_ADVANCE(in, in_format, ichunk*channels);
+      ilen -= ichunk;
+      olen -= ochunk;
+   }
+
+   for (i=0;i<channels;i++)
+      for (j=0;j<filt_offs;j++)
+         st->mem[i*st->mem_alloc_size+j] = x[j*channels+i];
+
+   *in_len -= ilen;
+   *out_len -= olen;
+}
+
+EXPORT int speex_resampler_process_interleaved_format(SpeexResamplerState *st, int in_format, const void *in, spx_uint32_t *in_len, int out_format, void *out, spx_uint32_t *out_len)
+{
+   spx_uint32_t i;
+   int istride_save, ostride_save;
+   spx_uint32_t bak_out_len = *out_len;
+   spx_uint32_t bak_in_len = *in_len;
+   if (!format_size(in_format) || !format_size(out_format))
+      return RESAMPLER_ERR_INVALID_ARG;
+   if (speex_resampler_interleaved_ready(st))
+   {
+      st->out_format = out_format;
+      speex_resampler_process_interleaved_native(st, in_format, in, in_len, out, out_len);
+      return RESAMPLER_ERR_SUCCESS;
+   }
+   istride_save = st->in_stride;
+   ostride_save = st->out_stride;
+   st->in_stride = st->out_stride = st->nb_channels;
+   for (i=0;i<st->nb_channels;i++)
+   {
+      *out_len = bak_out_len;
+      *in_len = bak_in_len;
+      if (in != NULL)
+         speex_resampler_process_format(st, i, in_format, FORMAT_ADVANCE(in, in_format, i), in_len, out_format, FORMAT_ADVANCE(out, out_format, i), out_len);
+      else
+         speex_resampler_process_format(st, i, in_format, NULL, in_len, out_format, FORMAT_ADVANCE(out, out_format, i), out_len);
+   }
+   st->in_stride = istride_save;
+   st->out_stride = ostride_save;
+   return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
+}
+
+EXPORT int speex_resampler_process_interleaved_float(SpeexResamplerState *st, const float *in, spx_uint32_t *in_len, float *out, spx_uint32_t *out_len)
+{
+   return speex_resampler_process_interleaved_format(st, SPEEX_RESAMPLER_FORMAT_FLOAT, in, in_len, SPEEX_RESAMPLER_FORMAT_FLOAT, out, out_len);
+}
+
+EXPORT int speex_resampler_process_interleaved_int(SpeexResamplerState *st, const spx_int16_t *in, spx_uint32_t *in_len, spx_int16_t *out, spx_uint32_t *out_len)
+{
+   return speex_resampler_process_interleaved_format(st, SPEEX_RESAMPLER_FORMAT_S16, in, in_len, SPEEX_RESAMPLER_FORMAT_S16, out, out_len);
+}
+
+/* Arguments of speex_resampler_process_interleaved_parallel() shared by its
+   tasks. Only the task of channel 0 writes back the lengths it processed. */
+struct ParallelCall {
+   SpeexResamplerState *st;
+   int in_format;
+   const void *in;
+   void *out;
+   spx_uint32_t in_len;
+   spx_uint32_t out_len;
+   spx_uint32_t in_done;
+   spx_uint32_t out_done;
+};
+
+static void parallel_task(void *arg, spx_uint32_t channel_index)
+{
+   struct ParallelCall *call = (struct ParallelCall *)arg;
+   SpeexResamplerState *st = call->st;
+   spx_uint32_t in_len = call->in_len;
+   spx_uint32_t out_len = call->out_len;
+
+   if (channel_index >= st->nb_channels)
+      return;
+   speex_resampler_process_channel(st, channel_index, call->in_format,
+                                   call->in ? FORMAT_ADVANCE(call->in, call->in_format, channel_index) : NULL, &in_len,
+                                   FORMAT_ADVANCE(call->out, st->out_format, channel_index), &out_len);
+   if (channel_index == 0)
+   {
+      call->in_done = in_len;
+      call->out_done = out_len;
+   }
+}
+
+EXPORT int speex_resampler_process_interleaved_parallel(SpeexResamplerState *st, int in_format, const void *in, spx_uint32_t *in_len, int out_format, void *out, spx_uint32_t *out_len, speex_resampler_parallel_func run, void *pool)
+{
+   struct ParallelCall call;
+   int istride_save, ostride_save;
+   spx_uint32_t i;
+
+   if (!format_size(in_format) || !format_size(out_format))
+      return RESAMPLER_ERR_INVALID_ARG;
+   /* Everything the channels share is set here, before the tasks start */
+   istride_save = st->in_stride;
+   ostride_save = st->out_stride;
+   st->in_stride = st->out_stride = st->nb_channels;
+   st->out_format = out_format;
+
+   call.st = st;
+   call.in_format = in_format;
+   call.in = in;
+   call.out = out;
+   call.in_len = call.in_done = *in_len;
+   call.out_len = call.out_done = *out_len;
+   if (run)
+      run(pool, parallel_task, &call, st->nb_channels);
+   else
+      for (i=0;i<st->nb_channels;i++)
+         parallel_task(&call, i);
+
+   st->in_stride = istride_save;
+   st->out_stride = ostride_save;
+   *in_len = call.in_done;
+   *out_len = call.out_done;
+   return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
+}
+
+EXPORT int speex_resampler_set_input_func(SpeexResamplerState *st, int format, speex_resampler_input_func func, void *user)
+{
+   if (!format_size(format))
+      return RESAMPLER_ERR_INVALID_ARG;
+   /* A frame held back in another format can't be used any more */
+   if (format != st->input_format)
+      st->pull_fill = 0;
+   st->input_func = func;
+   st->input_user = user;
+#ifndef OUTSIDE_SPEEX
+   st->input_buffer = NULL;
+#endif
+   st->input_format = format;
+   return RESAMPLER_ERR_SUCCESS;
+}
+
+#ifndef OUTSIDE_SPEEX
+EXPORT int speex_resampler_set_input_buffer(SpeexResamplerState *st, int format, SpeexBuffer *buffer)
+{
+   if (!format_size(format))
+      return RESAMPLER_ERR_INVALID_ARG;
+   if (format != st->input_format)
+      st->pull_fill = 0;
+   st->input_func = NULL;
+   st->input_user = NULL;
+   st->input_buffer = buffer;
+   st->input_format = format;
+   return RESAMPLER_ERR_SUCCESS;
+}
+#endif
+
+/* Reads up to len frames of input for the pull functions */
+static spx_uint32_t speex_resampler_read_input(SpeexResamplerState *st, void *data, spx_uint32_t len)
+{
+   spx_uint32_t got;
+#ifndef OUTSIDE_SPEEX
+   if (st->input_buffer)
+   {
+      const int frame_size = format_size(st->input_format)*st->nb_channels;
+      got = speex_buffer_get_available(st->input_buffer)/frame_size;
+      if (got > len)
+         got = len;
+      speex_buffer_read(st->input_buffer, data, got*frame_size);
+      return got;
+   }
+#endif
+   got = st->input_func(st->input_user, data, len);
+   return got > len ? len : got;
+}
+
+/* Number of input samples that out_len more output samples of a channel
+   depend on, counted before the half-band stages if there are some. The
+   position is stepped the same way as in the kernels. Without half-band
+   stages, the filter may consume one sample less than that, when the next
+   output starts at the same input sample as the last one. */
+static spx_uint32_t speex_resampler_input_needed(const SpeexResamplerState *st, spx_uint32_t channel_index, spx_uint32_t out_len)
+{
+   spx_int32_t last_sample = st->last_sample[channel_index];
+   spx_uint32_t samp_frac_num = st->samp_frac_num[channel_index];
+   const spx_uint32_t magic = st->magic_samples[channel_index];
+   spx_uint32_t needed;
+   spx_uint32_t i;
+   int stage;
+
+   if (!out_len)
+      return 0;
+   for (i=1;i<out_len;i++)
+   {
+      last_sample += st->int_advance;
+      if (st->asrc)
+      {
+         samp_frac_num += st->step_frac;
+         if (samp_frac_num < st->step_frac)
+            last_sample++;
+      } else {
+         samp_frac_num += st->frac_advance;
+         if (samp_frac_num >= st->den_rate)
+         {
+            samp_frac_num -= st->den_rate;
+            last_sample++;
+         }
+      }
+   }
+   /* The last output reads up to last_sample, and the magic samples are
+      already in the filter memory */
+   needed = (spx_uint32_t)last_sample + 1 > magic ? (spx_uint32_t)last_sample + 1 - magic : 0;
+   /* A half-band stage with fill samples in its memory outputs n samples
+      once it has len + 2*(n-1) of them */
+   for (stage=st->nb_stages;stage--;)
+   {
+      const struct HalfbandStage *hb = &st->stages[stage];
+      const spx_uint32_t fill = hb->fill[channel_index];
+      if (needed)
+         needed = hb->len + 2*(needed-1) > fill ? hb->len + 2*(needed-1) - fill : 0;
+   }
+   return needed;
+}
+
+/* The pull functions read the input of all the channels at once, so their
+   positions have to be the same */
+static int speex_resampler_channels_in_step(const SpeexResamplerState *st)
+{
+   spx_uint32_t i;
+   int stage;
+   for (i=1;i<st->nb_channels;i++)
+   {
+      if (st->last_sample[i] != st->last_sample[0] || st->samp_frac_num[i] != st->samp_frac_num[0]
+          || st->magic_samples[i] != st->magic_samples[0])
+         return 0;
+      for (stage=0;stage<st->nb_stages;stage++)
+         if (st->stages[stage].fill[i] != st->stages[stage].fill[0])
+            return 0;
+   }
+   return 1;
+}
+
+EXPORT int speex_resampler_pull_format(SpeexResamplerState *st, int out_format, void *out, spx_uint32_t *out_len)
+{
+   const spx_uint32_t channels = st->nb_channels;
+   const size_t frame_size = format_size(st->input_format)*channels;
+   spx_uint32_t olen = *out_len;
+   int ret = RESAMPLER_ERR_SUCCESS;
+
+   if (!format_size(out_format))
+      return RESAMPLER_ERR_INVALID_ARG;
+#ifndef OUTSIDE_SPEEX
+   if (!st->input_func && !st->input_buffer)
+#else
+   if (!st->input_func)
+#endif
+      ret = RESAMPLER_ERR_BAD_STATE;
+   else if (!speex_resampler_channels_in_step(st))
+      ret = RESAMPLER_ERR_BAD_STATE;
+
+   while (olen && ret == RESAMPLER_ERR_SUCCESS)
+   {
+      spx_uint32_t ochunk, ichunk, needed, wanted, got;
+
+      /* About PULL_CHUNK frames of input at a time, plus what the filter
+         position and the half-band stages add */
+      if (multiply_frac(&ochunk, PULL_CHUNK, st->ratio_den, st->ratio_num) != RESAMPLER_ERR_SUCCESS || ochunk > olen)
+         ochunk = olen;
+      if (!ochunk)
+         ochunk = 1;
+      needed = speex_resampler_input_needed(st, 0, ochunk);
+      if (needed > st->pull_alloc_size)
+      {
+         void *buf;
+         if (INT_MAX/frame_size < needed || !(buf = speex_realloc(st->pull_buf, needed*frame_size)))
+         {
+            ret = RESAMPLER_ERR_ALLOC_FAILED;
+            break;
+         }
+         st->pull_buf = buf;
+         st->pull_alloc_size = needed;
+      }
+      wanted = needed > st->pull_fill ? needed - st->pull_fill : 0;
+      got = wanted ? speex_resampler_read_input(st, FORMAT_ADVANCE(st->pull_buf, st->input_format, st->pull_fill*channels), wanted) : 0;
+
+      ichunk = st->pull_fill + got;
+      ret = speex_resampler_process_interleaved_format(st, st->input_format, st->pull_buf, &ichunk, out_format, out, &ochunk);
+      st->pull_fill += got - ichunk;
+      if (st->pull_fill && ichunk)
+         SPEEX_MOVE((char *)st->pull_buf, (char *)st->pull_buf + ichunk*frame_size, st->pull_fill*frame_size);
+      out = FORMAT_ADVANCE(out, out_format, ochunk*channels);
+      olen -= ochunk;
+      if (got < wanted || !ochunk)
+         break;
+   }
+   *out_len -= olen;
+   return ret;
+}
+
+EXPORT int speex_resampler_pull_float(SpeexResamplerState *st, float *out, spx_uint32_t *out_len)
 {
-   int j=0;
-   const int N = st->filt_len;
-   int out_sample = 0;
-   spx_word16_t *mem = st->mem + channel_index * st->mem_alloc_size;
-   spx_uint32_t ilen;
+   return speex_resampler_pull_format(st, SPEEX_RESAMPLER_FORMAT_FLOAT, out, out_len);
+}
 
-   st->started = 1;
+EXPORT int speex_resampler_pull_int(SpeexResamplerState *st, spx_int16_t *out, spx_uint32_t *out_len)
+{
+   return speex_resampler_pull_format(st, SPEEX_RESAMPLER_FORMAT_S16, out, out_len);
+}
 
-   /* Call the right resampler through the function ptr */
-   out_sample = st->resampler_ptr(st, channel_index, mem, in_len, out, out_len);
+/* speex_resampler_process_offline() splits the input at multiples of the
+   period of the filter phases: every num_rate<<nb_stages input samples (over
+   their gcd with den_rate), the half-band stages and the fractional filter
+   are back at the same phase, and den_rate output samples have been
+   produced. Each segment is resampled by a fresh state that first reads
+   enough periods of the input before it to fill all the filter memories,
+   and whose output for those is dropped. Every output sample is then
+   computed from the same input, at the same phase and with the same kernel
+   as in a single serial run. */
+#define OFFLINE_SEGMENTS_PER_THREAD 4
+#define OFFLINE_MIN_PERIODS 4   /* Per segment, in units of the lead-in */
+#define OFFLINE_SCRATCH 256
+
+struct OfflineSegment {
+   const SpeexResamplerState *st;
+   int in_format;
+   const void *in;
+   spx_uint32_t in_len;    /* Frames the segment may read */
+   spx_uint32_t skip;      /* Output frames of the lead-in, dropped */
+   int out_format;
+   void *out;
+   spx_uint32_t out_len;   /* Frames wanted */
+   spx_uint32_t written;
+};
 
-   if (st->last_sample[channel_index] < (spx_int32_t)*in_len)
-      *in_len = st->last_sample[channel_index];
-   *out_len = out_sample;
-   st->last_sample[channel_index] -= *in_len;
+/* A new state with the settings of st, at the position it has right after
+   initialisation, speex_resampler_reset_mem() or speex_resampler_skip_zeros() */
+static SpeexResamplerState *offline_clone(const SpeexResamplerState *st, int *err)
+{
+   SpeexResamplerState *c;
+   spx_uint32_t i;
+   int j;
 
-   ilen = *in_len;
+   c = speex_resampler_init_frac(st->nb_channels, st->ratio_num, st->ratio_den, st->in_rate, st->out_rate, st->quality, err);
+   if (!c)
+      return NULL;
+   if (c->phase != st->phase && (*err = speex_resampler_set_phase(c, st->phase)) != RESAMPLER_ERR_SUCCESS)
+   {
+      speex_resampler_destroy(c);
+      return NULL;
+   }
+   for (i=0;i<st->nb_channels;i++)
+      c->last_sample[i] = st->last_sample[i];
+   for (j=0;j<st->nb_stages;j++)
+      for (i=0;i<st->nb_channels;i++)
+         c->stages[j].fill[i] = st->stages[j].fill[i];
+   return c;
+}
 
-   for(j=0;j<N-1;++j)
-     mem[j] = mem[j+ilen];
+static int offline_segment_process(struct OfflineSegment *seg)
+{
+   const spx_uint32_t channels = seg->st->nb_channels;
+   const void *in = seg->in;
+   spx_uint32_t ilen = seg->in_len;
+   spx_uint32_t skip = seg->skip;
+   spx_uint32_t written = 0;
+   void *scratch = NULL;
+   SpeexResamplerState *c;
+   int err;
+
+   c = offline_clone(seg->st, &err);
+   if (c && skip && !(scratch = speex_alloc(OFFLINE_SCRATCH*channels*format_size(seg->out_format))))
+      err = RESAMPLER_ERR_ALLOC_FAILED;
+   while (c && err == RESAMPLER_ERR_SUCCESS && (skip || written < seg->out_len))
+   {
+      spx_uint32_t ichunk = ilen;
+      spx_uint32_t ochunk;
+      void *out;
 
-   return RESAMPLER_ERR_SUCCESS;
+      if (skip)
+      {
+         ochunk = skip < OFFLINE_SCRATCH ? skip : OFFLINE_SCRATCH;
+         out = scratch;
+      } else {
+         ochunk = seg->out_len - written;
+         out = FORMAT_ADVANCE(seg->out, seg->out_format, written*channels);
+      }
+      /* Called with no input left too, for what the cascade still holds */
+      err = speex_resampler_process_interleaved_format(c, seg->in_format, in, &ichunk, seg->out_format, out, &ochunk);
+      if (!ichunk && !ochunk)
+         break;
+      if (skip)
+         skip -= ochunk;
+      else
+         written += ochunk;
+      in = FORMAT_ADVANCE(in, seg->in_format, ichunk*channels);
+      ilen -= ichunk;
+   }
+   seg->written = skip ? 0 : written;
+   speex_free(scratch);
+   if (c)
+      speex_resampler_destroy(c);
+   return err;
 }
 
-static int speex_resampler_magic(SpeexResamplerState *st, spx_uint32_t channel_index, spx_word16_t **out, spx_uint32_t out_len) {
-   spx_uint32_t tmp_in_len = st->magic_samples[channel_index];
-   spx_word16_t *mem = st->mem + channel_index * st->mem_alloc_size;
-   const int N = st->filt_len;
+/* Jobs are sorted by filter table so that streams sharing one run back to
+   back, then handed out in runs of BATCH_CHUNK to the calling thread and the
+   workers */
+#define BATCH_CHUNK 8
 
-   speex_resampler_process_native(st, channel_index, &tmp_in_len, *out, &out_len);
+struct BatchItem {
+   size_t key;
+   spx_uint32_t index;
+};
 
-   st->magic_samples[channel_index] -= tmp_in_len;
+struct SpeexResamplerBatch_ {
+   struct BatchItem *items;
+   spx_uint32_t alloc_size;
+   spx_uint32_t nb_items;
+   SpeexResamplerJob *jobs_int;
+   SpeexResamplerJobFloat *jobs_float;
+   struct OfflineSegment *segments;
+   spx_uint32_t next;
+   int err;              /* Error of the failed job with the lowest index */
+   spx_uint32_t err_index;
+#ifdef USE_PTHREADS
+   int nb_threads;
+   SpxThreadPool *pool;
+#endif
+};
 
-   /* If we couldn't process all "magic" input samples, save the rest for next time */
-   if (st->magic_samples[channel_index])
+static int batch_item_compare(const void *a, const void *b)
+{
+   const struct BatchItem *x = (const struct BatchItem *)a;
+   const struct BatchItem *y = (const struct BatchItem *)b;
+   if (x->key != y->key)
+      return x->key < y->key ? -1 : 1;
+   /* Keeps the caller's order within a group */
+   return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int batch_job_process(SpeexResamplerBatch *batch, spx_uint32_t index)
+{
+   if (batch->segments)
    {
-      spx_uint32_t i;
-      for (i=0;i<st->magic_samples[channel_index];i++)
-         mem[N-1+i]=mem[N-1+i+tmp_in_len];
+      return offline_segment_process(&batch->segments[index]);
+   } else if (batch->jobs_int)
+   {
+      SpeexResamplerJob *job = &batch->jobs_int[index];
+      return speex_resampler_process_interleaved_int(job->st, job->in, &job->in_len, job->out, &job->out_len);
+   } else {
+      SpeexResamplerJobFloat *job = &batch->jobs_float[index];
+      return speex_resampler_process_interleaved_float(job->st, job->in, &job->in_len, job->out, &job->out_len);
    }
-   *out += out_len*st->out_stride;
-   return out_len;
 }
 
-#ifdef FIXED_POINT
-EXPORT int speex_resampler_process_int(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_int16_t *in, spx_uint32_t *in_len, spx_int16_t *out, spx_uint32_t *out_len)
-#else
-EXPORT int speex_resampler_process_float(SpeexResamplerState *st, spx_uint32_t channel_index, const float *in, spx_uint32_t *in_len, float *out, spx_uint32_t *out_len)
+/* Processes chunks of the sorted jobs until there are none left */
+static void batch_run(void *arg, int id)
+{
+   SpeexResamplerBatch *batch = (SpeexResamplerBatch *)arg;
+   /* Offline segments are few and long, so they are handed out one by one */
+   const spx_uint32_t chunk = batch->segments ? 1 : BATCH_CHUNK;
+   int err = RESAMPLER_ERR_SUCCESS;
+   spx_uint32_t err_index = 0;
+   (void)id;
+   for (;;)
+   {
+      spx_uint32_t i, end;
+#ifdef USE_PTHREADS
+      spx_pool_lock(batch->pool);
+#endif
+      i = batch->next;
+      end = batch->nb_items - i > chunk ? i + chunk : batch->nb_items;
+      batch->next = end;
+#ifdef USE_PTHREADS
+      spx_pool_unlock(batch->pool);
+#endif
+      if (i >= end)
+         break;
+      for (;i<end;i++)
+      {
+         const spx_uint32_t index = batch->items[i].index;
+         int ret = batch_job_process(batch, index);
+         /* The jobs are not run in order, so the errors are told apart by
+            the index of their job */
+         if (ret != RESAMPLER_ERR_SUCCESS && (err == RESAMPLER_ERR_SUCCESS || index < err_index))
+         {
+            err = ret;
+            err_index = index;
+         }
+      }
+   }
+#ifdef USE_PTHREADS
+   spx_pool_lock(batch->pool);
 #endif
+   if (err != RESAMPLER_ERR_SUCCESS && (batch->err == RESAMPLER_ERR_SUCCESS || err_index < batch->err_index))
+   {
+      batch->err = err;
+      batch->err_index = err_index;
+   }
+#ifdef USE_PTHREADS
+   spx_pool_unlock(batch->pool);
+#endif
+}
+
+static int batch_process(SpeexResamplerBatch *batch, spx_uint32_t nb_jobs)
 {
-   int j;
-   spx_uint32_t ilen = *in_len;
-   spx_uint32_t olen = *out_len;
-   spx_word16_t *x = st->mem + channel_index * st->mem_alloc_size;
-   const int filt_offs = st->filt_len - 1;
-   const spx_uint32_t xlen = st->mem_alloc_size - filt_offs;
-   const int istride = st->in_stride;
+   spx_uint32_t i;
 
-   if (st->magic_samples[channel_index])
-      olen -= speex_resampler_magic(st, channel_index, &out, olen);
-   if (! st->magic_samples[channel_index]) {
-      while (ilen && olen) {
-        spx_uint32_t ichunk = (ilen > xlen) ? xlen : ilen;
-        spx_uint32_t ochunk = olen;
+   if (nb_jobs > batch->alloc_size)
+   {
+      struct BatchItem *items = NULL;
+      if (nb_jobs <= INT_MAX/sizeof(struct BatchItem))
+         items = (struct BatchItem *)speex_realloc(batch->items, nb_jobs*sizeof(struct BatchItem));
+      if (!items)
+      {
+         /* Still do the work, just without the grouping */
+         int err = RESAMPLER_ERR_SUCCESS;
+         for (i=0;i<nb_jobs;i++)
+         {
+            int ret = batch_job_process(batch, i);
+            if (err == RESAMPLER_ERR_SUCCESS)
+               err = ret;
+         }
+         return err;
+      }
+      batch->items = items;
+      batch->alloc_size = nb_jobs;
+   }
 
-        if (in) {
-           for(j=0;j<ichunk;++j)
-              x[j+filt_offs]=in[j*istride];
-        } else {
-          for(j=0;j<ichunk;++j)
-            x[j+filt_offs]=0;
-        }
-        speex_resampler_process_native(st, channel_index, &ichunk, out, &ochunk);
-        ilen -= ichunk;
-        olen -= ochunk;
-        out += ochunk * st->out_stride;
-        if (in)
-           in += ichunk * istride;
+   for (i=0;i<nb_jobs;i++)
+   {
+      if (batch->segments)
+      {
+         batch->items[i].key = 0;
+      } else {
+         SpeexResamplerState *st = batch->jobs_int ? batch->jobs_int[i].st : batch->jobs_float[i].st;
+         batch->items[i].key = (size_t)st->sinc_table;
       }
+      batch->items[i].index = i;
    }
-   *in_len -= ilen;
-   *out_len -= olen;
-   return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
+   qsort(batch->items, nb_jobs, sizeof(struct BatchItem), batch_item_compare);
+
+   batch->nb_items = nb_jobs;
+   batch->next = 0;
+   batch->err = RESAMPLER_ERR_SUCCESS;
+#ifdef USE_PTHREADS
+   if (batch->pool && nb_jobs > (batch->segments ? 1 : BATCH_CHUNK))
+   {
+      spx_pool_run(batch->pool);
+      return batch->err;
+   }
+#endif
+   batch_run(batch, 0);
+   return batch->err;
 }
 
-#ifdef FIXED_POINT
-EXPORT int speex_resampler_process_float(SpeexResamplerState *st, spx_uint32_t channel_index, const float *in, spx_uint32_t *in_len, float *out, spx_uint32_t *out_len)
-#else
-EXPORT int speex_resampler_process_int(SpeexResamplerState *st, spx_uint32_t channel_index, const spx_int16_t *in, spx_uint32_t *in_len, spx_int16_t *out, spx_uint32_t *out_len)
+EXPORT SpeexResamplerBatch *speex_resampler_batch_init(int nb_threads, int *err)
+{
+   SpeexResamplerBatch *batch;
+
+   if (nb_threads < 0)
+   {
+      if (err)
+         *err = RESAMPLER_ERR_INVALID_ARG;
+      return NULL;
+   }
+   batch = (SpeexResamplerBatch *)speex_alloc(sizeof(SpeexResamplerBatch));
+   if (!batch)
+   {
+      if (err)
+         *err = RESAMPLER_ERR_ALLOC_FAILED;
+      return NULL;
+   }
+#ifdef USE_PTHREADS
+   if (nb_threads > 0)
+   {
+      batch->pool = spx_pool_create(nb_threads, batch_run, batch);
+      if (!batch->pool)
+      {
+         speex_resampler_batch_destroy(batch);
+         if (err)
+            *err = RESAMPLER_ERR_ALLOC_FAILED;
+         return NULL;
+      }
+      batch->nb_threads = nb_threads;
+   }
 #endif
+   if (err)
+      *err = RESAMPLER_ERR_SUCCESS;
+   return batch;
+}
+
+EXPORT void speex_resampler_batch_destroy(SpeexResamplerBatch *batch)
 {
-   int j;
-   const int istride_save = st->in_stride;
-   const int ostride_save = st->out_stride;
-   spx_uint32_t ilen = *in_len;
-   spx_uint32_t olen = *out_len;
-   spx_word16_t *x = st->mem + channel_index * st->mem_alloc_size;
-   const spx_uint32_t xlen = st->mem_alloc_size - (st->filt_len - 1);
-#ifdef VAR_ARRAYS
-   const unsigned int ylen = (olen < FIXED_STACK_ALLOC) ? olen : FIXED_STACK_ALLOC;
-   spx_word16_t ystack[ylen];
-#else
-   const unsigned int ylen = FIXED_STACK_ALLOC;
-   spx_word16_t ystack[FIXED_STACK_ALLOC];
+#ifdef USE_PTHREADS
+   if (batch->pool)
+      spx_pool_destroy(batch->pool);
 #endif
+   speex_free(batch->items);
+   speex_free(batch);
+}
 
-   st->out_stride = 1;
+EXPORT int speex_resampler_batch_process_int(SpeexResamplerBatch *batch, SpeexResamplerJob *jobs, spx_uint32_t nb_jobs)
+{
+   batch->jobs_int = jobs;
+   batch->jobs_float = NULL;
+   batch->segments = NULL;
+   return batch_process(batch, nb_jobs);
+}
 
-   while (ilen && olen) {
-     spx_word16_t *y = ystack;
-     spx_uint32_t ichunk = (ilen > xlen) ? xlen : ilen;
-     spx_uint32_t ochunk = (olen > ylen) ? ylen : olen;
-     spx_uint32_t omagic = 0;
-
-     if (st->magic_samples[channel_index]) {
-       omagic = speex_resampler_magic(st, channel_index, &y, ochunk);
-       ochunk -= omagic;
-       olen -= omagic;
-     }
-     if (! st->magic_samples[channel_index]) {
-       if (in) {
-         for(j=0;j<ichunk;++j)
-#ifdef FIXED_POINT
-           x[j+st->filt_len-1]=WORD2INT(in[j*istride_save]);
-#else
-           x[j+st->filt_len-1]=in[j*istride_save];
-#endif
-       } else {
-         for(j=0;j<ichunk;++j)
-           x[j+st->filt_len-1]=0;
-       }
+EXPORT int speex_resampler_batch_process_float(SpeexResamplerBatch *batch, SpeexResamplerJobFloat *jobs, spx_uint32_t nb_jobs)
+{
+   batch->jobs_int = NULL;
+   batch->jobs_float = jobs;
+   batch->segments = NULL;
+   return batch_process(batch, nb_jobs);
+}
 
-       speex_resampler_process_native(st, channel_index, &ichunk, y, &ochunk);
-     } else {
-       ichunk = 0;
-       ochunk = 0;
-     }
+EXPORT int speex_resampler_process_offline(SpeexResamplerState *st, SpeexResamplerBatch *batch, int in_format, const void *in, spx_uint32_t in_len, int out_format, void *out, spx_uint32_t *out_len)
+{
+   struct OfflineSegment *segs;
+   spx_uint32_t period_in, period_out, span, lead, periods, nb_segs, seg_periods;
+   spx_uint32_t i, total;
+   int threads = 0;
+   int err;
+   int j;
 
-     for (j=0;j<ochunk+omagic;++j)
-#ifdef FIXED_POINT
-        out[j*ostride_save] = ystack[j];
-#else
-        out[j*ostride_save] = WORD2INT(ystack[j]);
-#endif
+   if (!format_size(in_format) || !format_size(out_format) || st->asrc)
+      return RESAMPLER_ERR_INVALID_ARG;
 
-     ilen -= ichunk;
-     olen -= ochunk;
-     out += (ochunk+omagic) * ostride_save;
-     if (in)
-       in += ichunk * istride_save;
+   i = compute_gcd(st->num_rate, st->den_rate);
+   period_in = st->num_rate / i;
+   period_out = st->den_rate / i;
+   /* How far back the output can depend on the input, in input samples */
+   span = (st->filt_len + st->filt_delay + st->last_sample[0]) << st->nb_stages;
+   for (j=0;j<st->nb_stages;j++)
+      span += (spx_uint32_t)st->stages[j].len << j;
+   /* A period too long to count is as good as no period: one segment */
+   period_in = period_in <= UINT32_MAX >> st->nb_stages ? period_in << st->nb_stages : UINT32_MAX;
+   lead = span / period_in + 1;
+   periods = in_len / period_in;
+
+#ifdef USE_PTHREADS
+   if (batch)
+      threads = batch->nb_threads;
+#endif
+   nb_segs = 1;
+   if (threads > 0 && period_in < UINT32_MAX/OFFLINE_MIN_PERIODS/lead)
+   {
+      nb_segs = (threads+1)*OFFLINE_SEGMENTS_PER_THREAD;
+      if (periods / nb_segs < OFFLINE_MIN_PERIODS*lead)
+         nb_segs = periods / (OFFLINE_MIN_PERIODS*lead);
+      if (nb_segs < 1)
+         nb_segs = 1;
    }
-   st->out_stride = ostride_save;
-   *in_len -= ilen;
-   *out_len -= olen;
+   seg_periods = periods / nb_segs;
 
-   return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
-}
+   segs = (struct OfflineSegment *)speex_alloc(nb_segs*sizeof(struct OfflineSegment));
+   if (!segs)
+      return RESAMPLER_ERR_ALLOC_FAILED;
+   for (i=0;i<nb_segs;i++)
+   {
+      struct OfflineSegment *seg = &segs[i];
+      const spx_uint32_t start = i*seg_periods;
+      const spx_uint32_t back = start < lead ? start : lead;
+      const spx_uint32_t first = (start - back)*period_in;
 
-EXPORT int speex_resampler_process_interleaved_float(SpeexResamplerState *st, const float *in, spx_uint32_t *in_len, float *out, spx_uint32_t *out_len)
-{
-   spx_uint32_t i;
-   int istride_save, ostride_save;
-   spx_uint32_t bak_out_len = *out_len;
-   spx_uint32_t bak_in_len = *in_len;
-   istride_save = st->in_stride;
-   ostride_save = st->out_stride;
-   st->in_stride = st->out_stride = st->nb_channels;
-   for (i=0;i<st->nb_channels;i++)
+      /* Segments that start after the end of the output aren't needed */
+      if ((double)start*period_out >= *out_len)
+      {
+         nb_segs = i;
+         break;
+      }
+      seg->st = st;
+      seg->in_format = in_format;
+      seg->in = FORMAT_ADVANCE(in, in_format, (size_t)first*st->nb_channels);
+      seg->in_len = in_len - first;
+      seg->skip = back*period_out;
+      seg->out_format = out_format;
+      seg->out = FORMAT_ADVANCE(out, out_format, (size_t)start*period_out*st->nb_channels);
+      seg->out_len = *out_len - start*period_out;
+      if (i < nb_segs-1)
+      {
+         /* Enough input for the filters to reach the next segment */
+         if (in_len - (start+seg_periods)*period_in > span + period_in)
+            seg->in_len = (start+seg_periods)*period_in + span + period_in - first;
+         if ((double)seg_periods*period_out < seg->out_len)
+            seg->out_len = seg_periods*period_out;
+      }
+   }
+
+   if (batch)
    {
-      *out_len = bak_out_len;
-      *in_len = bak_in_len;
-      if (in != NULL)
-         speex_resampler_process_float(st, i, in+i, in_len, out+i, out_len);
-      else
-         speex_resampler_process_float(st, i, NULL, in_len, out+i, out_len);
+      batch->jobs_int = NULL;
+      batch->jobs_float = NULL;
+      batch->segments = segs;
+      err = batch_process(batch, nb_segs);
+      batch->segments = NULL;
+   } else {
+      err = nb_segs ? offline_segment_process(&segs[0]) : RESAMPLER_ERR_SUCCESS;
    }
-   st->in_stride = istride_save;
-   st->out_stride = ostride_save;
-   return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
-}
 
-EXPORT int speex_resampler_process_interleaved_int(SpeexResamplerState *st, const spx_int16_t *in, spx_uint32_t *in_len, spx_int16_t *out, spx_uint32_t *out_len)
-{
-   spx_uint32_t i;
-   int istride_save, ostride_save;
-   spx_uint32_t bak_out_len = *out_len;
-   spx_uint32_t bak_in_len = *in_len;
-   istride_save = st->in_stride;
-   ostride_save = st->out_stride;
-   st->in_stride = st->out_stride = st->nb_channels;
-   for (i=0;i<st->nb_channels;i++)
+   /* The output stops at the first segment that couldn't produce all of its
+      part, which can only happen at the end of the input */
+   total = 0;
+   for (i=0;i<nb_segs;i++)
    {
-      *out_len = bak_out_len;
-      *in_len = bak_in_len;
-      if (in != NULL)
-         speex_resampler_process_int(st, i, in+i, in_len, out+i, out_len);
-      else
-         speex_resampler_process_int(st, i, NULL, in_len, out+i, out_len);
+      total += segs[i].written;
+      if (segs[i].written < segs[i].out_len)
+         break;
    }
-   st->in_stride = istride_save;
-   st->out_stride = ostride_save;
-   return st->resampler_ptr == resampler_basic_zero ? RESAMPLER_ERR_ALLOC_FAILED : RESAMPLER_ERR_SUCCESS;
+   *out_len = total;
+   speex_free(segs);
+   return err;
 }
 
 EXPORT int speex_resampler_set_rate(SpeexResamplerState *st, spx_uint32_t in_rate, spx_uint32_t out_rate)
@@ -1095,18 +3237,6 @@ EXPORT void speex_resampler_get_rate(SpeexResamplerState *st, spx_uint32_t *in_r
    *out_rate = st->out_rate;
 }
 
-static inline spx_uint32_t compute_gcd(spx_uint32_t a, spx_uint32_t b)
-{
-   while (b != 0)
-   {
-      spx_uint32_t temp = a;
-
-      a = b;
-      b = temp % b;
-   }
-   return a;
-}
-
 EXPORT int speex_resampler_set_rate_frac(SpeexResamplerState *st, spx_uint32_t ratio_num, spx_uint32_t ratio_den, spx_uint32_t in_rate, spx_uint32_t out_rate)
 {
    spx_uint32_t fact;
@@ -1116,19 +3246,40 @@ EXPORT int speex_resampler_set_rate_frac(SpeexResamplerState *st, spx_uint32_t r
    if (ratio_num == 0 || ratio_den == 0)
       return RESAMPLER_ERR_INVALID_ARG;
 
-   if (st->in_rate == in_rate && st->out_rate == out_rate && st->num_rate == ratio_num && st->den_rate == ratio_den)
+   if (st->in_rate == in_rate && st->out_rate == out_rate && st->ratio_num == ratio_num && st->ratio_den == ratio_den)
+      return RESAMPLER_ERR_SUCCESS;
+
+   fact = compute_gcd(ratio_num, ratio_den);
+   ratio_num /= fact;
+   ratio_den /= fact;
+
+   if (st->asrc)
+   {
+      int nominal_changed = st->in_rate != in_rate || st->out_rate != out_rate;
+      if (in_rate == 0 || out_rate == 0)
+         return RESAMPLER_ERR_INVALID_ARG;
+      st->in_rate = in_rate;
+      st->out_rate = out_rate;
+      st->ratio_num = ratio_num;
+      st->ratio_den = ratio_den;
+      /* Only the nominal rates need a new filter */
+      if (nominal_changed && st->initialised)
+         return update_filter(st);
+      asrc_update_step(st);
       return RESAMPLER_ERR_SUCCESS;
+   }
+
+   /* The number of half-band stages is only revised by update_filter() */
+   if (ratio_den > (UINT32_MAX >> st->nb_stages))
+      halfband_set_count(st, 0);
 
    old_den = st->den_rate;
    st->in_rate = in_rate;
    st->out_rate = out_rate;
+   st->ratio_num = ratio_num;
+   st->ratio_den = ratio_den;
    st->num_rate = ratio_num;
-   st->den_rate = ratio_den;
-
-   fact = compute_gcd(st->num_rate, st->den_rate);
-
-   st->num_rate /= fact;
-   st->den_rate /= fact;
+   st->den_rate = ratio_den << st->nb_stages;
 
    if (old_den > 0)
    {
@@ -1147,10 +3298,70 @@ EXPORT int speex_resampler_set_rate_frac(SpeexResamplerState *st, spx_uint32_t r
    return RESAMPLER_ERR_SUCCESS;
 }
 
+EXPORT int speex_resampler_set_asrc(SpeexResamplerState *st, int enable)
+{
+   spx_uint32_t i;
+
+   enable = enable != 0;
+   if (st->asrc == enable)
+      return RESAMPLER_ERR_SUCCESS;
+   if (enable && (st->in_rate == 0 || st->out_rate == 0))
+      return RESAMPLER_ERR_INVALID_ARG;
+
+   halfband_set_count(st, 0);
+   /* The position within the current input sample is now (or no longer) a
+      32-bit fraction */
+   for (i=0;i<st->nb_channels;i++)
+   {
+      if (enable)
+         st->samp_frac_num[i] = (spx_uint32_t)(st->samp_frac_num[i]*(4294967296.0/st->den_rate));
+      else
+         st->samp_frac_num[i] = (spx_uint32_t)(st->samp_frac_num[i]*(st->ratio_den/4294967296.0));
+   }
+   st->asrc = enable;
+   return update_filter(st);
+}
+
+EXPORT void speex_resampler_get_asrc(SpeexResamplerState *st, int *enable)
+{
+   *enable = st->asrc;
+}
+
+EXPORT int speex_resampler_set_interleaved(SpeexResamplerState *st, int enable)
+{
+   st->interleaved = enable != 0;
+   return RESAMPLER_ERR_SUCCESS;
+}
+
+EXPORT void speex_resampler_get_interleaved(SpeexResamplerState *st, int *enable)
+{
+   *enable = st->interleaved;
+}
+
+EXPORT int speex_resampler_set_phase(SpeexResamplerState *st, int phase)
+{
+   int err;
+
+   if (phase != SPEEX_RESAMPLER_PHASE_LINEAR && phase != SPEEX_RESAMPLER_PHASE_MINIMUM)
+      return RESAMPLER_ERR_INVALID_ARG;
+   if (st->phase == phase)
+      return RESAMPLER_ERR_SUCCESS;
+   st->phase = phase;
+   err = update_filter(st);
+   /* The samples in memory aren't aligned for the new filter */
+   speex_resampler_reset_mem(st);
+   return err;
+}
+
+EXPORT void speex_resampler_get_phase(SpeexResamplerState *st, int *phase)
+{
+   *phase = st->phase;
+}
+
 EXPORT void speex_resampler_get_ratio(SpeexResamplerState *st, spx_uint32_t *ratio_num, spx_uint32_t *ratio_den)
 {
-   *ratio_num = st->num_rate;
-   *ratio_den = st->den_rate;
+   *ratio_num = st->ratio_num;
+   *ratio_den = st->ratio_den;
 }
 
 EXPORT int speex_resampler_set_quality(SpeexResamplerState *st, int quality)
@@ -1192,19 +3403,27 @@ EXPORT void speex_resampler_get_output_stride(SpeexResamplerState *st, spx_uint3
 
 EXPORT int speex_resampler_get_input_latency(SpeexResamplerState *st)
 {
-  return st->filt_len / 2;
+  int i;
+  int latency = st->filt_delay << st->nb_stages;
+  for (i=0;i<st->nb_stages;i++)
+    latency += ((st->stages[i].len - 1) / 2) << i;
+  return latency;
 }
 
 EXPORT int speex_resampler_get_output_latency(SpeexResamplerState *st)
 {
-  return ((st->filt_len / 2) * st->den_rate + (st->num_rate >> 1)) / st->num_rate;
+  return (speex_resampler_get_input_latency(st) * st->ratio_den + (st->ratio_num >> 1)) / st->ratio_num;
 }
 
 EXPORT int speex_resampler_skip_zeros(SpeexResamplerState *st)
 {
    spx_uint32_t i;
    for (i=0;i<st->nb_channels;i++)
-      st->last_sample[i] = st->filt_len/2;
+      st->last_sample[i] = st->filt_delay;
+   /* Only half of each half-band filter is primed with zeros, so that the
+      stages are aligned with the input too */
+   for (i=0;i<(spx_uint32_t)st->nb_stages;i++)
+      halfband_clear(st, i, (st->stages[i].len - 1) / 2);
    return RESAMPLER_ERR_SUCCESS;
 }
 
@@ -1217,8 +3436,15 @@ EXPORT int speex_resampler_reset_mem(SpeexResamplerState *st)
       st->magic_samples[i] = 0;
       st->samp_frac_num[i] = 0;
    }
-   for (i=0;i<st->nb_channels*(st->filt_len-1);i++)
-      st->mem[i] = 0;
+   for (i=0;i<st->nb_channels;i++)
+   {
+      spx_uint32_t j;
+      for (j=0;j<st->filt_len-1;j++)
+         st->mem[i*st->mem_alloc_size+j] = 0;
+   }
+   for (i=0;i<(spx_uint32_t)st->nb_stages;i++)
+      halfband_clear(st, i, st->stages[i].len - 1);
+   st->pull_fill = 0;
    return RESAMPLER_ERR_SUCCESS;
 }
 
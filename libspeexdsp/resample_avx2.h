@@ -0,0 +1,327 @@
+/* Copyright (C) 2026 Xiph.Org Foundation */
+/**
+   @file resample_avx2.h
+   @brief Resampler functions (AVX2/FMA version, selected at runtime)
+*/
+/*
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Xiph.org Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <immintrin.h>
+
+#ifdef FIXED_POINT
+/* 16-bit versions of the fixed-point SSE2 kernels in resample_sse.h, with
+   the same bit-exact results */
+
+AVX2_TARGET static inline spx_word32_t inner_product_single_avx2(const spx_word16_t *a, const spx_word16_t *b, unsigned int len)
+{
+   unsigned int i;
+   spx_word32_t ret;
+   __m256i sum1 = _mm256_setzero_si256();
+   __m128i sum;
+   for (i=0;i+16<=len;i+=16)
+      sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(a+i)), _mm256_loadu_si256((const __m256i *)(b+i))));
+   sum = _mm_add_epi32(_mm256_castsi256_si128(sum1), _mm256_extracti128_si256(sum1, 1));
+   if (i<len)
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(a+i)), _mm_loadu_si128((const __m128i *)(b+i))));
+   sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1,0,3,2)));
+   sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2,3,0,1)));
+   ret = _mm_cvtsi128_si32(sum);
+   return SATURATE32PSHR(ret, 15, 32767);
+}
+
+AVX2_TARGET static inline spx_word32_t interpolate_product_single_avx2(const spx_word16_t *a, const spx_word16_t *b, unsigned int len, const spx_uint32_t oversample, spx_word16_t *frac)
+{
+   unsigned int i;
+   spx_word32_t sum;
+   spx_word32_t accum[4];
+   __m256i acc = _mm256_setzero_si256();
+   __m128i acc128;
+   /* Four taps per iteration: taps i and i+1 interleaved in the low half,
+      taps i+2 and i+3 in the high half */
+   for(i=0;i<len;i+=4)
+   {
+      __m128i x = _mm_loadl_epi64((const __m128i *)(a+i));
+      __m128i t0 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(b+i*oversample)), _mm_loadl_epi64((const __m128i *)(b+(i+1)*oversample)));
+      __m128i t1 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(b+(i+2)*oversample)), _mm_loadl_epi64((const __m128i *)(b+(i+3)*oversample)));
+      __m256i t = _mm256_inserti128_si256(_mm256_castsi128_si256(t0), t1, 1);
+      __m256i xx = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_shuffle_epi32(x, 0x00)), _mm_shuffle_epi32(x, 0x55), 1);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(xx, t));
+   }
+   acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+   _mm_storeu_si128((__m128i *)accum, acc128);
+
+   sum = MULT16_32_Q15(frac[0],accum[0]) + MULT16_32_Q15(frac[1],accum[1]) + MULT16_32_Q15(frac[2],accum[2]) + MULT16_32_Q15(frac[3],accum[3]);
+   return SATURATE32PSHR(sum, 15, 32767);
+}
+
+/* The in-lane unpacks put channels 0-3 and 8-11 in the low sums and 4-7 and
+   12-15 in the high ones, which the in-lane pack puts back in order */
+AVX2_TARGET static inline void interleaved_product_single_avx2(const spx_word16_t *a, const spx_word16_t *b, unsigned int len, unsigned int channels, spx_word16_t *out)
+{
+   unsigned int c, j;
+   const __m256i one = _mm256_set1_epi32(1);
+   for (c=0;c+16<=channels;c+=16)
+   {
+      __m256i sum1 = _mm256_setzero_si256();
+      __m256i sum2 = _mm256_setzero_si256();
+      __m256i r;
+      for(j=0;j+2<=len;j+=2)
+      {
+         __m256i t = _mm256_unpacklo_epi16(_mm256_set1_epi16(a[j]), _mm256_set1_epi16(a[j+1]));
+         __m256i x0 = _mm256_loadu_si256((const __m256i *)(b+j*channels+c));
+         __m256i x1 = _mm256_loadu_si256((const __m256i *)(b+(j+1)*channels+c));
+         sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(t, _mm256_unpacklo_epi16(x0, x1)));
+         sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(t, _mm256_unpackhi_epi16(x0, x1)));
+      }
+      if (j<len)
+      {
+         __m256i t = _mm256_unpacklo_epi16(_mm256_set1_epi16(a[j]), _mm256_setzero_si256());
+         __m256i x0 = _mm256_loadu_si256((const __m256i *)(b+j*channels+c));
+         sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(t, _mm256_unpacklo_epi16(x0, x0)));
+         sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(t, _mm256_unpackhi_epi16(x0, x0)));
+      }
+      sum1 = _mm256_add_epi32(_mm256_srai_epi32(sum1, 15), _mm256_and_si256(_mm256_srai_epi32(sum1, 14), one));
+      sum2 = _mm256_add_epi32(_mm256_srai_epi32(sum2, 15), _mm256_and_si256(_mm256_srai_epi32(sum2, 14), one));
+      r = _mm256_max_epi16(_mm256_packs_epi32(sum1, sum2), _mm256_set1_epi16(-32767));
+      _mm256_storeu_si256((__m256i *)(out+c), r);
+   }
+   if (c+8<=channels)
+   {
+      __m128i sum1 = _mm_setzero_si128();
+      __m128i sum2 = _mm_setzero_si128();
+      for(j=0;j+2<=len;j+=2)
+      {
+         __m128i t = _mm_unpacklo_epi16(_mm_set1_epi16(a[j]), _mm_set1_epi16(a[j+1]));
+         __m128i x0 = _mm_loadu_si128((const __m128i *)(b+j*channels+c));
+         __m128i x1 = _mm_loadu_si128((const __m128i *)(b+(j+1)*channels+c));
+         sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(t, _mm_unpacklo_epi16(x0, x1)));
+         sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(t, _mm_unpackhi_epi16(x0, x1)));
+      }
+      if (j<len)
+      {
+         __m128i t = _mm_unpacklo_epi16(_mm_set1_epi16(a[j]), _mm_setzero_si128());
+         __m128i x0 = _mm_loadu_si128((const __m128i *)(b+j*channels+c));
+         sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(t, _mm_unpacklo_epi16(x0, x0)));
+         sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(t, _mm_unpackhi_epi16(x0, x0)));
+      }
+      _mm_storeu_si128((__m128i *)(out+c), saturate32pshr15_epi16(sum1, sum2));
+      c+=8;
+   }
+   for (;c<channels;c++)
+   {
+      spx_word32_t sum = 0;
+      for(j=0;j<len;j++)
+         sum += MULT16_16(a[j], b[j*channels+c]);
+      out[c] = SATURATE32PSHR(sum, 15, 32767);
+   }
+}
+
+#else /* FIXED_POINT */
+
+/* These mirror the SSE kernels in resample_sse.h, but process 8 floats per
+   instruction and use FMA where the rounding allows it. The lengths are the
+   same multiples of 8 that the SSE code relies on. */
+
+AVX2_TARGET static inline float inner_product_single_avx2(const float *a, const float *b, unsigned int len)
+{
+   unsigned int i = 0;
+   float ret;
+   __m256 sum1 = _mm256_setzero_ps();
+   __m256 sum2 = _mm256_setzero_ps();
+   __m128 sum;
+   for (;i+16<=len;i+=16)
+   {
+      sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i), sum1);
+      sum2 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8), sum2);
+   }
+   if (i<len)
+      sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i), sum1);
+   sum1 = _mm256_add_ps(sum1, sum2);
+   sum = _mm_add_ps(_mm256_castps256_ps128(sum1), _mm256_extractf128_ps(sum1, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+   _mm_store_ss(&ret, sum);
+   return ret;
+}
+
+AVX2_TARGET static inline float interpolate_product_single_avx2(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac)
+{
+   unsigned int i;
+   float ret;
+   __m256 sum1 = _mm256_setzero_ps();
+   __m128 sum;
+   /* Two taps per iteration: the low half holds tap i, the high half tap i+1 */
+   for(i=0;i<len;i+=2)
+   {
+      __m256 coef = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(b+i*oversample)), _mm_loadu_ps(b+(i+1)*oversample), 1);
+      __m256 x = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load1_ps(a+i)), _mm_load1_ps(a+i+1), 1);
+      sum1 = _mm256_fmadd_ps(x, coef, sum1);
+   }
+   sum = _mm_add_ps(_mm256_castps256_ps128(sum1), _mm256_extractf128_ps(sum1, 1));
+   sum = _mm_mul_ps(_mm_loadu_ps(frac), sum);
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+   _mm_store_ss(&ret, sum);
+   return ret;
+}
+
+/* Compensated product (see resample_sse.h). It doesn't use FMA, so that
+   the products are rounded as in the other kernels. */
+#define KAHAN_ADD_PS256(sum, comp, x) do { \
+      __m256 y_ = _mm256_sub_ps(x, comp); \
+      __m256 t_ = _mm256_add_ps(sum, y_); \
+      comp = _mm256_sub_ps(_mm256_sub_ps(t_, sum), y_); \
+      sum = t_; \
+   } while (0)
+
+AVX2_TARGET static inline float inner_product_compensated_avx2(const float *a, const float *b, unsigned int len)
+{
+   unsigned int i = 0;
+   float ret;
+   __m256 sum1 = _mm256_setzero_ps();
+   __m256 comp = _mm256_setzero_ps();
+   __m256 p;
+   __m128 sum;
+   for (;i+32<=len;i+=32)
+   {
+      p = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)),
+                                      _mm256_mul_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8))),
+                        _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a+i+16), _mm256_loadu_ps(b+i+16)),
+                                      _mm256_mul_ps(_mm256_loadu_ps(a+i+24), _mm256_loadu_ps(b+i+24))));
+      KAHAN_ADD_PS256(sum1, comp, p);
+   }
+   for (;i+16<=len;i+=16)
+   {
+      p = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)),
+                        _mm256_mul_ps(_mm256_loadu_ps(a+i+8), _mm256_loadu_ps(b+i+8)));
+      KAHAN_ADD_PS256(sum1, comp, p);
+   }
+   if (i<len)
+   {
+      p = _mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+      KAHAN_ADD_PS256(sum1, comp, p);
+   }
+   sum1 = _mm256_sub_ps(sum1, comp);
+   sum = _mm_add_ps(_mm256_castps256_ps128(sum1), _mm256_extractf128_ps(sum1, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+   _mm_store_ss(&ret, sum);
+   return ret;
+}
+
+/* Same double-precision accumulation as interpolate_product_double() in
+   resample_sse.h, on 4 doubles per instruction */
+AVX2_TARGET static inline double interpolate_product_double_avx2(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac)
+{
+   unsigned int i;
+   double ret;
+   __m256d sum1 = _mm256_setzero_pd();
+   __m256d sum2 = _mm256_setzero_pd();
+   __m128d sum;
+   for(i=0;i<len;i+=2)
+   {
+      sum1 = _mm256_add_pd(sum1, _mm256_cvtps_pd(_mm_mul_ps(_mm_load1_ps(a+i), _mm_loadu_ps(b+i*oversample))));
+      sum2 = _mm256_add_pd(sum2, _mm256_cvtps_pd(_mm_mul_ps(_mm_load1_ps(a+i+1), _mm_loadu_ps(b+(i+1)*oversample))));
+   }
+   sum1 = _mm256_add_pd(sum1, sum2);
+   sum1 = _mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(frac)), sum1);
+   sum = _mm_add_pd(_mm256_castpd256_pd128(sum1), _mm256_extractf128_pd(sum1, 1));
+   sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+   _mm_store_sd(&ret, sum);
+   return ret;
+}
+
+/* Taps are taken two at a time into separate accumulators to hide the FMA
+   latency when there are only a few channel blocks */
+AVX2_TARGET static inline void interleaved_product_single_avx2(const float *a, const float *b, unsigned int len, unsigned int channels, float *out)
+{
+   unsigned int c, j;
+   for (c=0;c+16<=channels;c+=16)
+   {
+      __m256 sum1 = _mm256_setzero_ps();
+      __m256 sum2 = _mm256_setzero_ps();
+      __m256 sum3 = _mm256_setzero_ps();
+      __m256 sum4 = _mm256_setzero_ps();
+      for(j=0;j+2<=len;j+=2)
+      {
+         const float *x = b+j*channels+c;
+         __m256 t0 = _mm256_broadcast_ss(a+j);
+         __m256 t1 = _mm256_broadcast_ss(a+j+1);
+         sum1 = _mm256_fmadd_ps(t0, _mm256_loadu_ps(x), sum1);
+         sum2 = _mm256_fmadd_ps(t0, _mm256_loadu_ps(x+8), sum2);
+         sum3 = _mm256_fmadd_ps(t1, _mm256_loadu_ps(x+channels), sum3);
+         sum4 = _mm256_fmadd_ps(t1, _mm256_loadu_ps(x+channels+8), sum4);
+      }
+      if (j<len)
+      {
+         __m256 t0 = _mm256_broadcast_ss(a+j);
+         sum1 = _mm256_fmadd_ps(t0, _mm256_loadu_ps(b+j*channels+c), sum1);
+         sum2 = _mm256_fmadd_ps(t0, _mm256_loadu_ps(b+j*channels+c+8), sum2);
+      }
+      _mm256_storeu_ps(out+c, _mm256_add_ps(sum1, sum3));
+      _mm256_storeu_ps(out+c+8, _mm256_add_ps(sum2, sum4));
+   }
+   if (c+8<=channels)
+   {
+      __m256 sum1 = _mm256_setzero_ps();
+      __m256 sum2 = _mm256_setzero_ps();
+      for(j=0;j+2<=len;j+=2)
+      {
+         sum1 = _mm256_fmadd_ps(_mm256_broadcast_ss(a+j), _mm256_loadu_ps(b+j*channels+c), sum1);
+         sum2 = _mm256_fmadd_ps(_mm256_broadcast_ss(a+j+1), _mm256_loadu_ps(b+(j+1)*channels+c), sum2);
+      }
+      if (j<len)
+         sum1 = _mm256_fmadd_ps(_mm256_broadcast_ss(a+j), _mm256_loadu_ps(b+j*channels+c), sum1);
+      _mm256_storeu_ps(out+c, _mm256_add_ps(sum1, sum2));
+      c+=8;
+   }
+   if (c+4<=channels)
+   {
+      __m128 sum1 = _mm_setzero_ps();
+      __m128 sum2 = _mm_setzero_ps();
+      for(j=0;j+2<=len;j+=2)
+      {
+         sum1 = _mm_fmadd_ps(_mm_broadcast_ss(a+j), _mm_loadu_ps(b+j*channels+c), sum1);
+         sum2 = _mm_fmadd_ps(_mm_broadcast_ss(a+j+1), _mm_loadu_ps(b+(j+1)*channels+c), sum2);
+      }
+      if (j<len)
+         sum1 = _mm_fmadd_ps(_mm_broadcast_ss(a+j), _mm_loadu_ps(b+j*channels+c), sum1);
+      _mm_storeu_ps(out+c, _mm_add_ps(sum1, sum2));
+      c+=4;
+   }
+   for (;c<channels;c++)
+   {
+      float sum = 0;
+      for(j=0;j<len;j++)
+         sum += a[j]*b[j*channels+c];
+      out[c] = sum;
+   }
+}
+
+#endif /* FIXED_POINT */
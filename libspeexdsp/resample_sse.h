@@ -34,6 +34,107 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifdef FIXED_POINT
+#include <emmintrin.h>
+
+/* The fixed-point kernels use _mm_madd_epi16, which multiplies pairs of
+   16-bit values and adds each pair into a 32-bit lane. The 32-bit sums wrap
+   exactly like the C accumulators, so the results are bit-exact with the
+   generic code. Lengths are multiples of 8, as for the float kernels. */
+
+/* SATURATE32PSHR(x, 15, 32767) on the eight lanes of lo and hi, packed to
+   16 bits. (x>>15) + ((x>>14)&1) is PSHR32(x, 15) without the add that could
+   overflow, and the packed result only needs -32768 raised to -32767. */
+static inline __m128i saturate32pshr15_epi16(__m128i lo, __m128i hi)
+{
+   const __m128i one = _mm_set1_epi32(1);
+   lo = _mm_add_epi32(_mm_srai_epi32(lo, 15), _mm_and_si128(_mm_srai_epi32(lo, 14), one));
+   hi = _mm_add_epi32(_mm_srai_epi32(hi, 15), _mm_and_si128(_mm_srai_epi32(hi, 14), one));
+   return _mm_max_epi16(_mm_packs_epi32(lo, hi), _mm_set1_epi16(-32767));
+}
+
+#define OVERRIDE_INNER_PRODUCT_SINGLE
+static inline spx_word32_t inner_product_single(const spx_word16_t *a, const spx_word16_t *b, unsigned int len)
+{
+   unsigned int i;
+   spx_word32_t ret;
+   __m128i sum1 = _mm_setzero_si128();
+   __m128i sum2 = _mm_setzero_si128();
+   for (i=0;i+16<=len;i+=16)
+   {
+      sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(a+i)), _mm_loadu_si128((const __m128i *)(b+i))));
+      sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(a+i+8)), _mm_loadu_si128((const __m128i *)(b+i+8))));
+   }
+   if (i<len)
+      sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(a+i)), _mm_loadu_si128((const __m128i *)(b+i))));
+   sum1 = _mm_add_epi32(sum1, sum2);
+   sum1 = _mm_add_epi32(sum1, _mm_shuffle_epi32(sum1, _MM_SHUFFLE(1,0,3,2)));
+   sum1 = _mm_add_epi32(sum1, _mm_shuffle_epi32(sum1, _MM_SHUFFLE(2,3,0,1)));
+   ret = _mm_cvtsi128_si32(sum1);
+   return SATURATE32PSHR(ret, 15, 32767);
+}
+
+#define OVERRIDE_INTERPOLATE_PRODUCT_SINGLE
+static inline spx_word32_t interpolate_product_single(const spx_word16_t *a, const spx_word16_t *b, unsigned int len, const spx_uint32_t oversample, spx_word16_t *frac)
+{
+   unsigned int i;
+   spx_word32_t sum;
+   spx_word32_t accum[4];
+   __m128i acc = _mm_setzero_si128();
+   /* Taps i and i+1 are interleaved so that each lane of the madd adds
+      a[i]*b[i*oversample+k] + a[i+1]*b[(i+1)*oversample+k] into accum[k] */
+   for(i=0;i<len;i+=4)
+   {
+      __m128i x = _mm_loadl_epi64((const __m128i *)(a+i));
+      __m128i t0 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(b+i*oversample)), _mm_loadl_epi64((const __m128i *)(b+(i+1)*oversample)));
+      __m128i t1 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(b+(i+2)*oversample)), _mm_loadl_epi64((const __m128i *)(b+(i+3)*oversample)));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi32(x, 0x00), t0));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi32(x, 0x55), t1));
+   }
+   _mm_storeu_si128((__m128i *)accum, acc);
+
+   sum = MULT16_32_Q15(frac[0],accum[0]) + MULT16_32_Q15(frac[1],accum[1]) + MULT16_32_Q15(frac[2],accum[2]) + MULT16_32_Q15(frac[3],accum[3]);
+   return SATURATE32PSHR(sum, 15, 32767);
+}
+
+#define OVERRIDE_INTERLEAVED_PRODUCT_SINGLE
+static inline void interleaved_product_single(const spx_word16_t *a, const spx_word16_t *b, unsigned int len, unsigned int channels, spx_word16_t *out)
+{
+  unsigned int c, j;
+  for (c=0;c+8<=channels;c+=8)
+  {
+    __m128i sum1 = _mm_setzero_si128();
+    __m128i sum2 = _mm_setzero_si128();
+    /* Frames j and j+1 are interleaved channel by channel and multiplied
+       by the (a[j], a[j+1]) pair */
+    for(j=0;j+2<=len;j+=2)
+    {
+      __m128i t = _mm_unpacklo_epi16(_mm_set1_epi16(a[j]), _mm_set1_epi16(a[j+1]));
+      __m128i x0 = _mm_loadu_si128((const __m128i *)(b+j*channels+c));
+      __m128i x1 = _mm_loadu_si128((const __m128i *)(b+(j+1)*channels+c));
+      sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(t, _mm_unpacklo_epi16(x0, x1)));
+      sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(t, _mm_unpackhi_epi16(x0, x1)));
+    }
+    if (j<len)
+    {
+      __m128i t = _mm_unpacklo_epi16(_mm_set1_epi16(a[j]), _mm_setzero_si128());
+      __m128i x0 = _mm_loadu_si128((const __m128i *)(b+j*channels+c));
+      sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(t, _mm_unpacklo_epi16(x0, x0)));
+      sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(t, _mm_unpackhi_epi16(x0, x0)));
+    }
+    _mm_storeu_si128((__m128i *)(out+c), saturate32pshr15_epi16(sum1, sum2));
+  }
+  for (;c<channels;c++)
+  {
+    spx_word32_t sum = 0;
+    for(j=0;j<len;j++)
+      sum += MULT16_16(a[j], b[j*channels+c]);
+    out[c] = SATURATE32PSHR(sum, 15, 32767);
+  }
+}
+
+#else /* FIXED_POINT */
+
 #include <xmmintrin.h>
 
 #define OVERRIDE_INNER_PRODUCT_SINGLE
@@ -71,34 +172,90 @@ static inline float interpolate_product_single(const float *a, const float *b, u
    return ret;
 }
 
-#ifdef USE_SSE2
-#include <emmintrin.h>
-#define OVERRIDE_INNER_PRODUCT_DOUBLE
+#define OVERRIDE_INTERLEAVED_PRODUCT_SINGLE
+static inline void interleaved_product_single(const float *a, const float *b, unsigned int len, unsigned int channels, float *out)
+{
+  unsigned int c, j;
+  for (c=0;c+8<=channels;c+=8)
+  {
+    __m128 sum1 = _mm_setzero_ps();
+    __m128 sum2 = _mm_setzero_ps();
+    for(j=0;j<len;j++)
+    {
+      __m128 t = _mm_load1_ps(a+j);
+      sum1 = _mm_add_ps(sum1, _mm_mul_ps(t, _mm_loadu_ps(b+j*channels+c)));
+      sum2 = _mm_add_ps(sum2, _mm_mul_ps(t, _mm_loadu_ps(b+j*channels+c+4)));
+    }
+    _mm_storeu_ps(out+c, sum1);
+    _mm_storeu_ps(out+c+4, sum2);
+  }
+  if (c+4<=channels)
+  {
+    __m128 sum = _mm_setzero_ps();
+    for(j=0;j<len;j++)
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_load1_ps(a+j), _mm_loadu_ps(b+j*channels+c)));
+    _mm_storeu_ps(out+c, sum);
+    c+=4;
+  }
+  for (;c<channels;c++)
+  {
+    float sum = 0;
+    for(j=0;j<len;j++)
+      sum += a[j]*b[j*channels+c];
+    out[c] = sum;
+  }
+}
+
+/* Compensated product, used instead of double-precision accumulation for the
+   direct table at the higher qualities. The products are summed pairwise
+   within blocks and the block sums are accumulated with Kahan's compensated
+   summation, so the rounding error doesn't grow with the filter length. It
+   stays close to that of a double accumulator, with twice as many lanes per
+   instruction. */
+#define OVERRIDE_COMPENSATED_PRODUCTS
+
+#define KAHAN_ADD_PS(sum, comp, x) do { \
+      __m128 y_ = _mm_sub_ps(x, comp); \
+      __m128 t_ = _mm_add_ps(sum, y_); \
+      comp = _mm_sub_ps(_mm_sub_ps(t_, sum), y_); \
+      sum = t_; \
+   } while (0)
 
-static inline double inner_product_double(const float *a, const float *b, unsigned int len)
+static inline float inner_product_compensated(const float *a, const float *b, unsigned int len)
 {
-   int i;
-   double ret;
-   __m128d sum = _mm_setzero_pd();
-   __m128 t;
-   for (i=0;i<len;i+=8)
+   unsigned int i = 0;
+   float ret;
+   __m128 sum = _mm_setzero_ps();
+   __m128 comp = _mm_setzero_ps();
+   __m128 p[8];
+   for (;i+32<=len;i+=32)
    {
-      t = _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i));
-      sum = _mm_add_pd(sum, _mm_cvtps_pd(t));
-      sum = _mm_add_pd(sum, _mm_cvtps_pd(_mm_movehl_ps(t, t)));
-
-      t = _mm_mul_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4));
-      sum = _mm_add_pd(sum, _mm_cvtps_pd(t));
-      sum = _mm_add_pd(sum, _mm_cvtps_pd(_mm_movehl_ps(t, t)));
+      unsigned int k;
+      for (k=0;k<8;k++)
+         p[k] = _mm_mul_ps(_mm_loadu_ps(a+i+4*k), _mm_loadu_ps(b+i+4*k));
+      p[0] = _mm_add_ps(_mm_add_ps(_mm_add_ps(p[0], p[1]), _mm_add_ps(p[2], p[3])),
+                        _mm_add_ps(_mm_add_ps(p[4], p[5]), _mm_add_ps(p[6], p[7])));
+      KAHAN_ADD_PS(sum, comp, p[0]);
+   }
+   for (;i<len;i+=8)
+   {
+      p[0] = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)), _mm_mul_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4)));
+      KAHAN_ADD_PS(sum, comp, p[0]);
    }
-   sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
-   _mm_store_sd(&ret, sum);
+   sum = _mm_sub_ps(sum, comp);
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+   _mm_store_ss(&ret, sum);
    return ret;
 }
 
+#ifdef USE_SSE2
+#include <emmintrin.h>
+/* The interpolated table keeps a double-precision accumulator: its strided
+   loads bound the speed, so compensation wouldn't make it any faster */
 #define OVERRIDE_INTERPOLATE_PRODUCT_DOUBLE
 static inline double interpolate_product_double(const float *a, const float *b, unsigned int len, const spx_uint32_t oversample, float *frac) {
-  int i;
+  unsigned int i;
   double ret;
   __m128d sum;
   __m128d sum1 = _mm_setzero_pd();
@@ -124,5 +281,6 @@ static inline double interpolate_product_double(const float *a, const float *b,
   _mm_store_sd(&ret, sum);
   return ret;
 }
+#endif /* USE_SSE2 */
 
-#endif
+#endif /* FIXED_POINT */
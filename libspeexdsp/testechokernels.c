@@ -0,0 +1,440 @@
+/* Copyright (C) 2026 Xiph.Org Foundation
+
+   File: testechokernels.c
+   Checks and times the vectorized spectral functions of the echo canceller
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+   INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+   STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+   POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Every kernel of mdf_sse.h and mdf_avx2.h, for both the packed and the
+   split layouts, is run on random spectra and compared with a plain C copy
+   of the generic code in mdf.c. The largest
+   difference is printed relative to the largest output, and must be zero
+   for SSE. The times are the best of a few runs, per call. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "arch.h"
+#include "pseudofloat.h"
+
+#ifdef FIXED_POINT
+
+int main(void)
+{
+   printf("The vectorized echo canceller kernels are only built for floating point\n");
+   return 0;
+}
+
+#else
+
+#ifdef USE_SSE
+#include "mdf_sse.h"
+#endif
+
+#ifdef USE_AVX2
+#include "x86cpu.h"
+#include "mdf_avx2.h"
+#endif
+
+#define RUNS 5
+#define MAX_N 2080
+#define MAX_M 64
+
+/* Frame sizes (N is twice that) and number of partitions */
+static const int sizes[][2] = {
+   {64, 8}, {160, 10}, {256, 16}, {480, 50}, {1024, 8}
+};
+
+static void power_spectrum_c(const float *X, float *ps, int N)
+{
+   int i, j;
+   ps[0]=X[0]*X[0];
+   for (i=1,j=1;i<N-1;i+=2,j++)
+      ps[j] = X[i]*X[i] + X[i+1]*X[i+1];
+   ps[j]=X[i]*X[i];
+}
+
+static void power_spectrum_accum_c(const float *X, float *ps, int N)
+{
+   int i, j;
+   ps[0]+=X[0]*X[0];
+   for (i=1,j=1;i<N-1;i+=2,j++)
+      ps[j] += X[i]*X[i] + X[i+1]*X[i+1];
+   ps[j]+=X[i]*X[i];
+}
+
+static void spectral_mul_accum_c(const float *X, int start, int R, const float *Y, float *acc, int N, int M)
+{
+   int i,j;
+   const float *Xb = X + start*N;
+   for (i=0;i<N;i++)
+      acc[i] = 0;
+   for (j=0;j<M;j++)
+   {
+      acc[0] += Xb[0]*Y[0];
+      for (i=1;i<N-1;i+=2)
+      {
+         acc[i] += (Xb[i]*Y[i] - Xb[i+1]*Y[i+1]);
+         acc[i+1] += (Xb[i+1]*Y[i] + Xb[i]*Y[i+1]);
+      }
+      acc[i] += Xb[i]*Y[i];
+      Xb += N;
+      if (Xb == X + R*N)
+         Xb = X;
+      Y += N;
+   }
+}
+
+static void weighted_spectral_mul_conj_c(const float *w, const float p, const float *X, const float *Y, float *prod, int N)
+{
+   int i, j;
+   float W;
+   W = p*w[0];
+   prod[0] += W*(X[0]*Y[0]);
+   for (i=1,j=1;i<N-1;i+=2,j++)
+   {
+      W = p*w[j];
+      prod[i] += W*(X[i]*Y[i] + X[i+1]*Y[i+1]);
+      prod[i+1] += W*(-X[i+1]*Y[i] + X[i]*Y[i+1]);
+   }
+   W = p*w[j];
+   prod[i] += W*(X[i]*Y[i]);
+}
+
+/* Split spectra, padded like in mdf.c */
+#define SPLIT_SIZE(frame_size) (2*(((frame_size)+8)&~7))
+
+static void power_spectrum_split_c(const float *X, float *ps, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i++)
+      ps[i] = X[i]*X[i] + X[B+i]*X[B+i];
+}
+
+static void power_spectrum_accum_split_c(const float *X, float *ps, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i++)
+      ps[i] += X[i]*X[i] + X[B+i]*X[B+i];
+}
+
+static void spectral_mul_accum_split_c(const float *X, int start, int R, const float *Y, float *acc, int N, int M)
+{
+   int i,j;
+   const int B = N/2;
+   const float *Xb = X + start*N;
+   for (i=0;i<N;i++)
+      acc[i] = 0;
+   for (j=0;j<M;j++)
+   {
+      for (i=0;i<B;i++)
+      {
+         acc[i] += (Xb[i]*Y[i] - Xb[B+i]*Y[B+i]);
+         acc[B+i] += (Xb[B+i]*Y[i] + Xb[i]*Y[B+i]);
+      }
+      Xb += N;
+      if (Xb == X + R*N)
+         Xb = X;
+      Y += N;
+   }
+}
+
+static void weighted_spectral_mul_conj_split_c(const float *w, const float p, const float *X, const float *Y, float *prod, int N)
+{
+   int i;
+   const int B = N/2;
+   for (i=0;i<B;i++)
+   {
+      float W = p*w[i];
+      prod[i] += W*(X[i]*Y[i] + X[B+i]*Y[B+i]);
+      prod[B+i] += W*(X[i]*Y[B+i] - X[B+i]*Y[i]);
+   }
+}
+
+enum {
+   KERNEL_POWER,
+   KERNEL_POWER_ACCUM,
+   KERNEL_MUL_ACCUM,
+   KERNEL_MUL_CONJ,
+   KERNEL_POWER_SPLIT,
+   KERNEL_POWER_ACCUM_SPLIT,
+   KERNEL_MUL_ACCUM_SPLIT,
+   KERNEL_MUL_CONJ_SPLIT,
+   NB_KERNELS
+};
+
+static const char *kernel_names[NB_KERNELS] = {
+   "power_spectrum", "power_spectrum_accum", "spectral_mul_accum", "weighted_spectral_mul_conj",
+   "power_spectrum_split", "power_spectrum_accum_split", "spectral_mul_accum_split", "weighted_spectral_mul_conj_split"
+};
+
+enum {
+   IMPL_C,
+   IMPL_SSE,
+   IMPL_AVX2,
+   NB_IMPLS
+};
+
+static float X[(MAX_M+1)*MAX_N], Y[MAX_M*MAX_N], w[MAX_N/2+1];
+static float out[NB_IMPLS][MAX_N], init[MAX_N];
+
+static double now(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+/* Runs one kernel as mdf.c does: the spectral products go over the M
+   partitions, starting in the middle of the history ring */
+static void run(int impl, int kernel, int N, int M, float *dst)
+{
+   int j;
+   switch (kernel)
+   {
+   case KERNEL_POWER:
+      for (j=0;j<M;j++)
+      {
+         if (impl == IMPL_C)
+            power_spectrum_c(X+j*N, dst, N);
+#ifdef USE_SSE
+         else if (impl == IMPL_SSE)
+            power_spectrum(X+j*N, dst, N);
+#endif
+#ifdef USE_AVX2
+         else
+            power_spectrum_avx2(X+j*N, dst, N);
+#endif
+      }
+      break;
+   case KERNEL_POWER_ACCUM:
+      for (j=0;j<M;j++)
+      {
+         if (impl == IMPL_C)
+            power_spectrum_accum_c(X+j*N, dst, N);
+#ifdef USE_SSE
+         else if (impl == IMPL_SSE)
+            power_spectrum_accum(X+j*N, dst, N);
+#endif
+#ifdef USE_AVX2
+         else
+            power_spectrum_accum_avx2(X+j*N, dst, N);
+#endif
+      }
+      break;
+   case KERNEL_MUL_ACCUM:
+      if (impl == IMPL_C)
+         spectral_mul_accum_c(X, M/2, M+1, Y, dst, N, M);
+#ifdef USE_SSE
+      else if (impl == IMPL_SSE)
+         spectral_mul_accum(X, M/2, M+1, Y, dst, N, M);
+#endif
+#ifdef USE_AVX2
+      else
+         spectral_mul_accum_avx2(X, M/2, M+1, Y, dst, N, M);
+#endif
+      break;
+   case KERNEL_MUL_CONJ:
+      for (j=0;j<M;j++)
+      {
+         if (impl == IMPL_C)
+            weighted_spectral_mul_conj_c(w, 1.f/M, X+j*N, Y+j*N, dst, N);
+#ifdef USE_SSE
+         else if (impl == IMPL_SSE)
+            weighted_spectral_mul_conj(w, 1.f/M, X+j*N, Y+j*N, dst, N);
+#endif
+#ifdef USE_AVX2
+         else
+            weighted_spectral_mul_conj_avx2(w, 1.f/M, X+j*N, Y+j*N, dst, N);
+#endif
+      }
+      break;
+   case KERNEL_POWER_SPLIT:
+      for (j=0;j<M;j++)
+      {
+         if (impl == IMPL_C)
+            power_spectrum_split_c(X+j*N, dst, N);
+#ifdef USE_SSE
+         else if (impl == IMPL_SSE)
+            power_spectrum_split(X+j*N, dst, N);
+#endif
+#ifdef USE_AVX2
+         else
+            power_spectrum_split_avx2(X+j*N, dst, N);
+#endif
+      }
+      break;
+   case KERNEL_POWER_ACCUM_SPLIT:
+      for (j=0;j<M;j++)
+      {
+         if (impl == IMPL_C)
+            power_spectrum_accum_split_c(X+j*N, dst, N);
+#ifdef USE_SSE
+         else if (impl == IMPL_SSE)
+            power_spectrum_accum_split(X+j*N, dst, N);
+#endif
+#ifdef USE_AVX2
+         else
+            power_spectrum_accum_split_avx2(X+j*N, dst, N);
+#endif
+      }
+      break;
+   case KERNEL_MUL_ACCUM_SPLIT:
+      if (impl == IMPL_C)
+         spectral_mul_accum_split_c(X, M/2, M+1, Y, dst, N, M);
+#ifdef USE_SSE
+      else if (impl == IMPL_SSE)
+         spectral_mul_accum_split(X, M/2, M+1, Y, dst, N, M);
+#endif
+#ifdef USE_AVX2
+      else
+         spectral_mul_accum_split_avx2(X, M/2, M+1, Y, dst, N, M);
+#endif
+      break;
+   case KERNEL_MUL_CONJ_SPLIT:
+      for (j=0;j<M;j++)
+      {
+         if (impl == IMPL_C)
+            weighted_spectral_mul_conj_split_c(w, 1.f/M, X+j*N, Y+j*N, dst, N);
+#ifdef USE_SSE
+         else if (impl == IMPL_SSE)
+            weighted_spectral_mul_conj_split(w, 1.f/M, X+j*N, Y+j*N, dst, N);
+#endif
+#ifdef USE_AVX2
+         else
+            weighted_spectral_mul_conj_split_avx2(w, 1.f/M, X+j*N, Y+j*N, dst, N);
+#endif
+      }
+      break;
+   }
+}
+
+/* Returns the time of one run in microseconds, leaving its output in dst */
+static double time_kernel(int impl, int kernel, int N, int M, float *dst)
+{
+   int r, i;
+   double best = 1e30;
+   int loops = 1 + 20000000/(N*M);
+   for (r=0;r<RUNS;r++)
+   {
+      double t = now();
+      for (i=0;i<loops;i++)
+         run(impl, kernel, N, M, dst);
+      t = now() - t;
+      if (t < best)
+         best = t;
+   }
+   /* The output from the last call is what gets checked */
+   for (i=0;i<N;i++)
+      dst[i] = init[i];
+   run(impl, kernel, N, M, dst);
+   return 1e6*best/loops;
+}
+
+int main(void)
+{
+   int s, i, kernel, impl;
+   int have[NB_IMPLS] = {1, 0, 0};
+   int failed = 0;
+
+#ifdef USE_SSE
+   have[IMPL_SSE] = 1;
+#endif
+#ifdef USE_AVX2
+   have[IMPL_AVX2] = speex_cpu_has_avx2();
+#endif
+
+   srand(1);
+   for (i=0;i<(MAX_M+1)*MAX_N;i++)
+      X[i] = 2000.f*rand()/RAND_MAX - 1000.f;
+   for (i=0;i<MAX_M*MAX_N;i++)
+      Y[i] = 2.f*rand()/RAND_MAX - 1.f;
+   for (i=0;i<=MAX_N/2;i++)
+      w[i] = 1e-6f*rand()/RAND_MAX;
+   for (i=0;i<MAX_N;i++)
+      init[i] = 2.f*rand()/RAND_MAX - 1.f;
+
+   printf("%-32s %5s %3s %10s %10s %10s %10s %10s\n", "kernel", "N", "M",
+          "C (us)", "SSE (us)", "AVX2 (us)", "SSE err", "AVX2 err");
+   for (kernel=0;kernel<NB_KERNELS;kernel++)
+   {
+      for (s=0;s<(int)(sizeof(sizes)/sizeof(sizes[0]));s++)
+      {
+         const int N = kernel >= KERNEL_POWER_SPLIT ? SPLIT_SIZE(sizes[s][0]) : 2*sizes[s][0];
+         const int M = sizes[s][1];
+         double t[NB_IMPLS], err[NB_IMPLS];
+         for (impl=0;impl<NB_IMPLS;impl++)
+         {
+            float peak = 0, diff = 0;
+            t[impl] = err[impl] = -1;
+            if (!have[impl])
+               continue;
+            t[impl] = time_kernel(impl, kernel, N, M, out[impl]);
+            for (i=0;i<N;i++)
+            {
+               if (fabs(out[IMPL_C][i]) > peak)
+                  peak = fabs(out[IMPL_C][i]);
+               if (fabs(out[impl][i] - out[IMPL_C][i]) > diff)
+                  diff = fabs(out[impl][i] - out[IMPL_C][i]);
+            }
+            err[impl] = diff/peak;
+         }
+         if (err[IMPL_SSE] > 0 || err[IMPL_AVX2] > 1e-5)
+            failed = 1;
+         printf("%-32s %5d %3d", kernel_names[kernel], N, M);
+         for (impl=0;impl<NB_IMPLS;impl++)
+         {
+            if (t[impl] < 0)
+               printf(" %10s", "-");
+            else
+               printf(" %10.3f", t[impl]);
+         }
+         for (impl=IMPL_SSE;impl<NB_IMPLS;impl++)
+         {
+            if (err[impl] < 0)
+               printf(" %10s", "-");
+            else
+               printf(" %10.2g", err[impl]);
+         }
+         printf("\n");
+      }
+   }
+   if (failed)
+      printf("Vectorized kernels differ from the C code\n");
+   return failed;
+}
+
+#endif
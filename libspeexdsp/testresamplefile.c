@@ -0,0 +1,333 @@
+/* Copyright (C) 2026 Xiph.Org Foundation
+
+   File: testresamplefile.c
+   Resamples a WAV or raw file with speex_resampler_process_offline()
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+   INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+   STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+   POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Both files are memory-mapped, so that the whole recording is handed to
+   the resampler in one call and only the pages being worked on need to be
+   in memory. The input is PCM (16, 24 or 32 bits) or float WAV, or raw
+   16-bit samples with -r and -c, and the output has the same format. The
+   samples are assumed to be little-endian, like the host. The filter delay
+   is skipped, so the output is aligned with the input. The output is then
+   checked against a serial conversion of the same input, a block at a time,
+   and the program fails if they differ. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "speex/speex_resampler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WAV_HEADER_SIZE 44
+#define CHECK_BLOCK 4096
+
+struct AudioFormat {
+   spx_uint32_t rate;
+   spx_uint32_t channels;
+   int format;           /* SPEEX_RESAMPLER_FORMAT_* */
+   int bytes;            /* Per sample */
+};
+
+static spx_uint32_t get_le(const unsigned char *p, int n)
+{
+   spx_uint32_t x = 0;
+   while (n--)
+      x = (x << 8) | p[n];
+   return x;
+}
+
+static void put_le(unsigned char *p, spx_uint32_t x, int n)
+{
+   int i;
+   for (i=0;i<n;i++)
+      p[i] = (x >> (8*i)) & 0xff;
+}
+
+/* Finds the format and the data chunk of a WAV file. Returns the offset of
+   the samples and sets *size to their size in bytes, or returns 0. */
+static size_t parse_wav(const unsigned char *p, size_t len, struct AudioFormat *fmt, size_t *size)
+{
+   size_t pos = 12;
+   int have_fmt = 0;
+
+   if (len < 12 || memcmp(p, "RIFF", 4) || memcmp(p+8, "WAVE", 4))
+      return 0;
+   while (pos + 8 <= len)
+   {
+      const spx_uint32_t chunk = get_le(p+pos+4, 4);
+      if (!memcmp(p+pos, "fmt ", 4) && chunk >= 16 && pos + 8 + chunk <= len)
+      {
+         const unsigned char *f = p + pos + 8;
+         int tag = get_le(f, 2);
+         int bits = get_le(f+14, 2);
+         if (tag == 0xfffe && chunk >= 40)
+            tag = get_le(f+24, 2);
+         fmt->channels = get_le(f+2, 2);
+         fmt->rate = get_le(f+4, 4);
+         fmt->bytes = bits/8;
+         if (tag == 1 && bits == 16)
+            fmt->format = SPEEX_RESAMPLER_FORMAT_S16;
+         else if (tag == 1 && bits == 24)
+            fmt->format = SPEEX_RESAMPLER_FORMAT_S24;
+         else if (tag == 1 && bits == 32)
+            fmt->format = SPEEX_RESAMPLER_FORMAT_S32;
+         else if (tag == 3 && bits == 32)
+            fmt->format = SPEEX_RESAMPLER_FORMAT_FLOAT;
+         else
+            return 0;
+         have_fmt = 1;
+      } else if (!memcmp(p+pos, "data", 4) && have_fmt) {
+         *size = chunk;
+         if (*size > len - pos - 8)
+            *size = len - pos - 8;
+         return pos + 8;
+      }
+      pos += 8 + chunk + (chunk&1);
+   }
+   return 0;
+}
+
+static void write_wav_header(unsigned char *p, const struct AudioFormat *fmt, size_t size)
+{
+   memcpy(p, "RIFF", 4);
+   put_le(p+4, (spx_uint32_t)(size + WAV_HEADER_SIZE - 8), 4);
+   memcpy(p+8, "WAVEfmt ", 8);
+   put_le(p+16, 16, 4);
+   put_le(p+20, fmt->format == SPEEX_RESAMPLER_FORMAT_FLOAT ? 3 : 1, 2);
+   put_le(p+22, fmt->channels, 2);
+   put_le(p+24, fmt->rate, 4);
+   put_le(p+28, fmt->rate*fmt->channels*fmt->bytes, 4);
+   put_le(p+32, fmt->channels*fmt->bytes, 2);
+   put_le(p+34, 8*fmt->bytes, 2);
+   memcpy(p+36, "data", 4);
+   put_le(p+40, (spx_uint32_t)size, 4);
+}
+
+static double now(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+/* Resamples in with st, which must not have been used yet, and compares the
+   result with out. Returns the number of samples (per channel) that match
+   before the first difference, which is out_len if there is none. */
+static spx_uint32_t check_serial(SpeexResamplerState *st, const struct AudioFormat *in_fmt, const unsigned char *in, spx_uint32_t in_len,
+                                 const struct AudioFormat *out_fmt, const unsigned char *out, spx_uint32_t out_len)
+{
+   const size_t in_frame = in_fmt->channels*in_fmt->bytes;
+   const size_t out_frame = out_fmt->channels*out_fmt->bytes;
+   unsigned char *buf = (unsigned char *)malloc(CHECK_BLOCK*out_frame);
+   spx_uint32_t done = 0;
+
+   if (!buf)
+      return 0;
+   while (done < out_len)
+   {
+      spx_uint32_t ilen = in_len, olen = out_len - done, i;
+      if (olen > CHECK_BLOCK)
+         olen = CHECK_BLOCK;
+      speex_resampler_process_interleaved_format(st, in_fmt->format, in, &ilen, out_fmt->format, buf, &olen);
+      for (i=0;i<olen;i++)
+      {
+         if (memcmp(buf + i*out_frame, out + (done+i)*out_frame, out_frame))
+            break;
+      }
+      done += i;
+      if (i < olen || olen == 0)
+         break;
+      in += ilen*in_frame;
+      in_len -= ilen;
+   }
+   free(buf);
+   return done;
+}
+
+static void usage(void)
+{
+   fprintf(stderr, "usage: testresamplefile [-q quality] [-t threads] [-r rate -c channels] input output out_rate\n");
+   fprintf(stderr, "  -r and -c read raw 16-bit input (and write raw output) instead of WAV\n");
+   exit(1);
+}
+
+int main(int argc, char **argv)
+{
+   struct AudioFormat in_fmt, out_fmt;
+   int quality = 8;
+   int threads = 0;
+   int raw = 0;
+   int i;
+   int err;
+   int in_fd, out_fd;
+   struct stat sb;
+   unsigned char *in_map, *out_map;
+   size_t in_offset, in_size, out_offset, out_size, map_size;
+   spx_uint32_t in_len, out_len, same;
+   double max_len, t;
+   SpeexResamplerState *st;
+   SpeexResamplerBatch *batch;
+
+   memset(&in_fmt, 0, sizeof(in_fmt));
+   in_fmt.format = SPEEX_RESAMPLER_FORMAT_S16;
+   in_fmt.bytes = 2;
+   for (i=1;i<argc-3;i+=2)
+   {
+      if (!strcmp(argv[i], "-q"))
+         quality = atoi(argv[i+1]);
+      else if (!strcmp(argv[i], "-t"))
+         threads = atoi(argv[i+1]);
+      else if (!strcmp(argv[i], "-r"))
+         in_fmt.rate = atoi(argv[i+1]), raw = 1;
+      else if (!strcmp(argv[i], "-c"))
+         in_fmt.channels = atoi(argv[i+1]), raw = 1;
+      else
+         usage();
+   }
+   if (i != argc-3)
+      usage();
+
+   in_fd = open(argv[argc-3], O_RDONLY);
+   if (in_fd < 0 || fstat(in_fd, &sb) || sb.st_size == 0)
+   {
+      perror(argv[argc-3]);
+      return 1;
+   }
+   in_map = (unsigned char *)mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, in_fd, 0);
+   if (in_map == MAP_FAILED)
+   {
+      perror("mmap");
+      return 1;
+   }
+#ifdef HAVE_MADVISE
+   madvise(in_map, sb.st_size, MADV_SEQUENTIAL);
+#endif
+   if (raw)
+   {
+      in_offset = 0;
+      in_size = sb.st_size;
+   } else {
+      in_offset = parse_wav(in_map, sb.st_size, &in_fmt, &in_size);
+      if (!in_offset)
+      {
+         fprintf(stderr, "%s: not a supported WAV file\n", argv[argc-3]);
+         return 1;
+      }
+   }
+   if (!in_fmt.rate || !in_fmt.channels)
+      usage();
+   out_fmt = in_fmt;
+   out_fmt.rate = atoi(argv[argc-1]);
+   if (!out_fmt.rate)
+      usage();
+
+   st = speex_resampler_init(in_fmt.channels, in_fmt.rate, out_fmt.rate, quality, &err);
+   if (!st)
+   {
+      fprintf(stderr, "%s\n", speex_resampler_strerror(err));
+      return 1;
+   }
+   speex_resampler_skip_zeros(st);
+   batch = speex_resampler_batch_init(threads, &err);
+   if (!batch)
+   {
+      fprintf(stderr, "%s\n", speex_resampler_strerror(err));
+      return 1;
+   }
+
+   if (in_size / in_fmt.bytes / in_fmt.channels > 0xffffffff)
+   {
+      fprintf(stderr, "input too long\n");
+      return 1;
+   }
+   in_len = in_size / in_fmt.bytes / in_fmt.channels;
+   max_len = (double)in_len * out_fmt.rate / in_fmt.rate + 2;
+   if (max_len > 0xffffffff)
+   {
+      fprintf(stderr, "output too long\n");
+      return 1;
+   }
+   out_len = (spx_uint32_t)max_len;
+   out_offset = raw ? 0 : WAV_HEADER_SIZE;
+   out_size = (size_t)out_len * out_fmt.channels * out_fmt.bytes;
+   map_size = out_offset + out_size;
+
+   out_fd = open(argv[argc-2], O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (out_fd < 0 || ftruncate(out_fd, map_size))
+   {
+      perror(argv[argc-2]);
+      return 1;
+   }
+   out_map = (unsigned char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+   if (out_map == MAP_FAILED)
+   {
+      perror("mmap");
+      return 1;
+   }
+
+   t = now();
+   err = speex_resampler_process_offline(st, batch, in_fmt.format, in_map + in_offset, in_len,
+                                         out_fmt.format, out_map + out_offset, &out_len);
+   t = now() - t;
+   if (err != RESAMPLER_ERR_SUCCESS)
+   {
+      fprintf(stderr, "%s\n", speex_resampler_strerror(err));
+      return 1;
+   }
+   out_size = (size_t)out_len * out_fmt.channels * out_fmt.bytes;
+   if (!raw)
+      write_wav_header(out_map, &out_fmt, out_size);
+   fprintf(stderr, "%u -> %u samples in %.3f s (%.0fx real time)\n", in_len, out_len, t,
+           (double)in_len / in_fmt.rate / t);
+   same = check_serial(st, &in_fmt, in_map + in_offset, in_len, &out_fmt, out_map + out_offset, out_len);
+   if (same != out_len)
+   {
+      fprintf(stderr, "output differs from a serial conversion from sample %u\n", same);
+      return 1;
+   }
+
+   munmap(out_map, map_size);
+   munmap(in_map, sb.st_size);
+   if (ftruncate(out_fd, out_offset + out_size))
+      perror(argv[argc-2]);
+   close(out_fd);
+   close(in_fd);
+   speex_resampler_batch_destroy(batch);
+   speex_resampler_destroy(st);
+   return 0;
+}
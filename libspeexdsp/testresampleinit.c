@@ -0,0 +1,103 @@
+/* Copyright (C) 2026 Xiph.Org Foundation
+
+   File: testresampleinit.c
+   Measures the set-up cost of the resampler
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+   INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+   STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+   POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "speex/speex_resampler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Minimum CPU time spent on each configuration */
+#define MIN_TIME (CLOCKS_PER_SEC/20)
+
+static const spx_uint32_t rates[][2] = {
+   { 8000, 16000}, {16000,  8000}, { 8000, 48000}, {48000,  8000},
+   {16000, 48000}, {48000, 16000}, {44100, 48000}, {48000, 44100},
+   {22050, 96000}, {96000, 44100}, {44100, 44000}
+};
+
+/* Time of a resampler init (and set_phase() when phase is not the default)
+   followed by a destroy, in microseconds. The tables are only shared while
+   a state holds them, so each iteration builds them from scratch. */
+static double time_init(spx_uint32_t in_rate, spx_uint32_t out_rate, int quality, int phase)
+{
+   clock_t start = clock(), now;
+   long n = 0;
+   do {
+      int err;
+      SpeexResamplerState *st = speex_resampler_init(1, in_rate, out_rate, quality, &err);
+      if (!st)
+      {
+         fprintf (stderr, "init failed: %s\n", speex_resampler_strerror(err));
+         exit(1);
+      }
+      if (phase != SPEEX_RESAMPLER_PHASE_LINEAR)
+         speex_resampler_set_phase(st, phase);
+      speex_resampler_destroy(st);
+      n++;
+      now = clock();
+   } while (now - start < MIN_TIME);
+   return 1e6*(now - start)/CLOCKS_PER_SEC/n;
+}
+
+int main(int argc, char **argv)
+{
+   int phase = SPEEX_RESAMPLER_PHASE_LINEAR;
+   unsigned i;
+   int q;
+
+   if (argc > 1 && strcmp(argv[1], "min") == 0)
+      phase = SPEEX_RESAMPLER_PHASE_MINIMUM;
+   else if (argc > 1)
+   {
+      fprintf (stderr, "usage: %s [min]\n", argv[0]);
+      return 1;
+   }
+
+   printf ("init time in us, %s phase\n", phase == SPEEX_RESAMPLER_PHASE_LINEAR ? "linear" : "minimum");
+   printf ("%13s", "");
+   for (q=0;q<=SPEEX_RESAMPLER_QUALITY_MAX;q++)
+      printf (" %7s%-2d", "q", q);
+   printf ("\n");
+   for (i=0;i<sizeof(rates)/sizeof(rates[0]);i++)
+   {
+      printf ("%5u->%-6u", rates[i][0], rates[i][1]);
+      for (q=0;q<=SPEEX_RESAMPLER_QUALITY_MAX;q++)
+         printf (" %9.1f", time_init(rates[i][0], rates[i][1], q, phase));
+      printf ("\n");
+   }
+   return 0;
+}
@@ -0,0 +1,222 @@
+/* Copyright (C) 2026 Xiph.Org Foundation
+
+   File: testresamplesnr.c
+   Measures the accuracy and speed of the resampler on a sine
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   3. The name of the author may not be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+   IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+   OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+   INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+   SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+   HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+   STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+   ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+   POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "speex/speex_resampler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "arch.h"
+
+#if defined(USE_SSE) && !defined(FIXED_POINT)
+#include "resample_sse.h"
+#endif
+
+#if defined(USE_AVX2) && !defined(FIXED_POINT)
+#include "x86cpu.h"
+#include "resample_avx2.h"
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Seconds of input for each configuration, and the fraction (1/MARGIN) of
+   the output left out at both ends of the measurement */
+#define LENGTH 2
+#define MARGIN 4
+
+static const spx_uint32_t rates[][2] = {
+   { 8000, 16000}, {16000,  8000}, {16000, 48000}, {48000, 16000},
+   {44100, 48000}, {48000, 44100}, {96000, 44100}
+};
+
+/* Resamples a sine at about a fifth of the lower rate, and returns the power of
+   what is left once the best fitting sine at that frequency is removed,
+   relative to the power of that sine (in dB). The residual is summed sample
+   by sample rather than taken as the difference of the two powers, which
+   cancels out well before the arithmetic error of the higher qualities. The frequency isn't a simple
+   fraction of the rates, or the aliases would fold back onto the sine. The processing time in
+   microseconds per second of input goes in *usec. */
+static double measure(spx_uint32_t in_rate, spx_uint32_t out_rate, int quality, double *usec)
+{
+   const double freq = .2137*(in_rate < out_rate ? in_rate : out_rate);
+   const spx_uint32_t in_len = LENGTH*in_rate;
+   const spx_uint32_t out_cap = LENGTH*out_rate + 1;
+   spx_uint32_t in_done = 0, out_done = 0, i, from, to;
+   double ss = 0, sc = 0, cc = 0, xs = 0, xc = 0, a, b, sig = 0, err = 0;
+   float *in, *out;
+   clock_t start;
+   SpeexResamplerState *st;
+   int ret;
+
+   st = speex_resampler_init(1, in_rate, out_rate, quality, &ret);
+   if (!st)
+   {
+      fprintf (stderr, "init failed: %s\n", speex_resampler_strerror(ret));
+      exit(1);
+   }
+   speex_resampler_skip_zeros(st);
+   in = malloc(in_len*sizeof(*in));
+   out = malloc(out_cap*sizeof(*out));
+   for (i=0;i<in_len;i++)
+      in[i] = 10000*sin(2*M_PI*freq*i/in_rate);
+
+   start = clock();
+   while (in_done < in_len)
+   {
+      /* 10 ms at a time, like a real-time caller */
+      spx_uint32_t in_chunk = in_rate/100, out_chunk = out_cap - out_done;
+      if (in_chunk > in_len - in_done)
+         in_chunk = in_len - in_done;
+      speex_resampler_process_float(st, 0, in+in_done, &in_chunk, out+out_done, &out_chunk);
+      in_done += in_chunk;
+      out_done += out_chunk;
+   }
+   *usec = 1e6*(clock() - start)/CLOCKS_PER_SEC/LENGTH;
+
+   /* Least-squares fit of a*sin + b*cos, the phase being unknown */
+   from = out_done/MARGIN;
+   to = out_done - out_done/MARGIN;
+   for (i=from;i<to;i++)
+   {
+      double s = sin(2*M_PI*freq*i/out_rate), c = cos(2*M_PI*freq*i/out_rate);
+      ss += s*s; sc += s*c; cc += c*c;
+      xs += out[i]*s; xc += out[i]*c;
+   }
+   a = (xs*cc - xc*sc)/(ss*cc - sc*sc);
+   b = (xc*ss - xs*sc)/(ss*cc - sc*sc);
+   for (i=from;i<to;i++)
+   {
+      double fit = a*sin(2*M_PI*freq*i/out_rate) + b*cos(2*M_PI*freq*i/out_rate);
+      sig += fit*fit;
+      err += (out[i] - fit)*(out[i] - fit);
+   }
+   free(in);
+   free(out);
+   speex_resampler_destroy(st);
+   return 10*log10(err/sig);
+}
+
+#ifdef OVERRIDE_COMPENSATED_PRODUCTS
+#define KERNEL_RUNS 2000
+
+/* Error of the single-precision and compensated inner products of the direct
+   table, relative to the output (in dB), on a windowed sinc and a full-scale
+   noise input. The reference adds up the exact float products in double
+   precision, as the double kernels did. */
+static void compare_kernels(void)
+{
+   static const unsigned int lengths[] = {64, 128, 192, 256};
+   static float a[256], b[256];
+   unsigned int i, j, k;
+   int run;
+
+   printf ("\nproduct error in dB, against a double accumulator\n");
+   printf ("%5s %11s %11s", "taps", "single", "compensated");
+#ifdef USE_AVX2
+   if (speex_cpu_has_avx2())
+      printf (" %11s", "avx2");
+#endif
+   printf ("\n");
+   for (k=0;k<sizeof(lengths)/sizeof(lengths[0]);k++)
+   {
+      const unsigned int len = lengths[k];
+      double ref2 = 0, single2 = 0, comp2 = 0;
+#ifdef USE_AVX2
+      double avx2 = 0;
+#endif
+      srand(k+1);
+      for (run=0;run<KERNEL_RUNS;run++)
+      {
+         double ref = 0, x, e;
+         for (i=0;i<len;i++)
+         {
+            x = M_PI*((double)i - len/2 + (double)rand()/RAND_MAX);
+            b[i] = (x == 0 ? 1 : sin(.9*x)/x)*(.54 - .46*cos(2*M_PI*i/len));
+            a[i] = 32767*(2.*rand()/RAND_MAX - 1);
+         }
+         for (j=0;j<len;j++)
+            ref += (double)a[j]*b[j];
+         ref2 += ref*ref;
+         e = inner_product_single(a, b, len) - ref;
+         single2 += e*e;
+         e = inner_product_compensated(a, b, len) - ref;
+         comp2 += e*e;
+#ifdef USE_AVX2
+         if (speex_cpu_has_avx2())
+         {
+            e = inner_product_compensated_avx2(a, b, len) - ref;
+            avx2 += e*e;
+         }
+#endif
+      }
+      printf ("%5u %11.1f %11.1f", len, 10*log10(single2/ref2), 10*log10(comp2/ref2));
+#ifdef USE_AVX2
+      if (speex_cpu_has_avx2())
+         printf (" %11.1f", 10*log10(avx2/ref2));
+#endif
+      printf ("\n");
+   }
+}
+#endif
+
+int main(void)
+{
+   unsigned i;
+   int q;
+
+   printf ("residual in dB / time in us per second of input\n");
+   printf ("%13s", "");
+   for (q=0;q<=SPEEX_RESAMPLER_QUALITY_MAX;q++)
+      printf (" %11s%-2d", "q", q);
+   printf ("\n");
+   for (i=0;i<sizeof(rates)/sizeof(rates[0]);i++)
+   {
+      printf ("%5u->%-6u", rates[i][0], rates[i][1]);
+      for (q=0;q<=SPEEX_RESAMPLER_QUALITY_MAX;q++)
+      {
+         double usec, snr = measure(rates[i][0], rates[i][1], q, &usec);
+         printf (" %6.1f/%-6.0f", snr, usec);
+      }
+      printf ("\n");
+   }
+#ifdef OVERRIDE_COMPENSATED_PRODUCTS
+   compare_kernels();
+#endif
+   return 0;
+}
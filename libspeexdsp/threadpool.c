@@ -0,0 +1,174 @@
+/* Copyright (C) 2026 Xiph.Org Foundation */
+/**
+   @file threadpool.c
+   @brief Worker threads shared by the echo canceller and the resampler
+*/
+/*
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Xiph.org Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "threadpool.h"
+
+#ifdef USE_PTHREADS
+
+#include <pthread.h>
+#include "os_support.h"
+
+struct PoolThread {
+   SpxThreadPool *pool;
+   pthread_t thread;
+   int id;
+};
+
+struct SpxThreadPool {
+   spx_pool_func func;
+   void *arg;
+   int nb_threads;
+   struct PoolThread *threads;
+   pthread_mutex_t lock;
+   pthread_cond_t start;
+   pthread_cond_t done;
+   unsigned int generation;   /* Counts the calls to spx_pool_run() */
+   int busy;                  /* Workers still in the current call */
+   int quit;
+   int next;
+};
+
+static void *pool_thread(void *arg)
+{
+   struct PoolThread *t = (struct PoolThread *)arg;
+   SpxThreadPool *pool = t->pool;
+   unsigned int generation = 0;
+   pthread_mutex_lock(&pool->lock);
+   for (;;)
+   {
+      while (pool->generation == generation && !pool->quit)
+         pthread_cond_wait(&pool->start, &pool->lock);
+      if (pool->quit)
+         break;
+      generation = pool->generation;
+      pthread_mutex_unlock(&pool->lock);
+      pool->func(pool->arg, t->id);
+      pthread_mutex_lock(&pool->lock);
+      if (--pool->busy == 0)
+         pthread_cond_signal(&pool->done);
+   }
+   pthread_mutex_unlock(&pool->lock);
+   return NULL;
+}
+
+SpxThreadPool *spx_pool_create(int nb_threads, spx_pool_func func, void *arg)
+{
+   SpxThreadPool *pool;
+   if (nb_threads <= 0)
+      return NULL;
+   pool = (SpxThreadPool *)speex_alloc(sizeof(SpxThreadPool));
+   if (!pool)
+      return NULL;
+   pool->threads = (struct PoolThread *)speex_alloc(nb_threads*sizeof(struct PoolThread));
+   if (!pool->threads)
+   {
+      speex_free(pool);
+      return NULL;
+   }
+   pool->func = func;
+   pool->arg = arg;
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->start, NULL);
+   pthread_cond_init(&pool->done, NULL);
+   for (pool->nb_threads=0;pool->nb_threads<nb_threads;pool->nb_threads++)
+   {
+      struct PoolThread *t = &pool->threads[pool->nb_threads];
+      t->pool = pool;
+      t->id = pool->nb_threads+1;
+      if (pthread_create(&t->thread, NULL, pool_thread, t) != 0)
+      {
+         spx_pool_destroy(pool);
+         return NULL;
+      }
+   }
+   return pool;
+}
+
+void spx_pool_destroy(SpxThreadPool *pool)
+{
+   int i;
+   pthread_mutex_lock(&pool->lock);
+   pool->quit = 1;
+   pthread_cond_broadcast(&pool->start);
+   pthread_mutex_unlock(&pool->lock);
+   for (i=0;i<pool->nb_threads;i++)
+      pthread_join(pool->threads[i].thread, NULL);
+   pthread_cond_destroy(&pool->done);
+   pthread_cond_destroy(&pool->start);
+   pthread_mutex_destroy(&pool->lock);
+   speex_free(pool->threads);
+   speex_free(pool);
+}
+
+void spx_pool_run(SpxThreadPool *pool)
+{
+   pthread_mutex_lock(&pool->lock);
+   pool->next = 0;
+   pool->generation++;
+   pool->busy = pool->nb_threads;
+   pthread_cond_broadcast(&pool->start);
+   pthread_mutex_unlock(&pool->lock);
+   pool->func(pool->arg, 0);
+   pthread_mutex_lock(&pool->lock);
+   while (pool->busy)
+      pthread_cond_wait(&pool->done, &pool->lock);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+int spx_pool_next(SpxThreadPool *pool)
+{
+   int i;
+   pthread_mutex_lock(&pool->lock);
+   i = pool->next++;
+   pthread_mutex_unlock(&pool->lock);
+   return i;
+}
+
+void spx_pool_lock(SpxThreadPool *pool)
+{
+   if (pool)
+      pthread_mutex_lock(&pool->lock);
+}
+
+void spx_pool_unlock(SpxThreadPool *pool)
+{
+   if (pool)
+      pthread_mutex_unlock(&pool->lock);
+}
+
+#endif
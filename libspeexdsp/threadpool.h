@@ -0,0 +1,68 @@
+/* Copyright (C) 2026 Xiph.Org Foundation */
+/**
+   @file threadpool.h
+   @brief Worker threads shared by the echo canceller and the resampler
+*/
+/*
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Xiph.org Foundation nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#ifdef USE_PTHREADS
+
+typedef struct SpxThreadPool SpxThreadPool;
+
+/** Work done on every thread of the pool by spx_pool_run(). id is 0 on the
+    calling thread and goes from 1 to the number of workers on the others. */
+typedef void (*spx_pool_func)(void *arg, int id);
+
+/** Starts nb_threads worker threads that wait for spx_pool_run(). Returns
+    NULL if any of them could not be started, leaving none running. */
+SpxThreadPool *spx_pool_create(int nb_threads, spx_pool_func func, void *arg);
+
+/** Stops the workers and frees the pool */
+void spx_pool_destroy(SpxThreadPool *pool);
+
+/** Calls func on the calling thread and on every worker, and returns once
+    all calls have returned */
+void spx_pool_run(SpxThreadPool *pool);
+
+/** Returns 0, 1, 2... to the successive callers during one spx_pool_run(),
+    for handing out the items of the work */
+int spx_pool_next(SpxThreadPool *pool);
+
+/** Guards state that the threads share. Does nothing if pool is NULL,
+    which is when everything runs on the calling thread. */
+void spx_pool_lock(SpxThreadPool *pool);
+void spx_pool_unlock(SpxThreadPool *pool);
+
+#endif
+
+#endif